@@ -0,0 +1,201 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// Expected entropy of the belief after a candidate action and the reading that follows it
+struct ActionScore
+{
+	std::string action;
+	double expectedEntropy = 0.0; // nats, over the 16 possible readings
+	bool evaluated = false; // false when the latency budget ran out first
+};
+
+struct ActionChoice
+{
+	std::string action; // lowest expected entropy
+	double entropy = 0.0; // of the current belief, nats
+	double gain = 0.0; // entropy - expected entropy of action
+	double milliseconds = 0.0;
+	std::vector<ActionScore> scores; // in candidate order
+};
+
+// Picks the next movement command by expected information gain. Each candidate action is
+// predicted on one scratch belief on the same GridMap; the 16 Filter readings are then scored
+// from sums of p and p log p per heading and neighbor signature, one pass over the predicted
+// belief: a reading scales every cell by its LikelihoodTable entry, so
+//   P(reading) = sum L A, H(posterior) = log P - sum L (A log L + B) / P
+// with A = sum p and B = sum p log p of each (heading, signature) group.
+// Candidates run one after another with parallel kernels, so only one extra volume is held;
+// candidates that would start past the budget are skipped, the first one always runs.
+class ActiveLocalizer
+{
+public:
+	static const int OUTCOMES = 16; // wall or none on each side of the robot
+
+private:
+	Environment& m_env;
+	SensorModel m_sm;
+	MovementModel m_mm;
+	std::vector<std::string> m_candidates;
+	std::unique_ptr<Environment> m_scratch; // made on first use
+	std::vector<std::vector<LikelihoodTable>> m_tables; // [reading][heading]
+
+	// sums of one signature group: p and p log p of the unnormalized predicted belief
+	struct GroupSums
+	{
+		double mass = 0.0;
+		double plogp = 0.0;
+	};
+
+public:
+	ActiveLocalizer(Environment& env, const SensorModel& sm = SensorModel(), const MovementModel& mm = MovementModel(),
+		const std::vector<std::string>& candidates = { "Forward", "Turn left", "Turn right" })
+		: m_env(env), m_sm(sm), m_mm(mm), m_candidates(candidates)
+	{
+		for (int o = 0; o < OUTCOMES; o++) m_tables.push_back(env.headingTables(reading(o), sm));
+	}
+
+	// reading o: bit d set = wall on side eDirection d
+	static Filter reading(int o)
+	{
+		Filter f;
+		f.up = (eCellOccupancy)((o >> eDirection::Up) & 1);
+		f.right = (eCellOccupancy)((o >> eDirection::Right) & 1);
+		f.down = (eCellOccupancy)((o >> eDirection::Down) & 1);
+		f.left = (eCellOccupancy)((o >> eDirection::Left) & 1);
+		return f;
+	}
+
+	// best candidate for the Environment's current belief, within about budgetMs
+	ActionChoice choose(double budgetMs)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(budgetMs));
+		const int count = (int)m_candidates.size();
+		if (!m_scratch)
+		{
+			m_scratch.reset(new Environment(m_env.map(), m_env.headings()));
+			m_scratch->setThreadPool(m_env.threadPool());
+		}
+
+		ActionChoice choice;
+		choice.entropy = m_env.entropy();
+		choice.scores.resize(count);
+		for (int c = 0; c < count; c++)
+		{
+			ActionScore& score = choice.scores[c];
+			score.action = m_candidates[c];
+			if (c > 0 && std::chrono::steady_clock::now() > deadline) continue;
+			score.expectedEntropy = expectedEntropy(*m_scratch, m_candidates[c]);
+			score.evaluated = true;
+		}
+
+		for (const ActionScore& score : choice.scores)
+		{
+			if (!score.evaluated) continue;
+			if (choice.action.empty() || choice.entropy - score.expectedEntropy > choice.gain)
+			{
+				choice.action = score.action;
+				choice.gain = choice.entropy - score.expectedEntropy;
+			}
+		}
+		choice.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return choice;
+	}
+
+private:
+	// same commands as OnSendMovement; Forward uses the Environment's own one-cell model
+	BeliefStats predict(Environment& env, const std::string& action) const
+	{
+		if (action == "Forward") return env.moveForward(m_mm);
+		if (action == "Turn left") return env.applyTurn(env.quarterTurnBins(), m_mm);
+		if (action == "Turn right") return env.applyTurn(-env.quarterTurnBins(), m_mm);
+		return BeliefStats();
+	}
+
+	double expectedEntropy(Environment& scratch, const std::string& action) const
+	{
+		scratch.assignBelief(m_env);
+		predict(scratch, action);
+		std::vector<GroupSums> sums = groupSums(scratch);
+
+		double total = 0.0;
+		for (const GroupSums& g : sums) total += g.mass;
+		if (total <= 0.0) return 0.0;
+
+		const int n = scratch.headings();
+		double expected = 0.0;
+		for (int o = 0; o < OUTCOMES; o++)
+		{
+			double z = 0.0, weighted = 0.0;
+			for (int h = 0; h < n; h++)
+			{
+				const LikelihoodTable& t = m_tables[o][h];
+				for (int s = 0; s < SIGNATURE_COUNT; s++)
+				{
+					const GroupSums& g = sums[(size_t)h * SIGNATURE_COUNT + s];
+					if (t.p[s] <= 0.0 || g.mass <= 0.0) continue;
+					z += t.p[s] * g.mass;
+					weighted += t.p[s] * (g.mass * std::log(t.p[s]) + g.plogp);
+				}
+			}
+			if (z <= 0.0) continue; // reading impossible here
+			expected += z / total * (std::log(z) - weighted / z); // P(reading) * H(posterior)
+		}
+		return expected;
+	}
+
+	// [heading][signature] sums over the belief, walls hold 0
+	std::vector<GroupSums> groupSums(Environment& env) const
+	{
+		const int n = env.headings();
+		const uint8_t* sig = env.signatures.data();
+		auto add = [](GroupSums& g, double v)
+		{
+			if (v <= 0.0) return;
+			g.mass += v;
+			g.plogp += v * std::log(v);
+		};
+
+		std::vector<GroupSums> sums((size_t)n * SIGNATURE_COUNT);
+		if (env.isSparse())
+		{
+			for (size_t i : env.activeCells())
+			{
+				size_t k = i % env.planeSize();
+				add(sums[(size_t)env.headingOfPlane((int)(i / env.planeSize())) * SIGNATURE_COUNT + sig[k]], env.data[i]);
+			}
+			return sums;
+		}
+
+		const int bands = env.bandCount();
+		std::vector<GroupSums> partial((size_t)n * bands * SIGNATURE_COUNT);
+		env.forEachBand(n, [&](int h, int yFirst, int yLast)
+		{
+			GroupSums* g = &partial[((size_t)h * bands + (yFirst - 1) / Environment::BAND_ROWS) * SIGNATURE_COUNT];
+			const double* p = env.plane(h);
+			for (size_t k = env.index(0, yFirst), end = env.index(0, yLast + 1); k < end; k++)
+			{
+				if (sig[k] != WALL_SIGNATURE) add(g[sig[k]], p[k]);
+			}
+			return BeliefStats();
+		});
+		for (int h = 0; h < n; h++)
+		{
+			for (int b = 0; b < bands; b++)
+			{
+				for (int s = 0; s < SIGNATURE_COUNT; s++)
+				{
+					const GroupSums& g = partial[((size_t)h * bands + b) * SIGNATURE_COUNT + s];
+					sums[(size_t)h * SIGNATURE_COUNT + s].mass += g.mass;
+					sums[(size_t)h * SIGNATURE_COUNT + s].plogp += g.plogp;
+				}
+			}
+		}
+		return sums;
+	}
+};
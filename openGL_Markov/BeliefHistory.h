@@ -0,0 +1,253 @@
+#pragma once
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// Bounded history of an Environment's normalized belief, one frame per recorded step, for
+// scrubbing through past steps and undo. Probabilities are stored as 16-bit log codes over the
+// free cells. A frame is either a keyframe or the cells whose code moved by more than the
+// tolerance since the previous frame; deltas are taken against the previous frame as it
+// decodes, so the error stays within the tolerance however long the chain. A keyframe every
+// KEYFRAME_INTERVAL frames bounds the deltas a seek replays, and the oldest keyframe with its
+// deltas is dropped when the frames exceed the byte budget.
+class BeliefHistory
+{
+public:
+	typedef uint16_t Code;
+	static const int KEYFRAME_INTERVAL = 16;
+	static constexpr double FLOOR = 1e-12; // probabilities below are stored as 0, as Environment::PRUNE_EPSILON
+	static const int STEPS_PER_NAT = 2048; // code resolution, 0.025% of the probability
+
+private:
+	// one heading: a varint gap in free cells and a code per stored cell, or every code when raw
+	struct Block
+	{
+		bool raw = false;
+		std::vector<uint8_t> bytes;
+	};
+	struct Frame
+	{
+		bool keyframe = false;
+		std::string label;
+		std::vector<Block> blocks; // per heading
+		size_t bytes() const
+		{
+			size_t total = sizeof(Frame) + label.size();
+			for (const Block& b : blocks) total += sizeof(Block) + b.bytes.size();
+			return total;
+		}
+	};
+
+	std::shared_ptr<const GridMap> m_map;
+	int m_headings;
+	ThreadPool* m_pool;
+	size_t m_budget;
+	int m_tolerance; // codes
+	std::deque<Frame> m_frames;
+	int m_firstStep = 0; // step of m_frames.front(), a keyframe
+	size_t m_bytes = 0;
+	int m_sinceKeyframe = 0;
+	std::vector<Code> m_last; // [heading][free cell], the newest frame as it decodes
+	int m_cursor = -1; // step decoded in m_cursorCodes, -1 = none
+	std::vector<Code> m_cursorCodes;
+
+public:
+	// budgetBytes bounds the stored frames; tolerance is in codes, 16 = 0.8% of the probability
+	BeliefHistory(const Environment& env, size_t budgetBytes, int tolerance = 16)
+		: m_map(env.map()), m_headings(env.headings()), m_pool(env.threadPool()), m_budget(budgetBytes), m_tolerance(tolerance)
+	{
+		m_last.assign((size_t)m_headings * cells(), 0);
+	}
+
+	static Code encode(double p)
+	{
+		if (!(p >= FLOOR)) return 0;
+		return (Code)std::min(1.5 + std::log(p / FLOOR) * STEPS_PER_NAT, 65535.0);
+	}
+	static double decode(Code c) { return c == 0 ? 0.0 : FLOOR * std::exp((c - 1) * (1.0 / STEPS_PER_NAT)); }
+
+	bool empty() const { return m_frames.empty(); }
+	int firstStep() const { return m_firstStep; }
+	int lastStep() const { return m_firstStep + (int)m_frames.size() - 1; }
+	const std::string& label(int step) const { return m_frames[step - m_firstStep].label; }
+	size_t bytes() const { return m_bytes; }
+
+	// Stores the Environment's current belief as the next step, returns its number
+	int record(Environment& env, const std::string& label = std::string())
+	{
+		const size_t n = cells();
+		const uint32_t* free = m_map->freeCells.data();
+		const double scale = env.scale();
+		Frame frame;
+		frame.label = label;
+		frame.keyframe = m_frames.empty() || m_sinceKeyframe + 1 >= KEYFRAME_INTERVAL;
+		frame.blocks.resize(m_headings);
+		std::function<void(size_t)> encodeHeading = [&](size_t h)
+		{
+			const double* p = env.plane((int)h);
+			Code* last = &m_last[h * n];
+			Block& b = frame.blocks[h];
+			size_t gap = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				const Code c = encode(p[free[i]] * scale);
+				if (frame.keyframe ? c == 0 : std::abs((int)c - (int)last[i]) <= m_tolerance)
+				{
+					if (frame.keyframe) last[i] = 0;
+					gap++;
+					continue;
+				}
+				putVarint(b.bytes, gap);
+				b.bytes.push_back((uint8_t)c);
+				b.bytes.push_back((uint8_t)(c >> 8));
+				last[i] = c;
+				gap = 0;
+				if (b.bytes.size() >= n * sizeof(Code)) break; // raw is smaller, see below
+			}
+			if (b.bytes.size() < n * sizeof(Code)) return;
+			// every code of the heading as it is now, exact
+			for (size_t i = 0; i < n; i++) last[i] = encode(p[free[i]] * scale);
+			b.raw = true;
+			b.bytes.resize(n * sizeof(Code));
+			memcpy(b.bytes.data(), last, n * sizeof(Code));
+		};
+		if (m_pool) m_pool->parallelFor(m_headings, encodeHeading);
+		else for (int h = 0; h < m_headings; h++) encodeHeading(h);
+
+		bool allRaw = true;
+		for (const Block& b : frame.blocks) allRaw = allRaw && b.raw;
+		frame.keyframe = frame.keyframe || allRaw;
+		m_sinceKeyframe = frame.keyframe ? 0 : m_sinceKeyframe + 1;
+		m_bytes += frame.bytes();
+		m_frames.push_back(std::move(frame));
+		evict();
+		return lastStep();
+	}
+
+	// probability of heading h at (x, y) at a recorded step
+	double probability(int step, int heading, int x, int y)
+	{
+		const int32_t i = m_map->freeIndex[m_map->index(x, y)];
+		if (i < 0 || !seek(step)) return 0.0;
+		return decode(m_cursorCodes[(size_t)heading * cells() + i]);
+	}
+	// [heading][free cell] probabilities at a recorded step, see GridMap::freeCells
+	std::vector<double> belief(int step)
+	{
+		std::vector<double> p;
+		if (!seek(step)) return p;
+		p.resize(m_cursorCodes.size());
+		for (size_t i = 0; i < p.size(); i++) p[i] = decode(m_cursorCodes[i]);
+		return p;
+	}
+
+	// Replaces the Environment's belief by a recorded step, normalized
+	void restore(int step, Environment& env)
+	{
+		if (!seek(step)) return;
+		const size_t n = cells();
+		const uint32_t* free = m_map->freeCells.data();
+		env.resetUniform(); // dense, walls 0
+		for (int h = 0; h < m_headings; h++)
+		{
+			double* p = env.plane(h);
+			const Code* c = &m_cursorCodes[(size_t)h * n];
+			for (size_t i = 0; i < n; i++) p[free[i]] = decode(c[i]);
+		}
+		env.normalize(env.getStats());
+	}
+	// drops the steps after `step`, the next record follows it
+	void truncate(int step)
+	{
+		if (step < m_firstStep || step >= lastStep()) return;
+		seek(step);
+		while (lastStep() > step)
+		{
+			m_bytes -= m_frames.back().bytes();
+			m_frames.pop_back();
+		}
+		m_last = m_cursorCodes;
+		m_sinceKeyframe = 0;
+		for (int s = lastStep(); !m_frames[s - m_firstStep].keyframe; s--) m_sinceKeyframe++;
+	}
+
+private:
+	size_t cells() const { return m_map->freeCells.size(); }
+
+	static void putVarint(std::vector<uint8_t>& bytes, size_t v)
+	{
+		for (; v >= 0x80; v >>= 7) bytes.push_back((uint8_t)(v | 0x80));
+		bytes.push_back((uint8_t)v);
+	}
+	static size_t getVarint(const uint8_t*& p)
+	{
+		size_t v = 0;
+		for (int shift = 0;; shift += 7)
+		{
+			v |= (size_t)(*p & 0x7F) << shift;
+			if (!(*p++ & 0x80)) return v;
+		}
+	}
+
+	// oldest keyframe and its deltas, while over budget and another keyframe follows
+	void evict()
+	{
+		while (m_bytes > m_budget)
+		{
+			size_t next = 1;
+			while (next < m_frames.size() && !m_frames[next].keyframe) next++;
+			if (next >= m_frames.size()) return;
+			for (size_t f = 0; f < next; f++) m_bytes -= m_frames[f].bytes();
+			m_frames.erase(m_frames.begin(), m_frames.begin() + next);
+			m_firstStep += (int)next;
+			if (m_cursor < m_firstStep) m_cursor = -1;
+		}
+	}
+
+	// decodes `step` into m_cursorCodes, going on from the cursor when no keyframe is between
+	bool seek(int step)
+	{
+		if (step < m_firstStep || step > lastStep()) return false;
+		if (step == m_cursor) return true;
+		int from = step;
+		while (!m_frames[from - m_firstStep].keyframe) from--;
+		if (m_cursor >= from && m_cursor < step) from = m_cursor + 1;
+		else m_cursorCodes.assign((size_t)m_headings * cells(), 0);
+
+		const size_t n = cells();
+		for (int s = from; s <= step; s++)
+		{
+			const Frame& frame = m_frames[s - m_firstStep];
+			std::function<void(size_t)> decodeHeading = [&](size_t h)
+			{
+				const Block& b = frame.blocks[h];
+				Code* codes = &m_cursorCodes[h * n];
+				if (b.raw)
+				{
+					memcpy(codes, b.bytes.data(), n * sizeof(Code));
+					return;
+				}
+				if (frame.keyframe) std::fill(codes, codes + n, 0);
+				const uint8_t* p = b.bytes.data();
+				const uint8_t* end = p + b.bytes.size();
+				for (size_t i = 0; p < end; i++)
+				{
+					i += getVarint(p);
+					codes[i] = (Code)(p[0] | p[1] << 8);
+					p += 2;
+				}
+			};
+			if (m_pool) m_pool->parallelFor(m_headings, decodeHeading);
+			else for (int h = 0; h < m_headings; h++) decodeHeading(h);
+		}
+		m_cursor = step;
+		return true;
+	}
+};
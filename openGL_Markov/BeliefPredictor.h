@@ -0,0 +1,227 @@
+#pragma once
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "MotionOperator.h"
+
+
+// What-if queries on the motion model, without touching the live belief.
+// A belief here is one vector over (heading, free cell) pairs, index = h * freeCells + i.
+// Operators for whole action sequences are composed once and cached; k forward moves are
+// composed from cached powers Forward^(2^i) by repeated squaring. Composed operators and
+// powers share one least recently used cache of budgetBytes; they are handed out by
+// shared_ptr, so an evicted operator lives on while a caller holds it.
+class BeliefPredictor
+{
+public:
+	typedef std::shared_ptr<const TransitionMatrix> Operator;
+
+private:
+	struct Cached
+	{
+		Operator op;
+		size_t bytes = 0;
+		std::list<std::string>::iterator lru;
+	};
+
+	Environment& m_env;
+	MovementModel m_turnModel;
+	int m_free = 0; // free cells per heading
+	size_t m_budget;
+	std::map<std::string, TransitionMatrix> m_actions; // single actions, always kept
+	std::map<std::string, Cached> m_cache; // composed operators and powers of two, by key
+	std::list<std::string> m_lru; // keys of m_cache, most recently used first
+	size_t m_cachedBytes = 0;
+public:
+	// forward = motion noise of "Forward", turn = turn model of "Turn left" / "Turn right"
+	BeliefPredictor(Environment& env, const MotionNoise& forward, const MovementModel& turn, size_t budgetBytes)
+		: m_env(env), m_turnModel(turn), m_budget(budgetBytes)
+	{
+		m_free = (int)env.freeCells.size();
+		m_actions["Forward"] = forwardOperator(MotionOperator(env, forward));
+		m_actions["Turn left"] = turnOperator(env.quarterTurnBins());
+		m_actions["Turn right"] = turnOperator(-env.quarterTurnBins());
+	}
+
+	int size() const { return m_env.headings() * m_free; }
+	size_t cachedBytes() const { return m_cachedBytes; }
+	size_t cachedOperators() const { return m_cache.size(); }
+
+	const TransitionMatrix& action(const std::string& name) const { return m_actions.at(name); }
+
+	// Forward^k
+	Operator forwardPower(int k)
+	{
+		if (k > 0 && (k & (k - 1)) == 0)
+		{
+			int i = 0;
+			while ((1 << i) < k) i++;
+			return power(i);
+		}
+		const std::string key = "Forward^" + std::to_string(k);
+		if (Operator op = cached(key)) return op;
+
+		TransitionMatrix result = identity();
+		for (int i = 0; (k >> i) > 0; i++)
+		{
+			if ((k >> i) & 1) result = *power(i) * result;
+		}
+		return store(key, std::move(result));
+	}
+
+	// operator of the actions applied in order, runs of "Forward" use forwardPower
+	Operator sequence(const std::vector<std::string>& actions)
+	{
+		std::string key;
+		for (const std::string& a : actions) key += a + ";";
+		if (Operator op = cached(key)) return op;
+
+		TransitionMatrix result = identity();
+		for (size_t i = 0; i < actions.size();)
+		{
+			size_t run = 0;
+			while (i + run < actions.size() && actions[i + run] == "Forward") run++;
+			if (run > 0)
+			{
+				result = *forwardPower((int)run) * result;
+				i += run;
+			}
+			else result = action(actions[i++]) * result;
+		}
+		return store(key, std::move(result));
+	}
+
+	// normalized copy of the live belief
+	Eigen::VectorXd snapshot()
+	{
+		Eigen::VectorXd b(size());
+		for (int h = 0; h < m_env.headings(); h++)
+		{
+			const double* p = m_env.plane(h);
+			for (int i = 0; i < m_free; i++) b[h * m_free + i] = p[m_env.freeCells[i]] * m_env.scale();
+		}
+		return b;
+	}
+
+	// op * belief, normalized
+	Eigen::VectorXd predict(const Eigen::VectorXd& belief, const TransitionMatrix& op) const
+	{
+		Eigen::VectorXd result = op * belief;
+		double sum = result.sum();
+		if (sum > 0.0) result /= sum;
+		return result;
+	}
+
+	// one prediction per operator, run on the Environment's thread pool
+	std::vector<Eigen::VectorXd> predictBatch(const Eigen::VectorXd& belief, const std::vector<const TransitionMatrix*>& ops) const
+	{
+		std::vector<Eigen::VectorXd> results(ops.size());
+		std::function<void(size_t)> task = [&](size_t q) { results[q] = predict(belief, *ops[q]); };
+		if (m_env.threadPool()) m_env.threadPool()->parallelFor(ops.size(), task);
+		else for (size_t q = 0; q < ops.size(); q++) task(q);
+		return results;
+	}
+
+	// probability of heading h at (x, y) in a belief vector
+	double probability(const Eigen::VectorXd& belief, int h, int x, int y) const
+	{
+		const int32_t i = m_env.freeIndex[m_env.index(x, y)];
+		return i < 0 ? 0.0 : belief[(size_t)h * m_free + i];
+	}
+
+	// probability of each free cell, summed over headings
+	Eigen::VectorXd positionMarginal(const Eigen::VectorXd& belief) const
+	{
+		Eigen::VectorXd m = Eigen::VectorXd::Zero(m_free);
+		for (int h = 0; h < m_env.headings(); h++) m += belief.segment(h * m_free, m_free);
+		return m;
+	}
+
+private:
+	// Forward^(2^i), squared from Forward^(2^(i-1))
+	Operator power(int i)
+	{
+		const std::string key = "Forward^" + std::to_string(1 << i);
+		if (Operator op = cached(key)) return op;
+		if (i == 0) return store(key, TransitionMatrix(m_actions["Forward"]));
+		Operator half = power(i - 1);
+		return store(key, *half * *half);
+	}
+
+	// nullptr when not cached, else marked as most recently used
+	Operator cached(const std::string& key)
+	{
+		auto it = m_cache.find(key);
+		if (it == m_cache.end()) return nullptr;
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+		return it->second.op;
+	}
+	// adds an operator, then drops the least recently used ones while over budget; the new one stays
+	Operator store(const std::string& key, TransitionMatrix&& m)
+	{
+		Cached& c = m_cache[key];
+		if (c.op) return c.op;
+		c.op = std::make_shared<const TransitionMatrix>(std::move(m));
+		c.bytes = (size_t)c.op->nonZeros() * (sizeof(double) + sizeof(int32_t)) + (size_t)(c.op->outerSize() + 1) * sizeof(int32_t);
+		m_lru.push_front(key);
+		c.lru = m_lru.begin();
+		m_cachedBytes += c.bytes;
+		Operator op = c.op;
+		while (m_cachedBytes > m_budget && m_lru.size() > 1)
+		{
+			auto last = m_cache.find(m_lru.back());
+			m_cachedBytes -= last->second.bytes;
+			m_cache.erase(last);
+			m_lru.pop_back();
+		}
+		return op;
+	}
+
+	TransitionMatrix identity() const
+	{
+		TransitionMatrix I(size(), size());
+		I.setIdentity();
+		return I;
+	}
+
+	// block diagonal of the per-heading operators
+	TransitionMatrix forwardOperator(const MotionOperator& op) const
+	{
+		std::vector<Eigen::Triplet<double, int32_t>> triplets;
+		for (int h = 0; h < (int)op.headings.size(); h++)
+		{
+			const TransitionMatrix& T = op.headings[h];
+			for (int r = 0; r < T.outerSize(); r++)
+			{
+				for (TransitionMatrix::InnerIterator it(T, r); it; ++it)
+				{
+					triplets.emplace_back(h * m_free + r, h * m_free + (int)it.col(), it.value());
+				}
+			}
+		}
+		TransitionMatrix result(size(), size());
+		result.setFromTriplets(triplets.begin(), triplets.end());
+		return result;
+	}
+
+	// same as Environment::applyTurn: new[h] = old[h] * pFail + old[h + bins] * pSuccess
+	TransitionMatrix turnOperator(int bins) const
+	{
+		const int n = m_env.headings();
+		const int shift = ((bins % n) + n) % n;
+		std::vector<Eigen::Triplet<double, int32_t>> triplets;
+		for (int h = 0; h < n; h++)
+		{
+			for (int i = 0; i < m_free; i++)
+			{
+				triplets.emplace_back(h * m_free + i, h * m_free + i, m_turnModel.pFail);
+				triplets.emplace_back(h * m_free + i, ((h + shift) % n) * m_free + i, m_turnModel.pSuccess);
+			}
+		}
+		TransitionMatrix result(size(), size());
+		result.setFromTriplets(triplets.begin(), triplets.end());
+		return result;
+	}
+};
@@ -0,0 +1,399 @@
+#pragma once
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// Cell encodings for CompactBelief. A plane stores value = decode(cell) * 2^exponent,
+// decode is monotonic and the plane maximum decodes to at most 1.
+
+// A Weight is a factor in the codec's own domain, made once per update by weight().
+
+// float32 log-probability: the sensor update is an add and there is no underflow
+struct LogFloat32Codec
+{
+	typedef float Cell;
+	typedef float Weight; // log(factor)
+	static Cell zero() { return -std::numeric_limits<float>::infinity(); }
+	static double decode(Cell c) { return std::exp((double)c); }
+	static Cell encode(double v) { return v > 0.0 ? (float)std::log(v) : zero(); }
+	static Weight weight(double factor) { return encode(factor); }
+	// encode(decode(c) * factor)
+	static Cell scale(Cell c, Weight w) { return c + w; }
+	// encode(decode(a) * wa + decode(b) * wb) by log-sum-exp, without leaving the log domain
+	static Cell blend(Cell a, Weight wa, Cell b, Weight wb)
+	{
+		const double x = (double)a + wa;
+		const double y = (double)b + wb;
+		const double hi = std::max(x, y);
+		const double lo = std::min(x, y);
+		if (lo == zero()) return (Cell)hi;
+		return (Cell)(hi + std::log1p(std::exp(lo - hi)));
+	}
+};
+
+// uint16 fraction of the plane maximum
+struct Quantized16Codec
+{
+	typedef uint16_t Cell;
+	typedef double Weight; // factor
+	static const int LEVELS = 65535;
+	static Cell zero() { return 0; }
+	static double decode(Cell c) { return c * (1.0 / LEVELS); }
+	static Cell encode(double v) { return (Cell)(std::min(v, 1.0) * LEVELS + 0.5); }
+	static Weight weight(double factor) { return factor; }
+	static Cell scale(Cell c, Weight w) { return (Cell)std::min(c * w + 0.5, (double)LEVELS); }
+	static Cell blend(Cell a, Weight wa, Cell b, Weight wb) { return (Cell)std::min(a * wa + b * wb + 0.5, (double)LEVELS); }
+};
+
+
+// Belief volume in a compact cell type, for maps that do not fit as doubles.
+// Keeps an Environment without a belief volume for the map, heading bins and thread pool,
+// so no double volume is allocated; load() and store() convert from and to the belief of
+// an Environment on the same map. Every kernel returns the sum and maximum of the values
+// like the Environment kernels do; cells are converted to probabilities only by
+// probability() and store(). Always dense.
+template <typename Codec>
+class CompactBelief
+{
+public:
+	typedef typename Codec::Cell Cell;
+	typedef typename Codec::Weight Weight;
+private:
+	Environment m_env; // map, headings and pool only
+	AlignedBuffer<Cell> m_data; // [plane][row][col]
+	std::vector<int> m_exponent; // per physical plane
+	std::vector<double> m_planeMax; // per physical plane, = largest value in it
+	int m_headingOffset = 0; // heading h is stored in plane (h + m_headingOffset) % headings
+	AlignedBuffer<Cell> m_halo; // see Environment::applyMovement
+	double m_normalizer = 0.0; // sum of all values, from the last kernel
+
+	// largest cell and decoded sum of one band of one plane
+	struct BandStats
+	{
+		Cell max = Codec::zero();
+		double sum = 0.0;
+		void add(Cell c)
+		{
+			if (c > max) max = c;
+			sum += Codec::decode(c);
+		}
+	};
+
+public:
+	// uniform belief over every free cell and heading, serial without a pool
+	CompactBelief(std::shared_ptr<const GridMap> map, int headings, ThreadPool* pool = nullptr) : m_env(map, headings, false)
+	{
+		m_env.setThreadPool(pool);
+		resetUniform();
+	}
+
+	size_t bytes() const { return m_data.size() * sizeof(Cell); }
+	Cell* plane(int heading) { return m_data.data() + (size_t)physical(heading) * m_env.planeSize(); }
+	int physical(int heading) const { return (heading + m_headingOffset) % m_env.headings(); }
+
+	// uniform belief over every free cell and heading, as after loading the map
+	void resetUniform()
+	{
+		const int n = m_env.headings();
+		const size_t empty = m_env.map()->emptyCount();
+		const double value = empty > 0 ? 1.0 / empty : 0.0;
+		const int exponent = exponentFor(value, 0);
+		const Cell free = Codec::encode(std::ldexp(value, -exponent));
+		m_data.resize(n * m_env.planeSize());
+		for (size_t k = 0; k < m_env.planeSize(); k++) m_data[k] = m_env.signatures[k] != WALL_SIGNATURE ? free : Codec::zero();
+		for (int h = 1; h < n; h++) std::copy(m_data.data(), m_data.data() + m_env.planeSize(), m_data.data() + h * m_env.planeSize());
+		m_exponent.assign(n, exponent);
+		m_planeMax.assign(n, value);
+		m_headingOffset = 0;
+		m_normalizer = n * std::ldexp(Codec::decode(free) * empty, exponent);
+	}
+	// encodes the normalized belief of an Environment on the same map and headings
+	void load(Environment& env)
+	{
+		const int n = env.headings();
+		m_data.resize(n * env.planeSize());
+		m_exponent.assign(n, 0);
+		m_planeMax.assign(n, 0.0);
+		m_headingOffset = 0;
+		m_normalizer = 0.0;
+		for (int h = 0; h < n; h++)
+		{
+			const double* src = env.plane(h);
+			double max = 0.0;
+			for (size_t k = 0; k < env.planeSize(); k++) max = std::max(max, src[k] * env.scale());
+			m_exponent[h] = exponentFor(max, 0);
+			const double toCell = std::ldexp(env.scale(), -m_exponent[h]);
+			Cell* dst = m_data.data() + h * env.planeSize();
+			double sum = 0.0;
+			for (size_t k = 0; k < env.planeSize(); k++)
+			{
+				dst[k] = Codec::encode(src[k] * toCell);
+				sum += Codec::decode(dst[k]);
+			}
+			m_planeMax[h] = max;
+			m_normalizer += std::ldexp(sum, m_exponent[h]);
+		}
+	}
+	// decodes into the Environment's belief, normalized
+	void store(Environment& env)
+	{
+		const double z = normalizer();
+		for (int h = 0; h < env.headings(); h++)
+		{
+			const Cell* src = plane(h);
+			const double toValue = std::ldexp(1.0, m_exponent[physical(h)]) / z;
+			double* dst = env.plane(h);
+			for (size_t k = 0; k < env.planeSize(); k++) dst[k] = Codec::decode(src[k]) * toValue;
+		}
+		env.normalize(env.getStats());
+	}
+
+	// sum of all values
+	double normalizer() const { return m_normalizer; }
+	double probability(int heading, int x, int y)
+	{
+		if (m_normalizer <= 0.0) return 0.0;
+		return std::ldexp(Codec::decode(plane(heading)[m_env.index(x, y)]), m_exponent[physical(heading)]) / m_normalizer;
+	}
+	// sum and max of the values, as returned by the last kernel
+	BeliefStats getStats() const
+	{
+		BeliefStats stats;
+		stats.sum = m_normalizer;
+		stats.max = *std::max_element(m_planeMax.begin(), m_planeMax.end());
+		return stats;
+	}
+	// Stats of the normalized belief. The values keep their own exponents, so only the
+	// stats are scaled (see Environment::normalize).
+	BeliefStats normalize(const BeliefStats& stats)
+	{
+		if (stats.sum <= 0.0) return BeliefStats();
+		BeliefStats result;
+		result.sum = 1.0;
+		result.max = stats.max / stats.sum;
+		return result;
+	}
+
+	BeliefStats applyFilter(Filter f, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = m_env.headingTables(f, sm);
+		return applyFilter(tables.data());
+	}
+	// readings at one pose, see Environment::applyFilters
+	BeliefStats applyFilters(const std::vector<Filter>& readings, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = m_env.headingTables(readings, sm);
+		return applyFilter(tables.data());
+	}
+	// sensor update, tables[h] for heading h: one scale per cell, an add in the log domain
+	BeliefStats applyFilter(const LikelihoodTable* tables)
+	{
+		const int n = m_env.headings();
+		std::vector<std::vector<Weight>> weight(n, std::vector<Weight>(SIGNATURE_COUNT + 1));
+		std::vector<int> exponentIn(n);
+		for (int h = 0; h < n; h++)
+		{
+			const int q = physical(h);
+			double tableMax = *std::max_element(tables[h].p, tables[h].p + SIGNATURE_COUNT + 1);
+			exponentIn[h] = m_exponent[q];
+			m_exponent[q] = exponentFor(m_planeMax[q] * tableMax, m_exponent[q]);
+			for (int s = 0; s <= SIGNATURE_COUNT; s++) weight[h][s] = Codec::weight(std::ldexp(tables[h].p[s], exponentIn[h] - m_exponent[q]));
+		}
+
+		return finishUpdate(forEachBandStats([&](int h, int yFirst, int yLast)
+		{
+			Cell* p = plane(h);
+			const uint8_t* sig = m_env.signatures.data();
+			BandStats stats;
+			for (size_t k = m_env.index(0, yFirst), end = m_env.index(0, yLast + 1); k < end; k++)
+			{
+				p[k] = Codec::scale(p[k], weight[h][sig[k]]);
+				stats.add(p[k]);
+			}
+			return stats;
+		}));
+	}
+
+	BeliefStats moveForward(MovementModel mm)
+	{
+		std::vector<CellOffset> sources(m_env.headings());
+		for (int h = 0; h < m_env.headings(); h++) sources[h] = m_env.forwardSource(h);
+		return applyMovement(sources.data(), mm);
+	}
+	// every heading h moves from sources[h], in place like Environment::applyMovement
+	BeliefStats applyMovement(const CellOffset* sources, MovementModel mm)
+	{
+		const int n = m_env.headings();
+		const int bands = m_env.bandCount();
+		const int stride = m_env.stride();
+		const int height = m_env.height();
+		const int width = m_env.width();
+		std::vector<double> toNew(n);
+		for (int h = 0; h < n; h++)
+		{
+			const int q = physical(h);
+			int exponentOut = exponentFor(m_planeMax[q] * (mm.pFail + mm.pSuccess), m_exponent[q]);
+			toNew[h] = std::ldexp(1.0, m_exponent[q] - exponentOut);
+			m_exponent[q] = exponentOut;
+		}
+
+		m_halo.resize((size_t)n * bands * stride);
+		for (int h = 0; h < n; h++)
+		{
+			int dy = sources[h].dy;
+			if (dy == 0) continue;
+			for (int b = 0; b < bands; b++)
+			{
+				int y = dy > 0 ? std::min((b + 1) * Environment::BAND_ROWS, height) + 1 : b * Environment::BAND_ROWS;
+				memcpy(&m_halo[((size_t)h * bands + b) * stride], plane(h) + m_env.index(0, y), stride * sizeof(Cell));
+			}
+		}
+
+		return finishUpdate(forEachBandStats([&](int h, int yFirst, int yLast)
+		{
+			const int dx = sources[h].dx;
+			const int dy = sources[h].dy;
+			const Cell* halo = &m_halo[((size_t)h * bands + (yFirst - 1) / Environment::BAND_ROWS) * stride];
+			const Weight stay = Codec::weight(mm.pFail * toNew[h]);
+			const Weight move = Codec::weight(mm.pSuccess * toNew[h]);
+
+			BandStats stats;
+			Cell* p = plane(h);
+			const int y0 = dy < 0 ? yLast : yFirst;
+			const int yStep = dy < 0 ? -1 : 1;
+			const int x0 = dx < 0 ? width : 1;
+			const int xStep = dx < 0 ? -1 : 1;
+			for (int y = y0; y >= yFirst && y <= yLast; y += yStep)
+			{
+				Cell* row = p + m_env.index(0, y);
+				const uint64_t* walls = m_env.rowWalls(y);
+				const uint64_t* srcWalls = m_env.rowWalls(y + dy);
+				const Cell* srcRow = (y + dy < yFirst || y + dy > yLast) ? halo : p + m_env.index(0, y + dy);
+				for (int i = 0, x = x0; i < width; i++, x += xStep)
+				{
+					if (Environment::isWallBit(walls, x)) continue;
+
+					if (Environment::isWallBit(srcWalls, x + dx)) row[x] = Codec::scale(row[x], stay);
+					else row[x] = Codec::blend(row[x], stay, srcRow[x + dx], move);
+					stats.add(row[x]);
+				}
+			}
+			return stats;
+		}));
+	}
+
+	// see HeadingTurn; the blend weights also move each plane to its new exponent
+	BeliefStats applyTurn(int bins, MovementModel mm)
+	{
+		const int n = m_env.headings();
+		const HeadingTurn turn(n, bins, mm);
+		m_headingOffset = turn.offset(m_headingOffset);
+		if (!turn.blends()) return getStats();
+
+		std::vector<int> exponentIn = m_exponent;
+		std::vector<double> planeMaxIn = m_planeMax;
+		std::vector<Weight> fromSelf(n), fromOther(n);
+		for (int q = 0; q < n; q++)
+		{
+			const int o = turn.from(q);
+			m_exponent[q] = exponentFor(turn.blend(planeMaxIn[q], planeMaxIn[o]), exponentIn[q]);
+			fromSelf[q] = Codec::weight(std::ldexp(turn.pSuccess, exponentIn[q] - m_exponent[q]));
+			fromOther[q] = Codec::weight(std::ldexp(turn.pFail, exponentIn[o] - m_exponent[q]));
+		}
+
+		const int bands = m_env.bandCount();
+		std::vector<BandStats> partial((size_t)bands * n); // [band][physical plane]
+		m_env.forEachBand(1, [&](int, int yFirst, int yLast) // all planes per cell
+		{
+			std::vector<Cell> old(n);
+			BandStats* stats = &partial[(size_t)(yFirst - 1) / Environment::BAND_ROWS * n];
+			const size_t planeSize = m_env.planeSize();
+			for (size_t k = m_env.index(0, yFirst), end = m_env.index(0, yLast + 1); k < end; k++)
+			{
+				for (int q = 0; q < n; q++) old[q] = m_data[q * planeSize + k];
+				for (int q = 0; q < n; q++)
+				{
+					Cell c = Codec::blend(old[q], fromSelf[q], old[turn.from(q)], fromOther[q]);
+					m_data[q * planeSize + k] = c;
+					stats[q].add(c);
+				}
+			}
+			return BeliefStats();
+		});
+		return finishUpdate(combine(partial, bands));
+	}
+
+private:
+	// smallest exponent e with value <= 2^e, `fallback` for an empty plane
+	static int exponentFor(double value, int fallback)
+	{
+		if (!(value > 0.0)) return fallback;
+		int e = 0;
+		std::frexp(value, &e);
+		return e;
+	}
+
+	// runs fn(h, yFirst, yLast) -> BandStats of the band for every logical heading h
+	template <typename F>
+	std::vector<BeliefStats> forEachBandStats(F fn)
+	{
+		const int n = m_env.headings();
+		const int bands = m_env.bandCount();
+		std::vector<BandStats> partial((size_t)bands * n); // [band][physical plane]
+		std::function<void(size_t)> task = [&](size_t t)
+		{
+			const int h = (int)(t / bands);
+			const int b = (int)(t % bands);
+			int yFirst = 1 + b * Environment::BAND_ROWS;
+			int yLast = std::min(yFirst + Environment::BAND_ROWS - 1, m_env.height());
+			partial[(size_t)b * n + physical(h)] = fn(h, yFirst, yLast);
+		};
+		if (m_env.threadPool()) m_env.threadPool()->parallelFor(partial.size(), task);
+		else for (size_t t = 0; t < partial.size(); t++) task(t);
+		return combine(partial, bands);
+	}
+	// decoded max and sum per physical plane from [band][physical plane], summed in band order
+	std::vector<BeliefStats> combine(const std::vector<BandStats>& partial, int bands) const
+	{
+		const int n = m_env.headings();
+		std::vector<BeliefStats> planes(n);
+		for (int b = 0; b < bands; b++)
+		{
+			for (int q = 0; q < n; q++)
+			{
+				const BandStats& p = partial[(size_t)b * n + q];
+				planes[q].max = std::max(planes[q].max, Codec::decode(p.max));
+				planes[q].sum += p.sum;
+			}
+		}
+		return planes;
+	}
+
+	// takes the stats of every physical plane, in units of its exponent
+	BeliefStats finishUpdate(const std::vector<BeliefStats>& planes)
+	{
+		m_normalizer = 0.0;
+		for (int q = 0; q < (int)planes.size(); q++)
+		{
+			m_planeMax[q] = std::ldexp(planes[q].max, m_exponent[q]);
+			m_normalizer += std::ldexp(planes[q].sum, m_exponent[q]);
+		}
+		return finishExponents();
+	}
+	// keeps the largest plane maximum near 1 so values stay in double range when decoded
+	BeliefStats finishExponents()
+	{
+		double max = *std::max_element(m_planeMax.begin(), m_planeMax.end());
+		int shift = exponentFor(max, 0);
+		for (size_t q = 0; q < m_exponent.size(); q++)
+		{
+			m_exponent[q] -= shift;
+			m_planeMax[q] = std::ldexp(m_planeMax[q], -shift);
+		}
+		m_normalizer = std::ldexp(m_normalizer, -shift);
+		return getStats();
+	}
+};
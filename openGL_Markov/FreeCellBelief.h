@@ -0,0 +1,213 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include "MotionOperator.h"
+
+
+// Belief over the free cells only, [heading][free cell] in Environment::freeCells order.
+// Walls take no memory and no branches: the sensor update reads one signature byte per cell
+// and motion gathers through the CSR rows of a MotionOperator (RowMajor, one row per free cell).
+// Keeps an Environment without a belief volume for the map, heading bins, pool and operators;
+// load() and store() convert from and to the belief of an Environment on the same map.
+// Normalization is lazy like Environment::normalize. Always dense.
+class FreeCellBelief
+{
+public:
+	static const int ROW_CHUNK = 32768; // cells per parallel task
+
+private:
+	Environment m_env; // map, headings and pool only
+	int m_free = 0;
+	std::vector<uint8_t> m_signature; // per free cell
+	AlignedBuffer<double> m_data; // [plane][free cell]
+	AlignedBuffer<double> m_next; // motion output, swapped with m_data
+	int m_headingOffset = 0; // heading h is stored in plane (h + m_headingOffset) % headings
+	double m_scale = 1.0;
+	BeliefStats m_stats; // of the stored values, at the last normalize()
+	MotionOperatorCache m_operators;
+
+public:
+	// uniform belief over every free cell and heading, serial without a pool
+	FreeCellBelief(std::shared_ptr<const GridMap> map, int headings, ThreadPool* pool = nullptr) : m_env(map, headings, false)
+	{
+		m_env.setThreadPool(pool);
+		m_free = (int)m_env.freeCells.size();
+		for (uint32_t k : m_env.freeCells) m_signature.push_back(m_env.signatures[k]);
+		resetUniform();
+	}
+
+	int size() const { return m_free; }
+	double* plane(int heading) { return m_data.data() + (size_t)((heading + m_headingOffset) % m_env.headings()) * m_free; }
+	double scale() const { return m_scale; }
+
+	// uniform belief over every free cell and heading, as after loading the map
+	void resetUniform()
+	{
+		m_data.resize((size_t)m_env.headings() * m_free);
+		m_headingOffset = 0;
+		std::fill(m_data.data(), m_data.data() + m_data.size(), m_free > 0 ? 1.0 / m_free : 0.0);
+		m_scale = 1.0 / m_env.headings();
+		m_stats = getStats();
+	}
+	// the belief of an Environment on the same map and headings
+	void load(Environment& env)
+	{
+		m_data.resize((size_t)env.headings() * m_free);
+		m_headingOffset = 0;
+		for (int h = 0; h < env.headings(); h++)
+		{
+			const double* src = env.plane(h);
+			double* dst = plane(h);
+			for (int i = 0; i < m_free; i++) dst[i] = src[env.freeCells[i]];
+		}
+		m_scale = env.scale();
+		m_stats = getStats();
+	}
+	void store(Environment& env)
+	{
+		env.leaveSparse();
+		for (int h = 0; h < env.headings(); h++)
+		{
+			const double* src = plane(h);
+			double* dst = env.plane(h);
+			for (int i = 0; i < m_free; i++) dst[env.freeCells[i]] = src[i] * m_scale;
+		}
+		env.normalize(env.getStats());
+	}
+
+	double probability(int heading, int x, int y)
+	{
+		int i = m_env.freeIndex[m_env.index(x, y)];
+		return i < 0 ? 0.0 : plane(heading)[i] * m_scale;
+	}
+
+	BeliefStats applyFilter(Filter f, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = m_env.headingTables(f, sm);
+		return applyFilter(tables.data());
+	}
+	BeliefStats applyFilters(const std::vector<Filter>& readings, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = m_env.headingTables(readings, sm);
+		return applyFilter(tables.data());
+	}
+	// sensor update, tables[h] for heading h
+	BeliefStats applyFilter(const LikelihoodTable* tables)
+	{
+		return forEachChunk([&](int h, int first, int end)
+		{
+			BeliefStats stats;
+			double* p = plane(h);
+			const uint8_t* sig = m_signature.data();
+			const double* t = tables[h].p;
+			for (int i = first; i < end; i++)
+			{
+				p[i] *= t[sig[i]];
+				stats.add(p[i]);
+			}
+			return stats;
+		});
+	}
+
+	// "Forward" with the same model as Environment::moveForward
+	BeliefStats moveForward(MovementModel mm)
+	{
+		return applyMotion(m_operators.get("Forward", m_env, MotionNoise(mm)));
+	}
+	// new = op.headings[h] * old for every heading
+	BeliefStats applyMotion(const MotionOperator& op)
+	{
+		if (m_next.size() != m_data.size()) m_next.resize(m_data.size());
+		BeliefStats stats = forEachChunk([&](int h, int first, int end)
+		{
+			BeliefStats stats;
+			const TransitionMatrix& T = op.headings[h];
+			const int32_t* row = T.outerIndexPtr();
+			const int32_t* col = T.innerIndexPtr();
+			const double* w = T.valuePtr();
+			const double* src = plane(h);
+			double* dst = m_next.data() + (src - m_data.data());
+			for (int i = first; i < end; i++)
+			{
+				double probValue = 0.0;
+				for (int32_t e = row[i]; e < row[i + 1]; e++) probValue += w[e] * src[col[e]];
+				dst[i] = probValue;
+				stats.add(probValue);
+			}
+			return stats;
+		});
+		m_data.swap(m_next);
+		return stats;
+	}
+
+	// see HeadingTurn, one physical plane per task
+	BeliefStats applyTurn(int bins, MovementModel mm)
+	{
+		const HeadingTurn turn(m_env.headings(), bins, mm);
+		m_headingOffset = turn.offset(m_headingOffset);
+		if (!turn.blends()) return m_stats;
+
+		if (m_next.size() != m_data.size()) m_next.resize(m_data.size());
+		BeliefStats stats = forEachChunk([&](int q, int first, int end)
+		{
+			BeliefStats stats;
+			double* dst = m_next.data() + (size_t)q * m_free;
+			const double* self = m_data.data() + (size_t)q * m_free;
+			const double* other = m_data.data() + (size_t)turn.from(q) * m_free;
+			for (int i = first; i < end; i++)
+			{
+				dst[i] = turn.blend(self[i], other[i]);
+				stats.add(dst[i]);
+			}
+			return stats;
+		});
+		m_data.swap(m_next);
+		return stats;
+	}
+
+	BeliefStats getStats()
+	{
+		return forEachChunk([&](int h, int first, int end)
+		{
+			BeliefStats stats;
+			const double* p = plane(h);
+			for (int i = first; i < end; i++) stats.add(p[i]);
+			return stats;
+		});
+	}
+	// returns the normalized stats
+	BeliefStats normalize(const BeliefStats& stats)
+	{
+		return Environment::normalizeLazily(stats, m_scale, m_stats, [&](double sum)
+		{
+			const double factor = 1.0 / sum;
+			forEachChunk([&](int h, int first, int end)
+			{
+				double* p = plane(h);
+				for (int i = first; i < end; i++) p[i] *= factor;
+				return BeliefStats();
+			});
+		});
+	}
+
+private:
+	// fn(h, first, end) for every chunk of every heading on the Environment's pool, partial stats combined in order
+	template <typename F>
+	BeliefStats forEachChunk(F fn)
+	{
+		const int n = m_env.headings();
+		const int chunks = std::max(1, (m_free + ROW_CHUNK - 1) / ROW_CHUNK);
+		std::vector<BeliefStats> partial((size_t)n * chunks);
+		std::function<void(size_t)> task = [&](size_t t)
+		{
+			const int first = (int)(t % chunks) * ROW_CHUNK;
+			partial[t] = fn((int)(t / chunks), first, std::min(first + ROW_CHUNK, m_free));
+		};
+		if (m_env.threadPool()) m_env.threadPool()->parallelFor(partial.size(), task);
+		else for (size_t t = 0; t < partial.size(); t++) task(t);
+
+		BeliefStats stats;
+		for (const BeliefStats& s : partial) stats.add(s);
+		return stats;
+	}
+};
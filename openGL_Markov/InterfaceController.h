@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <functional>
 #include "MarkovClasses.h"
 
 
@@ -161,35 +162,80 @@ class EnvironmentUIController
 {
 private:
 	HDC m_hDC = 0;
+	double m_cellSize = cellSize; // on-screen cell size for the loaded map
+	int m_width = 0; // map size in cells
+	int m_height = 0;
 public:
-	Environment* envUp; // Direction: UP
-	Environment* envRight; // Direction: RIGHT
-	Environment* envDown; // Direction: DOWN
-	Environment* envLeft; // Direction: LEFT
+	Environment* env = nullptr; // nullptr when an engine without an Environment owns the map
+	std::vector<RenderData> rd; // per heading
+	std::vector<std::string> dirNames;
 
-	Environment* hoveredEnv = nullptr;
+	int hoveredHeading = -1;
 	float maxValue = 0.0f;
+	std::function<double(int, int, int)> probabilityOf; // (heading, x, y) of the belief shown, env's by default
+	std::function<bool(int, int)> isFreeCell; // (x, y) of the map shown, env's by default
+	std::string statusText; // below the cell data, e.g. the history step shown
 
 	TextRenderer* textRenderer = nullptr;
 
 public:
-	EnvironmentUIController(const std::string& mapPath)
+	EnvironmentUIController() {}
+	EnvironmentUIController(const std::string& mapPath, int headings) : EnvironmentUIController(GridMap::load(mapPath), headings) {}
+	EnvironmentUIController(std::shared_ptr<const GridMap> map, int headings)
 	{
-		envUp = new Environment(mapPath, "Direction: ^ UP ^ (0 deg)");
-		envRight = new Environment(mapPath, "Direction: > RIGHT > (90 deg)");
-		envDown = new Environment(mapPath, "Direction: v DOWN v (180 deg)");
-		envLeft = new Environment(mapPath, "Direction: < LEFT < (270 deg)");
+		show(new Environment(map, headings));
+	}
+
+	// shows the belief and map of e
+	void show(Environment* e)
+	{
+		env = e;
+		probabilityOf = [this](int h, int x, int y) { return env->probability(h, x, y); };
+		isFreeCell = [this](int x, int y) { return env->cell(x, y) == eCellOccupancy::Empty; };
+		layout(env->width(), env->height(), env->headings());
+	}
+	// the map with the belief of an engine that keeps its own, no Environment
+	void show(std::shared_ptr<const GridMap> map, int headings, std::function<double(int, int, int)> probability)
+	{
+		env = nullptr;
+		probabilityOf = probability;
+		isFreeCell = [map](int x, int y) { return !map->isWall(x, y); };
+		layout(map->width(), map->height(), headings);
+	}
+	// grids for a width x height map without an Environment, the caller sets probabilityOf and isFreeCell
+	void layout(int width, int height, int headings)
+	{
+		m_width = width;
+		m_height = height;
+		const int n = headings;
+		dirNames.clear();
+		for (int h = 0; h < n; h++) dirNames.push_back(headingName(Environment::headingAngle(n, h)));
+
+		// headings laid out row by row, all of them in the space of a 2x2 layout
+		const int gridCols = (int)std::ceil(std::sqrt((double)n));
+		const double panelSize = gridPanelSize * 2 / gridCols;
+		int mapSize = std::max(width, height);
+		if (mapSize > 0) m_cellSize = std::min(cellSize * 2 / gridCols, panelSize / mapSize);
 
 		const int globalOffsX = 265;
 		const int globalOffsY = cellSize;
-		envUp->rd.posX = globalOffsX;
-		envUp->rd.posY = globalOffsY;
-		envRight->rd.posX = globalOffsX + cellSize * 11;
-		envRight->rd.posY = globalOffsY;
-		envDown->rd.posX = globalOffsX + cellSize * 11;
-		envDown->rd.posY = globalOffsY + cellSize * 11;
-		envLeft->rd.posX = globalOffsX;
-		envLeft->rd.posY = globalOffsY + cellSize * 11;
+		const int gridOffsX = m_cellSize * (width + 1);
+		const int gridOffsY = m_cellSize * (height + 1);
+		rd.assign(n, RenderData());
+		for (int h = 0; h < n; h++)
+		{
+			rd[h].posX = globalOffsX + gridOffsX * (h % gridCols);
+			rd[h].posY = globalOffsY + gridOffsY * (h / gridCols);
+		}
+	}
+	static std::string headingName(double angle)
+	{
+		std::string deg = " (" + std::to_string((int)std::lround(angle)) + " deg)";
+		if (angle == 0.0) return "Direction: ^ UP ^" + deg;
+		if (angle == 90.0) return "Direction: > RIGHT >" + deg;
+		if (angle == 180.0) return "Direction: v DOWN v" + deg;
+		if (angle == 270.0) return "Direction: < LEFT <" + deg;
+		return "Direction:" + deg;
 	}
 	void setHDC(HDC hdc)
 	{
@@ -199,24 +245,33 @@ public:
 
 	void checkHovered(int x, int y)
 	{
-		hoveredEnv = nullptr;
-		for (Environment* e : Environment::allEnvironments)
+		hoveredHeading = -1;
+		for (int h = 0; h < (int)rd.size(); h++)
 		{
-			int cellX = (x - e->rd.posX) / cellSize;
-			int cellY = (y - e->rd.posY) / cellSize;
+			int cellX = (x - rd[h].posX) / m_cellSize;
+			int cellY = (y - rd[h].posY) / m_cellSize;
 
-			if (cellX >= 0 && cellY >= 0 && cellX < SIZE_X && cellY < SIZE_Y)
+			if (x >= rd[h].posX && y >= rd[h].posY && cellX < m_width && cellY < m_height)
 			{
-				hoveredEnv = e;
-				e->rd.hoveredCellX = cellX;
-				e->rd.hoveredCellY = cellY;
+				hoveredHeading = h;
+				rd[h].hoveredCellX = cellX;
+				rd[h].hoveredCellY = cellY;
 				continue; // to prevent bug with double hovered envs
 			}
-			e->rd.hoveredCellX = -1;
-			e->rd.hoveredCellY = -1;
+			rd[h].hoveredCellX = -1;
+			rd[h].hoveredCellY = -1;
 		}
 		return;
 	}
+	// heading and map cell (border included) under the mouse, false when none is
+	bool hoveredPose(int& heading, int& x, int& y) const
+	{
+		if (hoveredHeading < 0) return false;
+		heading = hoveredHeading;
+		x = rd[heading].hoveredCellX + 1;
+		y = rd[heading].hoveredCellY + 1;
+		return true;
+	}
 
 	void renderEnvironments()
 	{
@@ -224,11 +279,12 @@ public:
 		std::string dir = "None";
 		std::string pos = "(None, None)";
 		std::string val = "None";
-		if (hoveredEnv != nullptr)
+		if (hoveredHeading >= 0)
 		{
-			dir = hoveredEnv->dirName;
-			pos = "(" + std::to_string(hoveredEnv->rd.hoveredCellX) + ", " + std::to_string(hoveredEnv->rd.hoveredCellY) + ")";
-			val = std::to_string(hoveredEnv->data[hoveredEnv->rd.hoveredCellX + 1][hoveredEnv->rd.hoveredCellY + 1]);
+			const RenderData& hrd = rd[hoveredHeading];
+			dir = dirNames[hoveredHeading];
+			pos = "(" + std::to_string(hrd.hoveredCellX) + ", " + std::to_string(hrd.hoveredCellY) + ")";
+			val = std::to_string(probabilityOf(hoveredHeading, hrd.hoveredCellX + 1, hrd.hoveredCellY + 1));
 		}
 		pos = "Position: " + pos;
 		val = "Probability: " + val;
@@ -239,21 +295,38 @@ public:
 		textRenderer->renderText(pos.c_str(), 30, 545, false);
 		textRenderer->renderText(val.c_str(), 30, 560, false);
 		drawBorder(20, 480, 200, 100);
-		for (Environment* e : Environment::allEnvironments)
+
+		if (env && env->hasSummary()) // tracked by the Environment's kernels, no extra pass
+		{
+			BeliefCell c = env->mapCell();
+			std::string mapPos = "Position: (" + std::to_string(c.x - 1) + ", " + std::to_string(c.y - 1) + ")";
+			std::string entropy = "Entropy: " + std::to_string(env->trackedEntropy()) + " nats";
+			textRenderer->renderText("MOST LIKELY POSE:", 60, 610, false);
+			textRenderer->renderText(dirNames[c.heading].c_str(), 30, 640, false);
+			textRenderer->renderText(mapPos.c_str(), 30, 655, false);
+			textRenderer->renderText(entropy.c_str(), 30, 670, false);
+			drawBorder(20, 590, 200, 100);
+		}
+		if (!statusText.empty()) textRenderer->renderText(statusText.c_str(), 30, 710, false);
+
+		const int sizeX = m_width;
+		const int sizeY = m_height;
+		const double cs = m_cellSize;
+		for (int h = 0; h < (int)rd.size(); h++)
 		{
 			glPushMatrix();
-			glTranslatef(e->rd.posX, e->rd.posY, 0.0f);
+			glTranslatef(rd[h].posX, rd[h].posY, 0.0f);
 
 			glColor3f(0.1f, 0.1f, 0.1f); // Text color
 
-			textRenderer->renderText(e->dirName.c_str(), cellSize * SIZE_X / 2, -10);
+			textRenderer->renderText(dirNames[h].c_str(), cs * sizeX / 2, -10);
 
-			for (size_t i = 0; i < SIZE_X; i++)
+			for (int i = 0; i < sizeX; i++)
 			{
-				for (size_t j = 0; j < SIZE_Y; j++)
+				for (int j = 0; j < sizeY; j++)
 				{
 					float red = 0; float green = 0;
-					float value = (float)e->data[i + 1][j + 1] / maxValue;
+					float value = (float)(probabilityOf(h, i + 1, j + 1) / maxValue);
 					if (value <= 0.5f) {
 						red = 1.0f;
 						green = value * 2.0f;
@@ -262,16 +335,16 @@ public:
 						red = 1.0f - (value - 0.5f) * 2.0f;
 						green = 1.0f;
 					}
-					if (e->cells[i + 1][j + 1] == eCellOccupancy::Empty)
+					if (isFreeCell(i + 1, j + 1))
 						glColor3f(red, green, 0.0f); // Cell gradient color by its probability value
 					else
 						glColor3f(0.1f, 0.1f, 0.1f); // Wall
 
 					glBegin(GL_QUADS);
-					glVertex2f(i * cellSize, j * cellSize);
-					glVertex2f(i * cellSize + cellSize, j * cellSize);
-					glVertex2f(i * cellSize + cellSize, j * cellSize + cellSize);
-					glVertex2f(i * cellSize, j * cellSize + cellSize);
+					glVertex2f(i * cs, j * cs);
+					glVertex2f(i * cs + cs, j * cs);
+					glVertex2f(i * cs + cs, j * cs + cs);
+					glVertex2f(i * cs, j * cs + cs);
 					glEnd();
 				}
 			}
@@ -279,37 +352,37 @@ public:
 			// Draw grid
 			glColor3f(0.0f, 0.0f, 0.0f); // Black color for grid
 			glBegin(GL_LINES);
-			for (int i = 0; i <= SIZE_X; i++) // horizontal
+			for (int i = 0; i <= sizeY; i++) // horizontal
 			{
-				glVertex2f(0, i * cellSize);
-				glVertex2f(SIZE_X * cellSize, i * cellSize);
+				glVertex2f(0, i * cs);
+				glVertex2f(sizeX * cs, i * cs);
 			}
-			for (int i = 0; i <= SIZE_Y; i++) // vertical
+			for (int i = 0; i <= sizeX; i++) // vertical
 			{
-				glVertex2f(i * cellSize, 0);
-				glVertex2f(i * cellSize, SIZE_Y * cellSize);
+				glVertex2f(i * cs, 0);
+				glVertex2f(i * cs, sizeY * cs);
 			}
 			glEnd();
 
 			// color hovered cell
-			if (e->rd.hoveredCellX >= 0)
+			if (rd[h].hoveredCellX >= 0)
 			{
-				int hoverCellX = e->rd.hoveredCellX;
-				int hoverCellY = e->rd.hoveredCellY;
+				int hoverCellX = rd[h].hoveredCellX;
+				int hoverCellY = rd[h].hoveredCellY;
 				glColor3f(0.8f, 0.8f, 0.8f); // White outline color
 
 				glBegin(GL_LINES);
-				glVertex2f(hoverCellX * cellSize, hoverCellY * cellSize);
-				glVertex2f(hoverCellX * cellSize + cellSize, hoverCellY * cellSize);
+				glVertex2f(hoverCellX * cs, hoverCellY * cs);
+				glVertex2f(hoverCellX * cs + cs, hoverCellY * cs);
 
-				glVertex2f(hoverCellX * cellSize + cellSize, hoverCellY * cellSize);
-				glVertex2f(hoverCellX * cellSize + cellSize, hoverCellY * cellSize + cellSize);
+				glVertex2f(hoverCellX * cs + cs, hoverCellY * cs);
+				glVertex2f(hoverCellX * cs + cs, hoverCellY * cs + cs);
 
-				glVertex2f(hoverCellX * cellSize + cellSize, hoverCellY * cellSize + cellSize);
-				glVertex2f(hoverCellX * cellSize, hoverCellY * cellSize + cellSize);
+				glVertex2f(hoverCellX * cs + cs, hoverCellY * cs + cs);
+				glVertex2f(hoverCellX * cs, hoverCellY * cs + cs);
 
-				glVertex2f(hoverCellX * cellSize, hoverCellY * cellSize + cellSize);
-				glVertex2f(hoverCellX * cellSize, hoverCellY * cellSize);
+				glVertex2f(hoverCellX * cs, hoverCellY * cs + cs);
+				glVertex2f(hoverCellX * cs, hoverCellY * cs);
 				glEnd();
 
 			}
@@ -453,6 +526,7 @@ private:
 	Button* m_bForward;
 	Button* m_bTurnLeft;
 	Button* m_bTurnRight;
+	Button* m_bBest; // action with the most expected information, see ActiveLocalizer
 
 	std::vector<Button*> btns;
 
@@ -476,10 +550,12 @@ public:
 		m_bForward = new Button("Forward", eButtonType::SIMPLE, m_offsX + 60, m_offsY + 25, 60, 50);
 		m_bTurnLeft = new Button("Turn left", eButtonType::SIMPLE, m_offsX + 0, m_offsY + 75, 60, 50);
 		m_bTurnRight = new Button("Turn right", eButtonType::SIMPLE, m_offsX + 120, m_offsY + 75, 60, 50);
+		m_bBest = new Button("Best", eButtonType::SIMPLE, m_offsX + 60, m_offsY + 75, 60, 50);
 
 		btns.push_back(m_bForward);
 		btns.push_back(m_bTurnLeft);
 		btns.push_back(m_bTurnRight);
+		btns.push_back(m_bBest);
 
 	}
 	void setHDC(HDC hdc)
@@ -0,0 +1,261 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// Likelihood-field model of a range reading: the beam endpoint is scored by its distance to
+// the nearest wall, zHit * N(distance; 0, sigmaHit) + zRandom / maxRange. Readings at or
+// beyond maxRange carry no information and are skipped.
+struct LikelihoodFieldModel
+{
+	double maxRange = 40.0; // cells
+	double sigmaHit = 1.0; // cells
+	double zHit = 0.9;
+	double zRandom = 0.1;
+};
+
+// Range scan at a pose: beam b points angles[b] degrees clockwise from the robot's heading and
+// reads ranges[b] cells, measured from the center of the robot's cell
+struct BeamScan
+{
+	std::vector<double> angles;
+	std::vector<double> ranges;
+};
+
+// Likelihood-field sensor on an Environment. The field is built once per map from a Euclidean
+// distance transform of the walls, stored as float log-likelihoods with a margin of maxRange
+// cells around the map (endpoints off the map score zRandom / maxRange). For a scan and heading
+// every beam endpoint is a fixed offset from the cell, so a row of cells sums the field rows
+// at those offsets in contiguous, vectorizable loops; beams ending in the same cell are summed
+// once with their count as weight. The scores of a scan go to a [heading][free cell] table,
+// applied like the LikelihoodTables of Environment::applyFilter in one tracked pass.
+class LikelihoodField
+{
+private:
+	Environment& m_env;
+	LikelihoodFieldModel m_model;
+	int m_margin; // cells of field around the map border
+	int m_fieldStride;
+	std::vector<float> m_field; // log-likelihood relative to a hit on a wall, <= 0
+	int m_free;
+	std::vector<int32_t> m_bandFirst; // first free cell of every band of the Environment, and the end
+	std::vector<float> m_score; // [heading][free cell], log-likelihood of the last scan
+
+public:
+	LikelihoodField(Environment& env, const LikelihoodFieldModel& model = LikelihoodFieldModel()) : m_env(env), m_model(model)
+	{
+		m_margin = (int)std::ceil(model.maxRange) + 1;
+		m_fieldStride = env.stride() + 2 * m_margin;
+		const double hit = m_model.zHit + m_model.zRandom / m_model.maxRange;
+		const float offMap = (float)std::log(m_model.zRandom / m_model.maxRange / hit);
+		m_field.assign((size_t)m_fieldStride * (env.height() + 2 + 2 * m_margin), offMap);
+
+		std::vector<float> computed; // unless the map came with it, see MapArtifact
+		if (env.map()->distance.empty()) computed = distanceTransform(*env.map(), env.threadPool());
+		const float* distance = computed.empty() ? env.map()->distance.data() : computed.data();
+		const double twoSigma2 = 2.0 * m_model.sigmaHit * m_model.sigmaHit;
+		for (int y = 0; y <= env.height() + 1; y++)
+		{
+			float* row = fieldRow(y);
+			for (int x = 0; x < env.stride(); x++)
+			{
+				double d = distance[env.index(x, y)];
+				row[x] = (float)std::log((m_model.zHit * std::exp(-d * d / twoSigma2) + m_model.zRandom / m_model.maxRange) / hit);
+			}
+		}
+
+		m_free = (int)env.freeCells.size();
+		for (int b = 0; b <= env.bandCount(); b++)
+		{
+			size_t k = env.index(0, 1 + b * Environment::BAND_ROWS);
+			m_bandFirst.push_back((int32_t)(std::lower_bound(env.freeCells.begin(), env.freeCells.end(), (uint32_t)k) - env.freeCells.begin()));
+		}
+	}
+
+	const LikelihoodFieldModel& model() const { return m_model; }
+	// field row of map row y (-margin..height + 1 + margin), indexed by map x (-margin..stride - 1 + margin)
+	const float* fieldRow(int y) const { return &m_field[(size_t)(y + m_margin) * m_fieldStride + m_margin]; }
+	float* fieldRow(int y) { return &m_field[(size_t)(y + m_margin) * m_fieldStride + m_margin]; }
+	double logLikelihood(int x, int y) const { return fieldRow(y)[x]; }
+
+	// Euclidean distance of every cell (index(x, y), border included) to the nearest wall,
+	// in cells: the separable linear-time transform of Felzenszwalb and Huttenlocher,
+	// columns first, then rows
+	static std::vector<float> distanceTransform(const GridMap& map, ThreadPool* pool = nullptr)
+	{
+		const int w = map.stride();
+		const int h = map.height() + 2;
+		const double far = 1e20;
+		std::vector<double> squared((size_t)w * h);
+		parallelFor(pool, w, [&](int x)
+		{
+			std::vector<double> f(h), d(h), z(h + 1);
+			std::vector<int> v(h);
+			for (int y = 0; y < h; y++) f[y] = map.isWall(x, y) ? 0.0 : far;
+			distance1D(f.data(), h, d.data(), v.data(), z.data());
+			for (int y = 0; y < h; y++) squared[(size_t)y * w + x] = d[y];
+		});
+		std::vector<float> distance((size_t)w * h);
+		parallelFor(pool, h, [&](int y)
+		{
+			std::vector<double> d(w), z(w + 1);
+			std::vector<int> v(w);
+			distance1D(&squared[(size_t)y * w], w, d.data(), v.data(), z.data());
+			for (int x = 0; x < w; x++) distance[(size_t)y * w + x] = (float)std::sqrt(d[x]);
+		});
+		return distance;
+	}
+
+	// Sensor update of the Environment's belief, unnormalized like Environment::applyFilter,
+	// and tracked like its kernels. Scores are summed as logs and applied relative to the best
+	// score of a cell with belief, so long scans do not underflow.
+	BeliefStats apply(const BeamScan& scan)
+	{
+		const int n = m_env.headings();
+		std::vector<std::vector<std::pair<ptrdiff_t, float>>> endpoints(n); // per heading: field offset, beams
+		for (int h = 0; h < n; h++) endpoints[h] = endpointOffsets(h, scan);
+
+		if (m_env.isSparse())
+		{
+			double best = -HUGE_VAL;
+			std::vector<double> logs;
+			for (size_t i : m_env.activeCells())
+			{
+				size_t k = i % m_env.planeSize();
+				const float* field = fieldRow((int)(k / m_env.stride())) + k % m_env.stride();
+				double sum = 0.0;
+				for (const std::pair<ptrdiff_t, float>& e : endpoints[m_env.headingOfPlane((int)(i / m_env.planeSize()))]) sum += e.second * field[e.first];
+				logs.push_back(sum);
+				best = std::max(best, sum);
+			}
+			return m_env.tracked(1, true, [&](auto collect)
+			{
+				BeliefTracker track = m_env.tracker(0);
+				for (size_t j = 0; j < logs.size(); j++)
+				{
+					const size_t i = m_env.activeCells()[j];
+					m_env.data[i] *= std::exp(logs[j] - best);
+					track.add(collect, m_env.data[i], i);
+				}
+				return m_env.keep(track);
+			});
+		}
+
+		// pass 1: the score table, and the best score with belief of every band
+		const int bands = m_env.bandCount();
+		m_score.resize((size_t)n * m_free);
+		std::vector<double> bandBest((size_t)n * bands, -HUGE_VAL);
+		m_env.forEachBand(n, [&](int h, int yFirst, int yLast)
+		{
+			std::vector<float> row(m_env.stride());
+			const double* p = m_env.plane(h);
+			float* score = &m_score[(size_t)h * m_free];
+			const int band = (yFirst - 1) / Environment::BAND_ROWS;
+			float best = -HUGE_VALF;
+			int32_t i = m_bandFirst[band];
+			for (int y = yFirst; y <= yLast; y++)
+			{
+				scoreRow(y, endpoints[h], row.data());
+				const size_t rowStart = m_env.index(0, y), rowEnd = m_env.index(0, y + 1);
+				for (; i < m_bandFirst[band + 1] && m_env.freeCells[i] < rowEnd; i++)
+				{
+					const uint32_t k = m_env.freeCells[i];
+					score[i] = row[k - rowStart];
+					if (p[k] != 0.0) best = std::max(best, score[i]);
+				}
+			}
+			bandBest[(size_t)h * bands + band] = best;
+			return BeliefStats();
+		});
+		const double best = *std::max_element(bandBest.begin(), bandBest.end());
+		if (best == -HUGE_VAL) return BeliefStats(); // no belief left
+
+		// pass 2: the table applied to the free cells, walls hold 0
+		return m_env.tracked((size_t)n * bands, true, [&](auto collect)
+		{
+			return m_env.forEachBand(n, [&](int h, int yFirst, int yLast)
+			{
+				BeliefTracker track = m_env.bandTracker(h, yFirst, yLast);
+				double* p = m_env.plane(h);
+				const size_t base = p - m_env.data.data();
+				const float* score = &m_score[(size_t)h * m_free];
+				const int band = (yFirst - 1) / Environment::BAND_ROWS;
+				for (int32_t i = m_bandFirst[band]; i < m_bandFirst[band + 1]; i++)
+				{
+					const uint32_t k = m_env.freeCells[i];
+					if (p[k] != 0.0) p[k] *= std::exp((double)score[i] - best); // float would underflow at -87
+					track.add(collect, p[k], base + k, k);
+				}
+				return m_env.keep(track);
+			});
+		});
+	}
+
+private:
+	template <typename F>
+	static void parallelFor(ThreadPool* pool, int count, F fn)
+	{
+		std::function<void(size_t)> task = [&](size_t i) { fn((int)i); };
+		if (pool) pool->parallelFor(count, task);
+		else for (int i = 0; i < count; i++) task(i);
+	}
+
+	// d[q] = min over p of (q - p)^2 + f[p], as the lower envelope of the parabolas rooted at f
+	static void distance1D(const double* f, int n, double* d, int* v, double* z)
+	{
+		int k = 0;
+		v[0] = 0;
+		z[0] = -HUGE_VAL;
+		z[1] = HUGE_VAL;
+		for (int q = 1; q < n; q++)
+		{
+			double s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * (q - v[k]));
+			while (s <= z[k]) // parabola v[k] is hidden by q
+			{
+				k--;
+				s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * (q - v[k]));
+			}
+			k++;
+			v[k] = q;
+			z[k] = s;
+			z[k + 1] = HUGE_VAL;
+		}
+		k = 0;
+		for (int q = 0; q < n; q++)
+		{
+			while (z[k + 1] < q) k++;
+			d[q] = (double)(q - v[k]) * (q - v[k]) + f[v[k]];
+		}
+	}
+
+	// field offsets of the beam endpoints for heading h, beams ending in the same cell merged
+	std::vector<std::pair<ptrdiff_t, float>> endpointOffsets(int h, const BeamScan& scan) const
+	{
+		std::map<ptrdiff_t, float> count;
+		for (size_t b = 0; b < std::min(scan.angles.size(), scan.ranges.size()); b++)
+		{
+			if (scan.ranges[b] >= m_model.maxRange || scan.ranges[b] < 0.0) continue;
+			const double rad = (m_env.headingAngle(h) + scan.angles[b]) * 3.14159265358979323846 / 180.0;
+			const int dx = (int)std::lround(scan.ranges[b] * std::sin(rad));
+			const int dy = (int)std::lround(-scan.ranges[b] * std::cos(rad)); // rows grow downwards
+			count[(ptrdiff_t)dy * m_fieldStride + dx] += 1.0f;
+		}
+		return std::vector<std::pair<ptrdiff_t, float>>(count.begin(), count.end());
+	}
+
+	// score[x] = sum of the field at every endpoint of map row y, x = 1..width
+	void scoreRow(int y, const std::vector<std::pair<ptrdiff_t, float>>& endpoints, float* score) const
+	{
+		const int width = m_env.width();
+		const float* row = fieldRow(y);
+		std::fill(score, score + width + 2, 0.0f);
+		for (const std::pair<ptrdiff_t, float>& e : endpoints)
+		{
+			const float* field = row + e.first;
+			const float weight = e.second;
+			for (int x = 1; x <= width; x++) score[x] += weight * field[x];
+		}
+	}
+};
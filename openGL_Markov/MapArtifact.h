@@ -0,0 +1,434 @@
+#pragma once
+#include <windows.h>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include "MarkovClasses.h"
+#include "LikelihoodField.h"
+
+
+// Fixed layout at the start of an artifact file, little-endian as written
+struct MapArtifactHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headerBytes; // sizeof(MapArtifactHeader)
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+	int32_t rowWords;
+	uint64_t planeSize;
+	uint64_t freeCount;
+	uint64_t sourceBytes; // size and last write time of the map it was compiled from
+	uint64_t sourceTime;
+	uint64_t sections[5][2]; // offset, bytes of each MapArtifact::eSection
+	uint64_t fileBytes;
+	uint64_t contentHash; // of the sections, checked on request
+	uint64_t headerHash; // of everything before it
+};
+static_assert(sizeof(MapArtifactHeader) == 168, "artifact header layout");
+
+// Compiled map: a GridMap with its distance transform in one binary file that loads with a
+// single read-only mapping. The arrays of the loaded GridMap point into the mapping, so
+// loading costs the header checks and the pages the beliefs touch, not a parse.
+// Sources are text maps ('w' = wall, see GridMap::freeInText), PGM (P2 or P5) and BMP images
+// (uncompressed 1 to 32 bits); an image pixel is free when its brightness is at least
+// FREE_BRIGHTNESS of white; grey (unknown) and dark pixels are walls.
+class MapArtifact
+{
+public:
+	enum eSection { Occupancy, Signatures, FreeIndex, FreeCells, Distance, SectionCount };
+	static const uint32_t VERSION = 1;
+	static const size_t SECTION_ALIGNMENT = 64;
+	static constexpr double FREE_BRIGHTNESS = 0.8;
+
+	// Map of an artifact next to the source (source path + ".gridmap"), compiled again when
+	// the source changed since; the source itself when it is an artifact. Falls back to the
+	// parsed source when the artifact cannot be written. nullptr, with the reason in error,
+	// when there is no usable map; nothing is compiled then.
+	static std::shared_ptr<const GridMap> open(const std::string& sourcePath, ThreadPool* pool = nullptr, std::string* error = nullptr)
+	{
+		if (isArtifact(sourcePath)) return load(sourcePath, error);
+		const std::string artifactPath = sourcePath + ".gridmap";
+		uint64_t bytes = 0, time = 0;
+		const bool hasSource = fileStamp(sourcePath, bytes, time);
+		std::shared_ptr<const GridMap> map = load(artifactPath);
+		MapArtifactHeader h;
+		if (map && (!hasSource || (readHeader(artifactPath, h) && h.sourceBytes == bytes && h.sourceTime == time))) return map;
+
+		map.reset(); // a mapped file cannot be rewritten
+		std::shared_ptr<const GridMap> parsed = loadSource(sourcePath, error);
+		if (!parsed || !compile(*parsed, artifactPath, pool, bytes, time)) return parsed;
+		map = load(artifactPath);
+		return map ? map : parsed;
+	}
+
+	// text, PGM or BMP by extension; nullptr, with the reason in error, when it cannot be read
+	// or has no free cell
+	static std::shared_ptr<const GridMap> loadSource(const std::string& path, std::string* error = nullptr)
+	{
+		std::ifstream in(path, std::ios::binary);
+		if (!in.is_open())
+		{
+			fail(error, "Error: Unable to open file: " + path);
+			return nullptr;
+		}
+		const std::string ext = extension(path);
+		std::shared_ptr<const GridMap> map;
+		if (ext != "pgm" && ext != "bmp")
+		{
+			in.close();
+			map = GridMap::load(path);
+		}
+		else
+		{
+			std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			int width = 0, height = 0;
+			std::vector<uint8_t> free; // [y][x], 1 = free
+			if (!(ext == "pgm" ? parsePgm(file, width, height, free) : parseBmp(file, width, height, free)))
+			{
+				fail(error, "Error: Unsupported or damaged map image: " + path);
+				return nullptr;
+			}
+			map = GridMap::build(width, height, [&](int x, int y) { return free[(size_t)(y - 1) * width + (x - 1)] != 0; });
+		}
+		if (map->emptyCount() == 0)
+		{
+			fail(error, "Error: Map has no free cell: " + path);
+			return nullptr;
+		}
+		return map;
+	}
+
+	// Writes the map and its distance transform; the source stamp lets open() spot a changed source
+	static bool compile(const GridMap& map, const std::string& path, ThreadPool* pool = nullptr,
+		uint64_t sourceBytes = 0, uint64_t sourceTime = 0, std::string* error = nullptr)
+	{
+		const std::vector<float> distance = LikelihoodField::distanceTransform(map, pool);
+		const void* data[SectionCount] = { map.occupancy.data(), map.signatures.data(), map.freeIndex.data(), map.freeCells.data(), distance.data() };
+
+		MapArtifactHeader h = {};
+		memcpy(h.magic, magic(), sizeof(h.magic));
+		h.version = VERSION;
+		h.headerBytes = sizeof(MapArtifactHeader);
+		h.width = map.width();
+		h.height = map.height();
+		h.stride = map.stride();
+		h.rowWords = map.rowWords();
+		h.planeSize = map.planeSize();
+		h.freeCount = map.freeCells.size();
+		h.sourceBytes = sourceBytes;
+		h.sourceTime = sourceTime;
+		uint64_t offset = align(sizeof(MapArtifactHeader));
+		for (int s = 0; s < SectionCount; s++)
+		{
+			h.sections[s][0] = offset;
+			h.sections[s][1] = expectedBytes(h, (eSection)s);
+			offset = align(offset + h.sections[s][1]);
+			h.contentHash = hash((const uint8_t*)data[s], (size_t)h.sections[s][1], h.contentHash);
+		}
+		h.fileBytes = offset;
+		h.headerHash = hash((const uint8_t*)&h, offsetof(MapArtifactHeader, headerHash), 0);
+
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write((const char*)&h, sizeof(h));
+		for (int s = 0; s < SectionCount; s++)
+		{
+			pad(out, h.sections[s][0]);
+			out.write((const char*)data[s], (std::streamsize)h.sections[s][1]);
+		}
+		pad(out, h.fileBytes);
+		out.close();
+		if (!out) return fail(error, "Error: Unable to write map artifact: " + path);
+		return true;
+	}
+
+	// Maps an artifact after checking its header against the file, and every cell index and
+	// signature against the map, so a damaged file cannot send a kernel out of bounds; nullptr,
+	// with the reason in error, when it is missing, of another version or inconsistent.
+	// verifyContents also checks the hash of all sections.
+	static std::shared_ptr<const GridMap> load(const std::string& path, std::string* error = nullptr, bool verifyContents = false)
+	{
+		std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+		if (!file->open(path))
+		{
+			fail(error, "Error: Unable to map file: " + path);
+			return nullptr;
+		}
+		const MapArtifactHeader* h = (const MapArtifactHeader*)file->data;
+		std::string problem = file->bytes < sizeof(MapArtifactHeader) ? "shorter than the header" : validate(h, file->bytes);
+		if (problem.empty()) problem = validateCells(*file);
+		if (problem.empty() && verifyContents)
+		{
+			uint64_t content = 0;
+			for (int s = 0; s < SectionCount; s++) content = hash(file->data + h->sections[s][0], (size_t)h->sections[s][1], content);
+			if (content != h->contentHash) problem = "contents do not match the hash";
+		}
+		if (!problem.empty())
+		{
+			fail(error, "Error: Invalid map artifact " + path + ": " + problem);
+			return nullptr;
+		}
+
+		std::shared_ptr<GridMap> map = std::make_shared<GridMap>();
+		map->m_width = h->width;
+		map->m_height = h->height;
+		map->m_stride = h->stride;
+		map->m_rowWords = h->rowWords;
+		map->m_planeSize = (size_t)h->planeSize;
+		map->m_emptyCount = (int)h->freeCount;
+		map->occupancy.view((const uint64_t*)section(*file, Occupancy), (size_t)h->sections[Occupancy][1] / sizeof(uint64_t));
+		map->signatures.view(section(*file, Signatures), (size_t)h->sections[Signatures][1]);
+		map->freeIndex.view((const int32_t*)section(*file, FreeIndex), (size_t)h->planeSize);
+		map->freeCells.view((const uint32_t*)section(*file, FreeCells), (size_t)h->freeCount);
+		map->distance.view((const float*)section(*file, Distance), (size_t)h->planeSize);
+		map->m_storage = file;
+		return map;
+	}
+
+	static bool isArtifact(const std::string& path)
+	{
+		MapArtifactHeader h;
+		return readHeader(path, h) && memcmp(h.magic, magic(), sizeof(h.magic)) == 0;
+	}
+
+private:
+	static const char* magic() { return "GRIDMAP\x1a"; } // 8 bytes, the \x1a stops a text viewer
+
+	// read-only view of a whole file, unmapped with the last GridMap that uses it
+	struct MappedFile
+	{
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = NULL;
+		const uint8_t* data = nullptr;
+		uint64_t bytes = 0;
+
+		bool open(const std::string& path)
+		{
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) return false;
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || (uint64_t)size.QuadPart > SIZE_MAX) return false;
+			bytes = (uint64_t)size.QuadPart;
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (!mapping) return false;
+			data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			return data != nullptr;
+		}
+		~MappedFile()
+		{
+			if (data) UnmapViewOfFile(data);
+			if (mapping) CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		}
+	};
+
+	// the first problem with the header, empty when the sections can be used as they are
+	static std::string validate(const MapArtifactHeader* h, uint64_t fileBytes)
+	{
+		if (memcmp(h->magic, magic(), sizeof(h->magic)) != 0) return "not a map artifact";
+		if (h->version != VERSION || h->headerBytes != sizeof(MapArtifactHeader)) return "version " + std::to_string(h->version) + ", expected " + std::to_string(VERSION);
+		if (h->headerHash != hash((const uint8_t*)h, offsetof(MapArtifactHeader, headerHash), 0)) return "damaged header";
+		if (h->fileBytes != fileBytes) return "file is " + std::to_string(fileBytes) + " bytes, expected " + std::to_string(h->fileBytes);
+		if (h->width < 0 || h->height < 0 || h->stride != h->width + 2 || h->rowWords != (h->stride + 63) / 64 ||
+			h->planeSize != (uint64_t)h->stride * (h->height + 2) || h->planeSize > UINT32_MAX || h->freeCount > h->planeSize) return "inconsistent geometry";
+		for (int s = 0; s < SectionCount; s++)
+		{
+			const uint64_t offset = h->sections[s][0], bytes = h->sections[s][1];
+			if (bytes != expectedBytes(*h, (eSection)s) || offset % SECTION_ALIGNMENT != 0 || offset < sizeof(MapArtifactHeader) ||
+				offset > fileBytes || bytes > fileBytes - offset) return "section " + std::to_string(s) + " out of place";
+		}
+		return std::string();
+	}
+
+	// the first out-of-range signature or cell index; freeIndex and freeCells must be inverses
+	static std::string validateCells(const MappedFile& file)
+	{
+		const MapArtifactHeader* h = (const MapArtifactHeader*)file.data;
+		const uint8_t* signatures = section(file, Signatures);
+		const int32_t* freeIndex = (const int32_t*)section(file, FreeIndex);
+		const uint32_t* freeCells = (const uint32_t*)section(file, FreeCells);
+		size_t free = 0;
+		for (size_t k = 0; k < h->planeSize; k++)
+		{
+			if (signatures[k] > WALL_SIGNATURE) return "signature out of range at cell " + std::to_string(k);
+			if (freeIndex[k] < 0) continue;
+			if ((uint64_t)freeIndex[k] >= h->freeCount || freeCells[freeIndex[k]] != k) return "free index out of range at cell " + std::to_string(k);
+			free++;
+		}
+		if (free != h->freeCount) return "free cell list does not match the free index";
+		return std::string();
+	}
+
+	static uint64_t expectedBytes(const MapArtifactHeader& h, eSection s)
+	{
+		switch (s)
+		{
+		case Occupancy: return (uint64_t)h.rowWords * (h.height + 2) * sizeof(uint64_t);
+		case Signatures: return h.planeSize;
+		case FreeIndex: return h.planeSize * sizeof(int32_t);
+		case FreeCells: return h.freeCount * sizeof(uint32_t);
+		default: return h.planeSize * sizeof(float);
+		}
+	}
+	static const uint8_t* section(const MappedFile& file, eSection s)
+	{
+		return file.data + ((const MapArtifactHeader*)file.data)->sections[s][0];
+	}
+	static uint64_t align(uint64_t offset) { return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT; }
+	static void pad(std::ofstream& out, uint64_t offset)
+	{
+		static const char zeros[SECTION_ALIGNMENT] = {};
+		const uint64_t at = (uint64_t)out.tellp();
+		if (offset > at) out.write(zeros, (std::streamsize)(offset - at));
+	}
+
+	// FNV-1a over 8-byte words, then the tail bytes
+	static uint64_t hash(const uint8_t* p, size_t bytes, uint64_t seed)
+	{
+		const uint64_t prime = 0x100000001b3ull;
+		uint64_t h = seed ^ 0xcbf29ce484222325ull;
+		size_t i = 0;
+		for (; i + 8 <= bytes; i += 8)
+		{
+			uint64_t w;
+			memcpy(&w, p + i, 8);
+			h = (h ^ w) * prime;
+		}
+		for (; i < bytes; i++) h = (h ^ p[i]) * prime;
+		return h;
+	}
+
+	static bool fail(std::string* error, const std::string& message)
+	{
+		if (error) *error = message;
+		return false;
+	}
+
+	static std::string extension(const std::string& path)
+	{
+		const size_t dot = path.find_last_of('.');
+		std::string ext = dot == std::string::npos ? std::string() : path.substr(dot + 1);
+		for (char& c : ext) c = (char)tolower((unsigned char)c);
+		return ext;
+	}
+	// size and last write time, false when the file does not exist
+	static bool fileStamp(const std::string& path, uint64_t& bytes, uint64_t& time)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info)) return false;
+		bytes = (uint64_t)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+		time = (uint64_t)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime;
+		return true;
+	}
+	// the header without mapping the file, e.g. for the source stamp
+	static bool readHeader(const std::string& path, MapArtifactHeader& h)
+	{
+		std::ifstream in(path, std::ios::binary);
+		return (bool)in.read((char*)&h, sizeof(h));
+	}
+
+	// PGM, P2 (text) or P5 (binary, 1 or 2 bytes per sample); rows top to bottom
+	static bool parsePgm(const std::vector<uint8_t>& file, int& width, int& height, std::vector<uint8_t>& free)
+	{
+		size_t pos = 2;
+		auto number = [&](long long& value)
+		{
+			while (pos < file.size() && (isspace(file[pos]) || file[pos] == '#'))
+			{
+				if (file[pos] == '#') while (pos < file.size() && file[pos] != '\n') pos++;
+				else pos++;
+			}
+			if (pos >= file.size() || !isdigit(file[pos])) return false;
+			for (value = 0; pos < file.size() && isdigit(file[pos]); pos++) value = value * 10 + (file[pos] - '0');
+			return value <= INT32_MAX;
+		};
+		long long w, h, maxValue;
+		if (file.size() < 2 || file[0] != 'P' || (file[1] != '2' && file[1] != '5')) return false;
+		if (!number(w) || !number(h) || !number(maxValue) || maxValue <= 0 || maxValue > 65535) return false;
+		width = (int)w;
+		height = (int)h;
+		const size_t cells = (size_t)width * height;
+		const double threshold = FREE_BRIGHTNESS * maxValue;
+		free.assign(cells, 0);
+		if (file[1] == '2')
+		{
+			long long value;
+			for (size_t i = 0; i < cells; i++)
+			{
+				if (!number(value)) return false;
+				free[i] = value >= threshold;
+			}
+			return true;
+		}
+		pos++; // the single whitespace after maxValue
+		const int sampleBytes = maxValue < 256 ? 1 : 2;
+		if (file.size() < pos + cells * sampleBytes) return false;
+		for (size_t i = 0; i < cells; i++)
+		{
+			const uint8_t* s = &file[pos + i * sampleBytes];
+			const int value = sampleBytes == 1 ? s[0] : s[0] << 8 | s[1];
+			free[i] = value >= threshold;
+		}
+		return true;
+	}
+
+	// BMP, uncompressed 1, 4, 8, 24 or 32 bits per pixel; rows bottom to top unless the height is negative
+	static bool parseBmp(const std::vector<uint8_t>& file, int& width, int& height, std::vector<uint8_t>& free)
+	{
+		auto u16 = [&](size_t at) { return (uint32_t)(file[at] | file[at + 1] << 8); };
+		auto u32 = [&](size_t at) { return (uint32_t)(u16(at) | u16(at + 2) << 16); };
+		if (file.size() < 54 || file[0] != 'B' || file[1] != 'M') return false;
+		const uint32_t pixels = u32(10);
+		const uint32_t infoBytes = u32(14);
+		const int32_t w = (int32_t)u32(18);
+		const int32_t h = (int32_t)u32(22);
+		const uint32_t bits = u16(28);
+		const uint32_t compression = u32(30);
+		if (w <= 0 || h == 0 || h == INT32_MIN || (compression != 0 && !(compression == 3 && bits == 32))) return false;
+		if (bits != 1 && bits != 4 && bits != 8 && bits != 24 && bits != 32) return false;
+		width = w;
+		height = std::abs(h);
+		const size_t rowBytes = ((size_t)width * bits + 31) / 32 * 4;
+		if (pixels > file.size() || file.size() - pixels < rowBytes * height) return false;
+
+		std::vector<uint8_t> paletteFree;
+		if (bits <= 8)
+		{
+			const size_t colors = u32(46) ? u32(46) : (size_t)1 << bits;
+			const size_t palette = 14 + (size_t)infoBytes;
+			if (colors > 256 || palette + colors * 4 > pixels) return false;
+			for (size_t c = 0; c < colors; c++) paletteFree.push_back(isFree(&file[palette + c * 4]));
+			paletteFree.resize(256, 0);
+		}
+		free.assign((size_t)width * height, 0);
+		for (int y = 0; y < height; y++)
+		{
+			const uint8_t* row = &file[pixels + (h > 0 ? height - 1 - y : y) * rowBytes];
+			uint8_t* out = &free[(size_t)y * width];
+			for (int x = 0; x < width; x++)
+			{
+				if (bits >= 24) out[x] = isFree(row + (size_t)x * (bits / 8));
+				else
+				{
+					const size_t bit = (size_t)x * bits;
+					const int index = (row[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+					out[x] = paletteFree[index];
+				}
+			}
+		}
+		return true;
+	}
+	// blue, green, red
+	static uint8_t isFree(const uint8_t* bgr)
+	{
+		return 0.114 * bgr[0] + 0.587 * bgr[1] + 0.299 * bgr[2] >= FREE_BRIGHTNESS * 255;
+	}
+};
@@ -2,9 +2,16 @@
 #include <windows.h>
 #include "stdio.h"
 #include <string>
+#include <cstdint>
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <malloc.h>
+#include <memory>
+#include <type_traits>
 #include "params.h"
+#include "ThreadPool.h"
 
 
 enum eCellOccupancy
@@ -43,6 +50,34 @@ struct MovementModel
 	double pFail = 0.2;
 };
 
+// Turn by `bins` heading bins, positive = counterclockwise (left), on planes stored through a
+// heading offset (heading h in physical plane (h + offset) % headings):
+// new[h] = old[h] * pFail + old[h + bins] * pSuccess
+// The shift along the heading axis only relabels planes. A blend pass is needed only when both
+// outcomes are possible; after relabeling, physical plane q then becomes
+// blend(old[q], old[from(q)]). A constant factor is left to the lazy normalization.
+struct HeadingTurn
+{
+	int headings;
+	int shift; // in [0, headings)
+	double pSuccess;
+	double pFail;
+
+	HeadingTurn(int headings, int bins, const MovementModel& mm) :
+		headings(headings), shift(((bins % headings) + headings) % headings), pSuccess(mm.pSuccess), pFail(mm.pFail) {}
+
+	bool blends() const { return shift != 0 && pFail != 0.0 && pSuccess != 0.0; }
+	// heading offset after the turn; unchanged when the turn surely fails
+	int offset(int headingOffset) const
+	{
+		if (shift != 0 && pFail != 0.0 && pSuccess == 0.0) return headingOffset;
+		return (headingOffset + shift) % headings;
+	}
+	// physical plane blended into plane q, after relabeling
+	int from(int q) const { return (q + headings - shift) % headings; }
+	double blend(double self, double other) const { return self * pSuccess + other * pFail; }
+};
+
 struct Filter
 {
 	eCellOccupancy up = eCellOccupancy::Empty;
@@ -65,6 +100,148 @@ struct Filter
 		down = Empty;
 		left = Empty;
 	}
+	eCellOccupancy side(eDirection d) const
+	{
+		switch (d)
+		{
+		case eDirection::Up: return up;
+		case eDirection::Right: return right;
+		case eDirection::Down: return down;
+		default: return left;
+		}
+	}
+};
+
+// Wall-neighbor signature of a free cell: bit d is set when the neighbor in eDirection d is a wall
+const int SIGNATURE_COUNT = 16;
+const uint8_t WALL_SIGNATURE = SIGNATURE_COUNT; // wall and border cells
+
+// Observation likelihood for every neighbor signature, built once per Filter and heading
+struct LikelihoodTable
+{
+	double p[SIGNATURE_COUNT + 1] = { 0 }; // p[WALL_SIGNATURE] stays 0
+
+	LikelihoodTable() {}
+	LikelihoodTable(const Filter& f, const SensorModel& sm)
+	{
+		for (int s = 0; s < SIGNATURE_COUNT; s++)
+		{
+			double probValue = 1.0;
+			for (int d = 0; d < 4; d++)
+			{
+				probValue *= sm.probModel[(s >> d) & 1][f.side((eDirection)d)];
+			}
+			p[s] = probValue;
+		}
+	}
+
+	// likelihood of both readings: independent given the pose
+	void multiply(const LikelihoodTable& t)
+	{
+		for (int s = 0; s <= SIGNATURE_COUNT; s++) p[s] *= t.p[s];
+	}
+	double max() const { return *std::max_element(p, p + SIGNATURE_COUNT + 1); }
+};
+
+// Sum and max of a belief, accumulated by the update kernels
+struct BeliefStats
+{
+	double sum = 0.0;
+	double max = 0.0;
+
+	void add(double value)
+	{
+		sum += value;
+		if (value > max) max = value;
+	}
+	void add(const BeliefStats& other)
+	{
+		sum += other.sum;
+		if (other.max > max) max = other.max;
+	}
+};
+
+// Per-task summary collected by the Environment kernels while they write cells: the stats, the
+// largest cell, sum v log v, the topK largest cells and the position marginal (sum over
+// headings, [row][col]). Values are in the kernel's data units. The first argument of add
+// is std::false_type when the summary is not collected, which is just BeliefStats::add.
+struct BeliefTracker
+{
+	typedef std::pair<double, size_t> Entry; // value, volume index
+
+	BeliefStats stats;
+	size_t argmax = 0; // volume index of stats.max
+	double plogp = 0.0;
+	std::vector<Entry> top; // min-heap while collecting
+	size_t topK = 0;
+	double* marginal = nullptr; // dense kernels only
+	size_t task = 0;
+
+	void reset(size_t t, size_t k, double* marginalPlane)
+	{
+		task = t;
+		stats = BeliefStats();
+		argmax = 0;
+		plogp = 0.0;
+		top.clear();
+		topK = k;
+		marginal = marginalPlane;
+	}
+	// cell i of the volume, k of its plane
+	void add(std::true_type, double value, size_t i, size_t k)
+	{
+		add(std::true_type(), value, i);
+		if (marginal) marginal[k] += value;
+	}
+	void add(std::true_type, double value, size_t i)
+	{
+		if (value > stats.max)
+		{
+			stats.max = value;
+			argmax = i;
+		}
+		stats.sum += value;
+		if (value <= 0.0) return;
+		plogp += value * std::log(value);
+		if (topK > 0) addTop(Entry(value, i));
+	}
+	void add(std::false_type, double value, size_t, size_t = 0) { stats.add(value); }
+	void add(const BeliefTracker& other)
+	{
+		if (other.stats.max > stats.max) argmax = other.argmax;
+		stats.add(other.stats);
+		plogp += other.plogp;
+		for (const Entry& e : other.top) addTop(e);
+	}
+	void addTop(const Entry& e)
+	{
+		if (top.size() < topK)
+		{
+			top.push_back(e);
+			std::push_heap(top.begin(), top.end(), std::greater<Entry>());
+		}
+		else if (e.first > top.front().first)
+		{
+			std::pop_heap(top.begin(), top.end(), std::greater<Entry>());
+			top.back() = e;
+			std::push_heap(top.begin(), top.end(), std::greater<Entry>());
+		}
+	}
+};
+
+// A pose of the belief with its normalized probability
+struct BeliefCell
+{
+	int heading = 0;
+	int x = 0;
+	int y = 0;
+	double p = 0.0;
+};
+
+struct CellOffset
+{
+	int dx = 0;
+	int dy = 0;
 };
 
 struct RenderData
@@ -75,185 +252,1044 @@ struct RenderData
 	int hoveredCellX = -1;
 };
 
-
-class Environment
+// Heap array aligned to a cache line, zero-initialized
+template <typename T>
+class AlignedBuffer
 {
 private:
-	int m_emptyCount = 0; // for initial probabilities
+	T* m_ptr = nullptr;
+	size_t m_size = 0;
 public:
-	static std::vector<Environment*> allEnvironments;
-
+	static const size_t ALIGNMENT = 64;
 public:
-	RenderData rd;
-	std::string dirName;
-	eCellOccupancy cells[SIZE_X + 2][SIZE_Y + 2] = { eCellOccupancy::Empty };
-	double data[SIZE_X + 2][SIZE_Y + 2] = { 0 };
+	AlignedBuffer() {}
+	explicit AlignedBuffer(size_t size) { resize(size); }
+	AlignedBuffer(const AlignedBuffer& other) { *this = other; }
+	AlignedBuffer& operator=(const AlignedBuffer& other)
+	{
+		if (this == &other) return *this;
+		resize(other.m_size);
+		if (m_size > 0) memcpy(m_ptr, other.m_ptr, m_size * sizeof(T));
+		return *this;
+	}
+	~AlignedBuffer() { _aligned_free(m_ptr); }
 
-public:
-	Environment(const std::string& mapPath, const std::string& directionName)
+	void resize(size_t size)
 	{
-		dirName = directionName;
-		for (size_t i = 0; i < SIZE_X + 2; i++)
+		if (size != m_size)
 		{
-			for (size_t j = 0; j < SIZE_Y + 2; j++)
-			{
-				if (i == 0 || i == SIZE_X + 1) cells[i][j] = eCellOccupancy::Wall;
-				else if (j == 0 || j == SIZE_Y + 1) cells[i][j] = eCellOccupancy::Wall;
-			}
-		}
-		loadMapFromFile(mapPath);
-		for (size_t i = 1; i < SIZE_X + 1; i++)
-		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
-			{
-				if (cells[i][j] == eCellOccupancy::Empty) data[i][j] = 1.0 / m_emptyCount;
-				else data[i][j] = 0.0;
-			}
+			_aligned_free(m_ptr);
+			m_ptr = size > 0 ? (T*)_aligned_malloc(size * sizeof(T), ALIGNMENT) : nullptr;
+			m_size = size;
 		}
-		allEnvironments.push_back(this);
-		return;
+		if (m_size > 0) memset(m_ptr, 0, m_size * sizeof(T));
+	}
+	// exchanges the storage, no copy
+	void swap(AlignedBuffer& other)
+	{
+		std::swap(m_ptr, other.m_ptr);
+		std::swap(m_size, other.m_size);
 	}
+	T* data() { return m_ptr; }
+	const T* data() const { return m_ptr; }
+	size_t size() const { return m_size; }
+	T& operator[](size_t i) { return m_ptr[i]; }
+	const T& operator[](size_t i) const { return m_ptr[i]; }
+};
+
 
-	void loadMapFromFile(const std::string& mapPath) {
+// Read-only array of a GridMap: owns its elements when the map is computed, or points into the
+// mapped file of a MapArtifact
+template <typename T>
+class MapArray
+{
+private:
+	std::vector<T> m_owned;
+	const T* m_data = nullptr;
+	size_t m_size = 0;
+public:
+	MapArray() {}
+	MapArray(const MapArray&) = delete;
+	MapArray& operator=(const MapArray&) = delete;
+
+	void assign(std::vector<T>&& elements)
+	{
+		m_owned = std::move(elements);
+		m_data = m_owned.data();
+		m_size = m_owned.size();
+	}
+	// elements owned elsewhere, kept alive by the GridMap
+	void view(const T* elements, size_t size)
+	{
+		m_owned = std::vector<T>();
+		m_data = elements;
+		m_size = size;
+	}
+	const T& operator[](size_t i) const { return m_data[i]; }
+	const T* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	const T* begin() const { return m_data; }
+	const T* end() const { return m_data + m_size; }
+};
+
+// Map of a floor plan, shared by every belief on it and immutable once loaded: the Environment
+// grid geometry, occupancy, neighbor signatures and the free cell index. Beliefs hold it through
+// a shared_ptr, so robots on the same map pay only for their belief volume.
+class GridMap
+{
+	friend class MapArtifact; // maps its arrays from the artifact file
+private:
+	int m_emptyCount = 0; // for initial probabilities
+	int m_width = 0; // map size without border
+	int m_height = 0;
+	int m_stride = 0; // row length with border
+	int m_rowWords = 0; // occupancy words per row
+	size_t m_planeSize = 0; // cells in one heading plane with border
+	std::shared_ptr<const void> m_storage; // the mapped file the arrays point into, if any
+
+public:
+	MapArray<uint64_t> occupancy; // [row][word], bit x % 64 of word x / 64 is set for walls, see rowWalls
+	MapArray<uint8_t> signatures; // [row][col], see LikelihoodTable
+	MapArray<int32_t> freeIndex; // [row][col] -> free cell number, -1 for walls
+	MapArray<uint32_t> freeCells; // free cell number -> index(x, y), in row-major order
+	MapArray<float> distance; // [row][col] to the nearest wall, only when loaded from a MapArtifact, see LikelihoodField::distanceTransform
+
+public:
+	// text map cell x (1-based) of a line: 'w' is a wall, anything else free, as are the cells
+	// past the end of a short line
+	static bool freeInText(const std::string& line, int x) { return x > (int)line.size() || line[x - 1] != 'w'; }
+
+	// Text map, see freeInText; an empty map, after a message box, when the file cannot be read
+	static std::shared_ptr<const GridMap> load(const std::string& mapPath)
+	{
 		std::ifstream file(mapPath);
 		if (!file.is_open()) {
 			std::string output = "Error: Unable to open file: ";
 			output += mapPath;
 			MessageBoxA(0, output.c_str(), "Error", MB_OK);
 
-			return;
+			return std::make_shared<GridMap>();
 		}
 
+		// map size is taken from the file: rows = lines, columns = longest line
+		std::vector<std::string> lines;
 		std::string line;
-		size_t row = 1; // Счётчик строк, начинаем с 1, так как 0 и SIZE_X+1 — внешние стены
-		while (std::getline(file, line) && row <= SIZE_X) {
-			for (size_t col = 1; col <= SIZE_Y && col <= line.size(); ++col) {
-				char s = line[col - 1];
-				if (line[col - 1] == 'w') {
-					cells[col][row] = eCellOccupancy::Wall;
-				}
-				else if (line[col - 1] == '0') {
-					cells[col][row] = eCellOccupancy::Empty;
-					m_emptyCount++;
-				}
-			}
-			row++;
+		size_t width = 0;
+		while (std::getline(file, line)) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (line.empty()) continue;
+			width = std::max(width, line.size());
+			lines.push_back(line);
 		}
 		file.close();
+
+		return build((int)width, (int)lines.size(), [&](int x, int y) { return freeInText(lines[y - 1], x); });
 	}
+	// width x height cells, free(x, y) for x = 1..width, y = 1..height; the others are walls
+	template <typename F>
+	static std::shared_ptr<const GridMap> build(int width, int height, F free)
+	{
+		std::shared_ptr<GridMap> map = std::make_shared<GridMap>();
+		map->m_width = width;
+		map->m_height = height;
+		map->m_stride = width + 2;
+		map->m_planeSize = (size_t)map->m_stride * (height + 2);
+		map->m_rowWords = (map->m_stride + 63) / 64;
 
-	void applyFilter(Filter f, SensorModel sm)
+		std::vector<uint64_t> occupancy((size_t)map->m_rowWords * (height + 2), ~0ull); // border and unknown cells are walls
+		for (int y = 1; y <= height; y++)
+		{
+			uint64_t* bits = &occupancy[(size_t)y * map->m_rowWords];
+			for (int x = 1; x <= width; x++)
+			{
+				if (free(x, y)) bits[x >> 6] &= ~(1ull << (x & 63));
+			}
+		}
+		map->occupancy.assign(std::move(occupancy));
+		map->computeSignatures();
+		map->computeFreeCells();
+		return map;
+	}
+
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	int stride() const { return m_stride; }
+	int rowWords() const { return m_rowWords; }
+	size_t planeSize() const { return m_planeSize; }
+	int emptyCount() const { return m_emptyCount; }
+	size_t index(int x, int y) const { return (size_t)y * m_stride + x; }
+	// Occupancy bits of row y for x = 0..stride - 1. Rows start on a word, and the bits past
+	// the border are set, so a word of 64 walls is ~0.
+	const uint64_t* rowWalls(int y) const { return &occupancy[(size_t)y * m_rowWords]; }
+	static bool isWallBit(const uint64_t* row, int x) { return (row[x >> 6] >> (x & 63)) & 1; }
+	bool isWall(int x, int y) const { return isWallBit(rowWalls(y), x); }
+	// memory held by the map, shared by all its beliefs
+	size_t bytes() const
+	{
+		return occupancy.size() * sizeof(uint64_t) + signatures.size() + freeIndex.size() * sizeof(int32_t) + freeCells.size() * sizeof(uint32_t) +
+			distance.size() * sizeof(float);
+	}
+
+	// low 8 bits of v to the low bit of 8 bytes, bit i to byte i
+	static uint64_t spreadBits(uint64_t v)
+	{
+		return (((v & 0x7F) * 0x0002040810204081ull) & 0x0101010101010101ull) | ((v >> 7 & 1) << 56);
+	}
+
+private:
+	// Signatures from occupancy, 64 cells per word: the neighbor masks of a word are the rows
+	// above and below and the row shifted by one, spread to one byte per cell 8 cells at a time.
+	// Bytes are stored little-endian.
+	void computeSignatures()
 	{
-		for (size_t i = 1; i < SIZE_X + 1; i++)
+		std::vector<uint8_t> sigs(m_planeSize, WALL_SIGNATURE);
+		const uint64_t wallBytes = 0x0101010101010101ull * WALL_SIGNATURE;
+		for (int y = 1; y <= m_height; y++)
 		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
+			const uint64_t* up = rowWalls(y - 1);
+			const uint64_t* row = rowWalls(y);
+			const uint64_t* down = rowWalls(y + 1);
+			uint8_t* sig = &sigs[index(0, y)];
+			for (int w = 0; w < m_rowWords; w++)
 			{
-				if (cells[i][j] == eCellOccupancy::Wall)
+				// neighbor to the left of bit i is bit i - 1, to the right bit i + 1
+				const uint64_t left = row[w] << 1 | (w > 0 ? row[w - 1] >> 63 : 1);
+				const uint64_t right = row[w] >> 1 | (w + 1 < m_rowWords ? row[w + 1] << 63 : 1ull << 63);
+				for (int b = 0; b < 64 && w * 64 + b < m_stride; b += 8)
 				{
-					data[i][j] = 0;
-					continue;
+					uint64_t bytes = spreadBits(up[w] >> b) << eDirection::Up | spreadBits(right >> b) << eDirection::Right |
+						spreadBits(down[w] >> b) << eDirection::Down | spreadBits(left >> b) << eDirection::Left;
+					const uint64_t wall = spreadBits(row[w] >> b) * 0xFF;
+					bytes = (bytes & ~wall) | (wallBytes & wall);
+					memcpy(sig + w * 64 + b, &bytes, std::min(8, m_stride - (w * 64 + b)));
 				}
+			}
+		}
+		signatures.assign(std::move(sigs));
+	}
 
-				double probValue = 1.0;
+	void computeFreeCells()
+	{
+		std::vector<int32_t> number(m_planeSize, -1);
+		std::vector<uint32_t> cells;
+		for (size_t i = 0; i < m_planeSize; i++)
+		{
+			if (signatures[i] == WALL_SIGNATURE) continue;
+			number[i] = (int32_t)cells.size();
+			cells.push_back((uint32_t)i);
+		}
+		m_emptyCount = (int)cells.size();
+		freeIndex.assign(std::move(number));
+		freeCells.assign(std::move(cells));
+	}
+};
+
+// Belief for all headings on a shared GridMap.
+// Both grids are row-major with a one-cell wall border: index(x, y) = y * stride + x,
+// where x = 1..width and y = 1..height are map cells. The belief volume is laid out
+// as [heading][row][col] in one contiguous buffer, so whole-volume kernels are a single sweep.
+class Environment
+{
+private:
+	std::shared_ptr<const GridMap> m_map;
+	int m_width = 0; // geometry of m_map, copied for the kernels
+	int m_height = 0;
+	int m_stride = 0;
+	int m_rowWords = 0;
+	size_t m_planeSize = 0;
+	double m_scale = 1.0; // normalized belief = data * m_scale
+	BeliefStats m_stats; // sum and max of data as of the last normalize
+	int m_headingOffset = 0; // heading h is stored in plane (h + m_headingOffset) % m_headings
+	int m_headings = 4; // heading bins, bin h points h * 360 / m_headings degrees clockwise from Up
+	ThreadPool* m_pool = nullptr; // serial when not set
+	AlignedBuffer<double> m_halo; // source rows of neighboring bands for applyMovement
+
+	// sparse mode: only the listed cells of data can be nonzero
+	bool m_sparseAllowed = true;
+	bool m_sparse = false;
+	std::vector<size_t> m_active; // physical volume indices, sorted; a volume can pass 2^32 cells
+	std::vector<uint8_t> m_activeMark; // [volume], set for cells in m_active
+	double m_prunedMass = 0.0; // probability dropped by pruning so far
+	int m_stepsSinceCheck = 0;
+
+	// summary of the last kernel over every heading, collected while it ran, see setTracking
+	bool m_tracking = false;
+	int m_topK = 0;
+	bool m_trackMarginal = false;
+	std::vector<BeliefTracker> m_trackers; // per task of the running kernel
+	size_t m_trackerCount = 0;
+	bool m_groupBands = false; // forEachBand runs all headings of a band in one task, for the marginal
+	BeliefTracker m_summary;
+	bool m_summaryValid = false;
+	std::vector<double> m_marginal; // [row][col], in data units of m_summary
+	std::vector<uint32_t> m_marginalCells; // sparse mode: the nonzero entries of m_marginal
+public:
+	// data is rescaled only when its sum leaves this range
+	static constexpr double RESCALE_MIN = 1e-150;
+	static constexpr double RESCALE_MAX = 1e150;
+	static const int BAND_ROWS = 32; // rows per parallel task
+	// Sparse mode is entered when the effective support exp(entropy) drops below SPARSE_ENTER
+	// of the volume (checked every SPARSE_CHECK_INTERVAL steps), and left when more than
+	// SPARSE_EXIT of the volume is active. Cells below PRUNE_EPSILON are dropped in sparse mode.
+	static constexpr double SPARSE_ENTER = 0.01;
+	static constexpr double SPARSE_EXIT = 0.05;
+	static constexpr double PRUNE_EPSILON = 1e-12;
+	static const int SPARSE_CHECK_INTERVAL = 8;
+
+public:
+	const MapArray<uint64_t>& occupancy; // of the GridMap
+	const MapArray<uint8_t>& signatures;
+	const MapArray<int32_t>& freeIndex;
+	const MapArray<uint32_t>& freeCells;
+	AlignedBuffer<double> data; // [heading][row][col]
 
-				probValue *= sm.probModel[cells[i - 1][j]][f.left];
-				probValue *= sm.probModel[cells[i + 1][j]][f.right];
-				probValue *= sm.probModel[cells[i][j - 1]][f.up];
-				probValue *= sm.probModel[cells[i][j + 1]][f.down];
+public:
+	Environment(const std::string& mapPath, int headings = 4) : Environment(GridMap::load(mapPath), headings) {}
+	// another belief on a map that is already loaded. Without `withBelief` data stays empty:
+	// the geometry, heading helpers and pool serve an engine that keeps its own belief, and
+	// the belief kernels must not be called.
+	Environment(std::shared_ptr<const GridMap> map, int headings = 4, bool withBelief = true) : m_map(map),
+		occupancy(map->occupancy), signatures(map->signatures), freeIndex(map->freeIndex), freeCells(map->freeCells)
+	{
+		m_headings = std::max(1, headings);
+		m_width = map->width();
+		m_height = map->height();
+		m_stride = map->stride();
+		m_rowWords = map->rowWords();
+		m_planeSize = map->planeSize();
+		if (!withBelief) return;
+		data.resize(m_headings * m_planeSize);
+		resetUniform();
+	}
+	Environment(const Environment&) = delete;
+	Environment& operator=(const Environment&) = delete;
+
+	// copies the belief of another Environment on the same map, as a scratch copy; the pool is kept
+	void assignBelief(const Environment& other)
+	{
+		m_headings = other.m_headings;
+		data = other.data;
+		m_scale = other.m_scale;
+		m_stats = other.m_stats;
+		m_headingOffset = other.m_headingOffset;
+		m_sparseAllowed = other.m_sparseAllowed;
+		m_sparse = other.m_sparse;
+		m_active = other.m_active;
+		m_activeMark = other.m_activeMark;
+		m_prunedMass = other.m_prunedMass;
+		m_stepsSinceCheck = other.m_stepsSinceCheck;
+		m_summaryValid = false;
+		if (m_trackMarginal) std::fill(m_marginal.begin(), m_marginal.end(), 0.0);
+		m_marginalCells.clear();
+	}
 
-				data[i][j] *= probValue;
+	// uniform belief over every free cell and heading, as after loading the map
+	void resetUniform()
+	{
+		leaveSparse();
+		for (int h = 0; h < m_headings; h++)
+		{
+			double* p = plane(h);
+			for (size_t k = 0; k < m_planeSize; k++)
+			{
+				p[k] = signatures[k] != WALL_SIGNATURE ? 1.0 / m_map->emptyCount() : 0.0;
 			}
 		}
-		return;
+		m_scale = 1.0 / m_headings;
+		m_stats.sum = m_headings;
+		m_stats.max = m_map->emptyCount() > 0 ? 1.0 / m_map->emptyCount() : 0.0;
+		m_summaryValid = false;
 	}
-	void applyMovement(eDirection mtype, MovementModel mm)
+
+	const std::shared_ptr<const GridMap>& map() const { return m_map; }
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	int stride() const { return m_stride; }
+	size_t planeSize() const { return m_planeSize; }
+	int headings() const { return m_headings; }
+	double headingAngle(int heading) const { return headingAngle(m_headings, heading); } // clockwise from Up
+	static double headingAngle(int headings, int heading) { return 360.0 * heading / headings; }
+	size_t index(int x, int y) const { return (size_t)y * m_stride + x; }
+
+	double* plane(int heading) { return data.data() + (size_t)((heading + m_headingOffset) % m_headings) * m_planeSize; }
+	const uint64_t* rowWalls(int y) const { return &occupancy[(size_t)y * m_rowWords]; } // see GridMap::rowWalls
+	static bool isWallBit(const uint64_t* row, int x) { return GridMap::isWallBit(row, x); }
+	bool isWall(int x, int y) const { return isWallBit(rowWalls(y), x); }
+	eCellOccupancy cell(int x, int y) const { return isWall(x, y) ? eCellOccupancy::Wall : eCellOccupancy::Empty; }
+	double& at(int heading, int x, int y) { return plane(heading)[index(x, y)]; } // unnormalized
+
+	void setThreadPool(ThreadPool* pool) { m_pool = pool; }
+	ThreadPool* threadPool() const { return m_pool; }
+	int bandCount() const { return (m_height + BAND_ROWS - 1) / BAND_ROWS; }
+
+	// Runs fn(h, yFirst, yLast) for every band of rows 1..height and every h in [0, planes),
+	// in parallel when a pool is set. Partial stats are combined in band order, so results
+	// do not depend on the thread count.
+	template <typename F>
+	BeliefStats forEachBand(int planes, F fn)
 	{
-		double dataCopy[SIZE_X + 2][SIZE_Y + 2] = { 0 };
+		const int bands = bandCount();
+		const size_t count = (size_t)planes * bands;
+		std::vector<BeliefStats> partial(count);
+		std::function<void(size_t)> task = [&](size_t t)
+		{
+			int yFirst = 1 + (int)(t % bands) * BAND_ROWS;
+			int yLast = std::min(yFirst + BAND_ROWS - 1, m_height);
+			partial[t] = fn((int)(t / bands), yFirst, yLast);
+		};
+		std::function<void(size_t)> bandTask = [&](size_t b) // headings in order, see m_groupBands
+		{
+			for (int h = 0; h < planes; h++) task((size_t)h * bands + b);
+		};
+		const bool grouped = m_groupBands && planes > 1;
+		if (m_pool) m_pool->parallelFor(grouped ? bands : count, grouped ? bandTask : task);
+		else for (size_t t = 0; t < count; t++) task(t);
 
-		// array address direction
-		int di = 0;
-		int dj = 0;
+		BeliefStats stats;
+		for (const BeliefStats& p : partial) stats.add(p);
+		return stats;
+	}
 
-		switch (mtype)
+	double scale() const { return m_scale; }
+	double probability(int heading, int x, int y) { return at(heading, x, y) * m_scale; }
+
+	void setSparseAllowed(bool allowed)
+	{
+		m_sparseAllowed = allowed;
+		if (!allowed) leaveSparse();
+	}
+	bool isSparse() const { return m_sparse; }
+	const std::vector<size_t>& activeCells() const { return m_active; }
+	double prunedMass() const { return m_prunedMass; }
+	// Summary tracking: with `summary` set, every kernel that updates all headings records the
+	// MAP cell, the entropy, the topK most likely poses and, with `marginal`, the position
+	// distribution over headings as it goes. Queries are O(1) (topCells O(k)) until the belief
+	// changes by other means: kernels over some headings, engines writing data, see hasSummary.
+	// getStats() collects the summary again. Kernels cost the same as before when it is off.
+	void setTracking(bool summary, int topK = 0, bool marginal = false)
+	{
+		m_tracking = summary;
+		m_topK = summary ? std::max(0, topK) : 0;
+		m_trackMarginal = summary && marginal;
+		m_marginal.assign(m_trackMarginal ? m_planeSize : 0, 0.0);
+		m_marginalCells.clear();
+		m_summaryValid = false;
+	}
+	bool isTracking() const { return m_tracking; }
+	bool hasSummary() const { return m_summaryValid; }
+	BeliefCell mapCell() const { return cellOf(m_summary.argmax, m_summary.stats.max); }
+	// nats
+	double trackedEntropy() const
+	{
+		const double sum = m_summary.stats.sum;
+		return sum > 0.0 ? std::log(sum) - m_summary.plogp / sum : 0.0;
+	}
+	// most likely first
+	std::vector<BeliefCell> topCells() const
+	{
+		std::vector<BeliefCell> cells;
+		for (const BeliefTracker::Entry& e : m_summary.top) cells.push_back(cellOf(e.second, e.first));
+		return cells;
+	}
+	// probability of cell (x, y) over all headings
+	double marginal(int x, int y) const { return m_summary.stats.sum > 0.0 ? m_marginal[index(x, y)] / m_summary.stats.sum : 0.0; }
+
+	// Runs kernel(collect) for a kernel of `tasks` tasks. Task t adds its cells to a copy of
+	// tracker(t) (forEachBand kernels: bandTracker) with collect as first argument and hands
+	// it back with keep; a local keeps its sums in registers. collect is std::true_type when
+	// the kernel updates every heading and the summary is tracked.
+	template <typename K>
+	BeliefStats tracked(size_t tasks, bool allHeadings, K kernel)
+	{
+		const bool collect = allHeadings && m_tracking;
+		if (m_trackers.size() < tasks) m_trackers.resize(tasks);
+		m_trackerCount = tasks;
+		for (size_t t = 0; t < tasks; t++)
 		{
-		case eDirection::Up:
-			di = 0;
-			dj = 1;
-			break;
-		case eDirection::Right:
-			di = -1;
-			dj = 0;
-			break;
-		case eDirection::Down:
-			di = 0;
-			dj = -1;
-			break;
-		case eDirection::Left:
-			di = 1;
-			dj = 0;
-			break;
-		}
-
-		for (size_t i = 1; i < SIZE_X + 1; i++)
-		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
+			m_trackers[t].reset(t, collect ? m_topK : 0, collect && m_trackMarginal && !m_sparse ? m_marginal.data() : nullptr);
+		}
+		m_groupBands = collect && m_trackMarginal && !m_sparse;
+		BeliefStats stats = collect ? kernel(std::true_type()) : kernel(std::false_type());
+		m_groupBands = false;
+		if (collect) mergeSummary();
+		else m_summaryValid = false;
+		return stats;
+	}
+	BeliefTracker tracker(size_t task) const { return m_trackers[task]; }
+	BeliefStats keep(BeliefTracker& track)
+	{
+		m_trackers[track.task] = std::move(track);
+		return m_trackers[track.task].stats;
+	}
+	// the marginal is being tracked: each task must update all headings of its cells, in order
+	bool groupsHeadings() const { return m_groupBands; }
+	// tracker for heading h of a forEachBand kernel; the first heading clears the band's marginal
+	BeliefTracker bandTracker(int h, int yFirst, int yLast)
+	{
+		BeliefTracker track = m_trackers[(size_t)h * bandCount() + (yFirst - 1) / BAND_ROWS];
+		if (h == 0 && track.marginal) std::fill(&m_marginal[index(0, yFirst)], &m_marginal[index(0, yLast + 1)], 0.0);
+		return track;
+	}
+	// logical heading of physical plane q
+	int headingOfPlane(int q) const { return (q - m_headingOffset % m_headings + m_headings) % m_headings; }
+	int planeOfHeading(int heading) const { return (heading + m_headingOffset) % m_headings; }
+
+	// Sparse mode: replaces the active cells of headings [headingFirst, headingFirst + headingCount)
+	// by the mass they push along outgoing(h, k, emit), which calls emit(hDst, kDst, weight)
+	// for every transition out of cell k of heading h. Returns stats of the pushed mass.
+	template <typename F>
+	BeliefStats pushActive(int headingFirst, int headingCount, F outgoing)
+	{
+		double* p = data.data();
+		std::vector<std::pair<size_t, double>> moving;
+		std::vector<size_t> staying;
+		for (size_t i : m_active)
+		{
+			int h = headingOfPlane((int)(i / m_planeSize));
+			if (h < headingFirst || h >= headingFirst + headingCount)
 			{
-				if (cells[i][j] == eCellOccupancy::Wall) continue; // skip walls
+				staying.push_back(i);
+				continue;
+			}
+			moving.emplace_back(i, p[i]);
+			p[i] = 0.0;
+			m_activeMark[i] = 0;
+		}
+		m_active.swap(staying);
 
-				double probValue = data[i][j] * mm.pFail; 
+		std::vector<size_t> reached;
+		for (const std::pair<size_t, double>& m : moving)
+		{
+			const double value = m.second;
+			outgoing(headingOfPlane((int)(m.first / m_planeSize)), (size_t)(m.first % m_planeSize), [&](int h, size_t k, double weight)
+			{
+				if (weight == 0.0) return;
+				size_t j = planeOfHeading(h) * m_planeSize + k;
+				p[j] += value * weight;
+				if (!m_activeMark[j])
+				{
+					m_activeMark[j] = 1;
+					m_active.push_back(j);
+					reached.push_back(j);
+				}
+			});
+		}
+		std::sort(m_active.begin(), m_active.end());
 
-				if (cells[i + di][j + dj] == eCellOccupancy::Empty) probValue += (data[i + di][j + dj] * mm.pSuccess);
+		return tracked(1, headingCount == m_headings, [&](auto collect)
+		{
+			BeliefTracker track = tracker(0);
+			for (size_t j : reached) track.add(collect, p[j], j);
+			return keep(track);
+		});
+	}
 
-				// probValue = pFail of current cell + pSuccess from previous cell
-				dataCopy[i][j] = probValue;
+	void applyFilter(int heading, Filter f, SensorModel sm)
+	{
+		applyFilter(heading, LikelihoodTable(f, sm));
+	}
+	// sensor update as one gather-multiply pass, t built from the Filter rotated into the heading's frame
+	BeliefStats applyFilter(int heading, const LikelihoodTable& t)
+	{
+		return applyFilter(heading, 1, &t);
+	}
+	// all headings in one sweep over the volume, tables[h] for heading h
+	BeliefStats applyFilter(const LikelihoodTable* tables)
+	{
+		return applyFilter(0, m_headings, tables);
+	}
+	BeliefStats applyFilter(Filter f, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = headingTables(f, sm);
+		return applyFilter(tables.data());
+	}
+	// Likelihood table of every heading bin for a reading f in the robot frame.
+	// Each of the four sensor directions is rotated by the bin angle; one that falls between
+	// two cardinal neighbors reads either of them, weighted by angular distance.
+	std::vector<LikelihoodTable> headingTables(Filter f, const SensorModel& sm) const
+	{
+		return headingTables(m_headings, f, sm);
+	}
+	// for engines that do not hold an Environment, see OutOfCoreBelief
+	static std::vector<LikelihoodTable> headingTables(int headings, Filter f, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables(headings);
+		for (int h = 0; h < headings; h++)
+		{
+			const double quarters = headingAngle(headings, h) / 90.0;
+			const int q = (int)quarters;
+			const double w = quarters - q;
+			for (int s = 0; s < SIGNATURE_COUNT; s++)
+			{
+				double probValue = 1.0;
+				for (int d = 0; d < 4; d++) // sensor direction in the robot frame
+				{
+					const eCellOccupancy z = f.side((eDirection)d);
+					const int first = (q + d) % 4, second = (q + d + 1) % 4; // world directions
+					probValue *= sm.probModel[(s >> first) & 1][z] * (1.0 - w) + (w > 0.0 ? sm.probModel[(s >> second) & 1][z] * w : 0.0);
+				}
+				tables[h].p[s] = probValue;
 			}
 		}
-
-		// apply all calculations
-		for (size_t i = 1; i < SIZE_X + 1; i++)
+		return tables;
+	}
+	// Readings taken at the same pose, folded into one table per heading. The tables are
+	// rescaled by a common factor to stay in range, normalization removes it.
+	std::vector<LikelihoodTable> headingTables(const std::vector<Filter>& readings, const SensorModel& sm) const
+	{
+		return headingTables(m_headings, readings, sm);
+	}
+	static std::vector<LikelihoodTable> headingTables(int headings, const std::vector<Filter>& readings, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables(headings);
+		for (LikelihoodTable& t : tables) std::fill(t.p, t.p + SIGNATURE_COUNT, 1.0);
+		for (const Filter& f : readings)
 		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
+			std::vector<LikelihoodTable> single = headingTables(headings, f, sm);
+			double max = 0.0;
+			for (int h = 0; h < headings; h++)
+			{
+				tables[h].multiply(single[h]);
+				max = std::max(max, tables[h].max());
+			}
+			if (max <= 0.0) break;
+			for (LikelihoodTable& t : tables)
 			{
-				data[i][j] = dataCopy[i][j];
+				for (int s = 0; s < SIGNATURE_COUNT; s++) t.p[s] /= max;
 			}
 		}
+		return tables;
+	}
+	// a burst of readings at one pose in a single sweep, normalized once by the caller
+	BeliefStats applyFilters(const std::vector<Filter>& readings, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = headingTables(readings, sm);
+		return applyFilter(tables.data());
+	}
+	BeliefStats applyFilter(int headingFirst, int headingCount, const LikelihoodTable* tables)
+	{
+		if (m_sparse)
+		{
+			return tracked(1, headingCount == m_headings, [&](auto collect)
+			{
+				BeliefTracker track = tracker(0);
+				double* p = data.data();
+				for (size_t i : m_active)
+				{
+					int h = headingOfPlane((int)(i / m_planeSize)) - headingFirst;
+					if (h < 0 || h >= headingCount) continue;
+					p[i] *= tables[h].p[signatures[i % m_planeSize]];
+					track.add(collect, p[i], i);
+				}
+				return keep(track);
+			});
+		}
+		return tracked((size_t)headingCount * bandCount(), headingCount == m_headings, [&](auto collect)
+		{
+			return forEachBand(headingCount, [&](int h, int yFirst, int yLast)
+			{
+				BeliefTracker track = bandTracker(h, yFirst, yLast);
+				const LikelihoodTable& t = tables[h];
+				double* p = plane(headingFirst + h);
+				const size_t base = p - data.data();
+				const uint8_t* sig = signatures.data();
+				for (size_t k = index(0, yFirst), end = index(0, yLast + 1); k < end; k++)
+				{
+					p[k] *= t.p[sig[k]];
+					track.add(collect, p[k], base + k, k);
+				}
+				return keep(track);
+			});
+		});
 	}
 
-	// for gradient
-	double getMax()
+	BeliefStats applyMovement(int heading, eDirection mtype, MovementModel mm)
+	{
+		CellOffset src = sourceOffset(mtype);
+		return applyMovement(heading, 1, &src, mm);
+	}
+	// Forward: every heading plane moves one cell along its own heading
+	BeliefStats moveForward(MovementModel mm)
 	{
-		double max = 0.0;
-		for (size_t i = 1; i < SIZE_X + 1; i++)
+		std::vector<CellOffset> sources(m_headings);
+		for (int h = 0; h < m_headings; h++) sources[h] = forwardSource(h);
+		return applyMovement(0, m_headings, sources.data(), mm);
+	}
+	BeliefStats applyMovement(int headingFirst, int headingCount, const CellOffset* sources, MovementModel mm)
+	{
+		if (m_sparse)
+		{
+			return pushActive(headingFirst, headingCount, [&](int h, size_t k, auto emit)
+			{
+				emit(h, k, mm.pFail);
+				const CellOffset src = sources[h - headingFirst];
+				size_t dst = (size_t)((ptrdiff_t)k - src.dx - (ptrdiff_t)src.dy * m_stride);
+				if (signatures[dst] != WALL_SIGNATURE) emit(h, dst, mm.pSuccess);
+			});
+		}
+
+		// Planes are updated in place, each band sweeping away from its source side so every
+		// source cell is read before it is overwritten. Source rows owned by a neighboring band
+		// are copied to the halo buffer first.
+		const int bands = bandCount();
+		m_halo.resize((size_t)headingCount * bands * m_stride);
+		for (int h = 0; h < headingCount; h++)
 		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
+			int dy = sources[h].dy;
+			if (dy == 0) continue;
+			for (int b = 0; b < bands; b++)
 			{
-				if (data[i][j] > max) max = data[i][j];
+				int y = dy > 0 ? std::min((b + 1) * BAND_ROWS, m_height) + 1 : 1 + b * BAND_ROWS - 1;
+				memcpy(&m_halo[((size_t)h * bands + b) * m_stride], plane(headingFirst + h) + index(0, y), m_stride * sizeof(double));
 			}
 		}
-		return max;
+
+		return tracked((size_t)headingCount * bands, headingCount == m_headings, [&](auto collect)
+		{
+			return forEachBand(headingCount, [&](int h, int yFirst, int yLast)
+			{
+				const int dx = sources[h].dx;
+				const int dy = sources[h].dy;
+				const double* halo = &m_halo[((size_t)h * bands + (yFirst - 1) / BAND_ROWS) * m_stride];
+
+				BeliefTracker track = bandTracker(h, yFirst, yLast);
+				double* p = plane(headingFirst + h);
+				const size_t base = p - data.data();
+				const int y0 = dy < 0 ? yLast : yFirst;
+				const int yStep = dy < 0 ? -1 : 1;
+				const int x0 = dx < 0 ? m_width : 1;
+				const int xStep = dx < 0 ? -1 : 1;
+				for (int y = y0; y >= yFirst && y <= yLast; y += yStep)
+				{
+					double* row = p + index(0, y);
+					const uint64_t* walls = rowWalls(y);
+					const double* srcRow = (y + dy < yFirst || y + dy > yLast) ? halo : p + index(0, y + dy);
+					const size_t rowStart = index(0, y);
+					uint64_t word = walls[x0 >> 6];
+					for (int n = 0, x = x0; n < m_width; n++, x += xStep)
+					{
+						if ((x & 63) == (dx < 0 ? 63 : 0)) // first cell of a word in sweep order
+						{
+							word = walls[x >> 6];
+							if (word == ~0ull) // 64 walls
+							{
+								n += 63;
+								x += 63 * xStep;
+								continue;
+							}
+						}
+						if ((word >> (x & 63)) & 1) continue; // skip walls
+
+						double probValue = row[x] * mm.pFail;
+
+						probValue += (srcRow[x + dx] * mm.pSuccess); // a wall source holds 0
+
+						// probValue = pFail of current cell + pSuccess from previous cell
+						row[x] = probValue;
+						track.add(collect, probValue, base + rowStart + x, rowStart + x);
+					}
+				}
+				return keep(track);
+			});
+		});
+	}
+
+	// Turn by `bins` heading bins, see HeadingTurn
+	BeliefStats applyTurn(int bins, MovementModel mm)
+	{
+		const int n = m_headings;
+		const HeadingTurn turn(n, bins, mm);
+		if (!turn.blends())
+		{
+			m_headingOffset = turn.offset(m_headingOffset);
+			return m_stats;
+		}
+
+		if (m_sparse)
+		{
+			return pushActive(0, n, [&](int h, size_t k, auto emit)
+			{
+				emit(h, k, mm.pFail);
+				emit((h + n - turn.shift) % n, k, mm.pSuccess);
+			});
+		}
+
+		m_headingOffset = turn.offset(m_headingOffset);
+		return tracked(bandCount(), true, [&](auto collect)
+		{
+			return forEachBand(1, [&](int, int yFirst, int yLast) // all planes per cell
+			{
+				BeliefTracker track = bandTracker(0, yFirst, yLast);
+				std::vector<double> old(n);
+				double* p = data.data();
+				for (size_t k = index(0, yFirst), end = index(0, yLast + 1); k < end; k++)
+				{
+					for (int q = 0; q < n; q++) old[q] = p[q * m_planeSize + k];
+					for (int q = 0; q < n; q++)
+					{
+						double probValue = turn.blend(old[q], old[turn.from(q)]);
+						p[q * m_planeSize + k] = probValue;
+						track.add(collect, probValue, q * m_planeSize + k, k);
+					}
+				}
+				return keep(track);
+			});
+		});
+	}
+	// heading bins in a 90 degree turn
+	int quarterTurnBins() const { return quarterTurnBins(m_headings); }
+	static int quarterTurnBins(int headings) { return std::max(1, (headings + 2) / 4); }
+
+	// source cell offset: the robot arrives from the cell behind it
+	static CellOffset sourceOffset(eDirection mtype)
+	{
+		switch (mtype)
+		{
+		case eDirection::Up: return { 0, 1 };
+		case eDirection::Right: return { -1, 0 };
+		case eDirection::Down: return { 0, -1 };
+		default: return { 1, 0 };
+		}
+	}
+	// source cell for a one-cell forward move of heading bin h, rounded to the 8-neighborhood
+	CellOffset forwardSource(int heading) const { return forwardSource(m_headings, heading); }
+	static CellOffset forwardSource(int headings, int heading)
+	{
+		const double rad = headingAngle(headings, heading) * 3.14159265358979323846 / 180.0;
+		return { -(int)std::lround(std::sin(rad)), (int)std::lround(std::cos(rad)) };
+	}
+
+	// Whole-volume reductions: border and wall cells hold 0, so bands span full rows
+
+	BeliefStats getStats()
+	{
+		if (m_sparse)
+		{
+			return tracked(1, true, [&](auto collect)
+			{
+				BeliefTracker track = tracker(0);
+				for (size_t i : m_active) track.add(collect, data[i], i);
+				return keep(track);
+			});
+		}
+		return tracked((size_t)m_headings * bandCount(), true, [&](auto collect)
+		{
+			return forEachBand(m_headings, [&](int h, int yFirst, int yLast)
+			{
+				BeliefTracker track = bandTracker(h, yFirst, yLast);
+				const double* p = plane(h);
+				const size_t base = p - data.data();
+				for (size_t k = index(0, yFirst), end = index(0, yLast + 1); k < end; k++)
+				{
+					track.add(collect, p[k], base + k, k);
+				}
+				return keep(track);
+			});
+		});
+	}
+	// for gradient
+	double getMax()
+	{
+		return getStats().max;
 	}
 	// for normalizing
 	double getSum()
 	{
-		double result = 0.0;
-		for (size_t i = 1; i < SIZE_X + 1; i++)
+		return getStats().sum;
+	}
+
+	void normalizeWithSum(double sum)
+	{
+		const double scale = 1.0 / sum;
+		if (m_sparse)
 		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
+			for (size_t i : m_active) data[i] = data[i] * scale;
+			return;
+		}
+		forEachBand(m_headings, [&](int h, int yFirst, int yLast)
+		{
+			double* p = plane(h);
+			for (size_t k = index(0, yFirst), end = index(0, yLast + 1); k < end; k++)
 			{
-				result += data[i][j];
+				p[k] = p[k] * scale;
 			}
+			return BeliefStats();
+		});
+	}
+	// Lazy normalization: stats returned by an update kernel only set the scale factor.
+	// The data itself is rescaled when its sum drifts towards underflow or overflow.
+	// Returns the normalized stats.
+	BeliefStats normalize(const BeliefStats& stats)
+	{
+		if (stats.sum <= 0.0) return stats; // nothing to normalize
+		// stats of neither the tracked kernel nor unchanged data: data was written by other code
+		if (!sameStats(stats, m_summary.stats) && !sameStats(stats, m_stats)) m_summaryValid = false;
+
+		BeliefStats result = normalizeLazily(stats, m_scale, m_stats, [&](double sum) { normalizeWithSum(sum); });
+		updateRepresentation();
+		return result;
+	}
+	// The lazy normalization above for any belief that keeps stored values and a scale:
+	// divideBy(sum) divides every stored value, it runs only when the sum leaves
+	// [RESCALE_MIN, RESCALE_MAX]. Updates scale and stored (the stats of the stored values).
+	template <typename F>
+	static BeliefStats normalizeLazily(const BeliefStats& stats, double& scale, BeliefStats& stored, F divideBy)
+	{
+		if (stats.sum <= 0.0) return stats;
+		BeliefStats result;
+		result.sum = 1.0;
+		result.max = stats.max / stats.sum;
+
+		if (stats.sum < RESCALE_MIN || stats.sum > RESCALE_MAX)
+		{
+			divideBy(stats.sum);
+			scale = 1.0;
+			stored = result;
+		}
+		else
+		{
+			scale = 1.0 / stats.sum;
+			stored = stats;
 		}
 		return result;
 	}
 
-	void normalizeWithSum(double sum)
+	// Shannon entropy of the normalized belief, in nats
+	double entropy()
+	{
+		if (m_summaryValid) return trackedEntropy(); // collected by the last kernel
+		// with p = v * scale: H = -sum(p log p) = -scale * sum(v log v) - log(scale)
+		auto plogp = [](const double* p, size_t first, size_t end)
+		{
+			double result = 0.0;
+			for (size_t k = first; k < end; k++)
+			{
+				if (p[k] > 0.0) result += p[k] * std::log(p[k]);
+			}
+			return result;
+		};
+		double sum = 0.0;
+		if (m_sparse)
+		{
+			for (size_t i : m_active) sum += plogp(data.data(), i, i + 1);
+		}
+		else
+		{
+			sum = forEachBand(m_headings, [&](int h, int yFirst, int yLast)
+			{
+				BeliefStats stats;
+				stats.sum = plogp(plane(h), index(0, yFirst), index(0, yLast + 1));
+				return stats;
+			}).sum;
+		}
+		return -m_scale * sum - std::log(m_scale);
+	}
+
+	// Switches between dense and sparse mode after a normalized step, see SPARSE_ENTER
+	void updateRepresentation()
+	{
+		if (!m_sparseAllowed) return;
+		const double volume = (double)m_headings * freeCells.size();
+		if (m_sparse)
+		{
+			prune();
+			if (m_active.size() > SPARSE_EXIT * volume) leaveSparse();
+			return;
+		}
+		if (++m_stepsSinceCheck < SPARSE_CHECK_INTERVAL) return;
+		m_stepsSinceCheck = 0;
+		if (std::exp(entropy()) < SPARSE_ENTER * volume) enterSparse();
+	}
+	void enterSparse()
 	{
-		for (size_t i = 1; i < SIZE_X + 1; i++)
+		if (m_sparse) return;
+		m_activeMark.assign(data.size(), 0);
+		m_active.clear();
+		for (size_t i = 0; i < data.size(); i++)
 		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
+			if (data[i] == 0.0) continue;
+			m_active.push_back(i);
+			m_activeMark[i] = 1;
+		}
+		m_sparse = true;
+		if (m_trackMarginal)
+		{
+			std::fill(m_marginal.begin(), m_marginal.end(), 0.0);
+			m_marginalCells.clear();
+		}
+		prune();
+		if (m_trackMarginal) buildSparseMarginal();
+	}
+	void leaveSparse()
+	{
+		if (!m_sparse) return;
+		m_sparse = false;
+		m_active.clear();
+		m_activeMark.clear();
+		m_stepsSinceCheck = 0;
+	}
+	// drops active cells below PRUNE_EPSILON, the dropped mass is added to prunedMass
+	void prune()
+	{
+		const double threshold = PRUNE_EPSILON / m_scale;
+		double dropped = 0.0;
+		size_t kept = 0;
+		for (size_t i : m_active)
+		{
+			if (data[i] >= threshold)
 			{
-				data[i][j] = data[i][j] / sum;
+				m_active[kept++] = i;
+				continue;
 			}
+			dropped += data[i];
+			data[i] = 0.0;
+			m_activeMark[i] = 0;
+		}
+		m_active.resize(kept);
+		m_stats.sum -= dropped;
+		m_prunedMass += dropped * m_scale;
+	}
+	// fold the pending scale into data, for consumers that read data directly
+	void applyScale()
+	{
+		if (m_scale == 1.0) return;
+		normalizeWithSum(1.0 / m_scale);
+		m_stats.sum *= m_scale;
+		m_stats.max *= m_scale;
+		m_scale = 1.0;
+	}
+
+private:
+	static bool sameStats(const BeliefStats& a, const BeliefStats& b) { return a.sum == b.sum && a.max == b.max; }
+	BeliefCell cellOf(size_t i, double value) const
+	{
+		BeliefCell c;
+		const size_t k = i % m_planeSize;
+		c.heading = headingOfPlane((int)(i / m_planeSize));
+		c.x = (int)(k % m_stride);
+		c.y = (int)(k / m_stride);
+		c.p = m_summary.stats.sum > 0.0 ? value / m_summary.stats.sum : 0.0;
+		return c;
+	}
+	void mergeSummary()
+	{
+		m_summary = m_trackers[0];
+		for (size_t t = 1; t < m_trackerCount; t++) m_summary.add(m_trackers[t]);
+		std::sort(m_summary.top.begin(), m_summary.top.end(), std::greater<BeliefTracker::Entry>());
+		if (m_trackMarginal && m_sparse) buildSparseMarginal();
+		m_summaryValid = true;
+	}
+	// marginal of the active cells, clearing the entries of the previous ones
+	void buildSparseMarginal()
+	{
+		for (uint32_t k : m_marginalCells) m_marginal[k] = 0.0;
+		m_marginalCells.clear();
+		for (size_t i : m_active)
+		{
+			const uint32_t k = (uint32_t)(i % m_planeSize); // a plane index fits, like GridMap::freeCells
+			if (m_marginal[k] == 0.0) m_marginalCells.push_back(k);
+			m_marginal[k] += data[i];
 		}
 	}
 };
\ No newline at end of file
@@ -0,0 +1,241 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Eigen/SparseCore>
+#include "MarkovClasses.h"
+
+
+// One possible result of a motion command, in the robot frame
+struct MotionOutcome
+{
+	int forward = 0; // cells along the heading
+	int lateral = 0; // cells to the right of the heading
+	double p = 0.0;
+};
+
+// Motion noise as a list of outcomes.
+// An outcome whose path crosses a wall loses its mass, like pSuccess in Environment::applyMovement.
+struct MotionNoise
+{
+	std::vector<MotionOutcome> outcomes;
+
+	MotionNoise() {}
+	// same model as Environment::moveForward: stay with pFail, one cell forward with pSuccess
+	explicit MotionNoise(const MovementModel& mm)
+	{
+		outcomes.push_back({ 0, 0, mm.pFail });
+		outcomes.push_back({ 1, 0, mm.pSuccess });
+	}
+	// `cells` forward, overshooting by one cell or slipping one cell to either side
+	static MotionNoise forward(int cells, double pStay, double pOvershoot, double pSlip)
+	{
+		MotionNoise noise;
+		noise.outcomes.push_back({ 0, 0, pStay });
+		noise.outcomes.push_back({ cells, 0, 1.0 - pStay - pOvershoot - pSlip });
+		noise.outcomes.push_back({ cells + 1, 0, pOvershoot });
+		noise.outcomes.push_back({ cells, -1, pSlip / 2 });
+		noise.outcomes.push_back({ cells, 1, pSlip / 2 });
+		return noise;
+	}
+};
+
+typedef Eigen::SparseMatrix<double, Eigen::RowMajor, int32_t> TransitionMatrix;
+typedef Eigen::SparseMatrix<double, Eigen::ColMajor, int32_t> TransitionColumns;
+
+// Free-cell vectors of every heading plane for the dense MotionOperator::apply, kept between steps
+struct MotionScratch
+{
+	std::vector<Eigen::VectorXd> in, out;
+
+	void fit(int planes, int n)
+	{
+		if (in.size() == (size_t)planes && (planes == 0 || in[0].size() == n)) return;
+		in.assign(planes, Eigen::VectorXd(n));
+		out.assign(planes, Eigen::VectorXd(n));
+	}
+};
+
+// Transition operator of one action over the free cells of a map.
+// For heading h: new = headings[h] * old, both indexed by Environment::freeCells.
+class MotionOperator
+{
+public:
+	static const int ROW_CHUNK = 32768; // matrix rows per parallel task
+	std::vector<TransitionMatrix> headings;
+	std::vector<TransitionColumns> columns; // same operators by source cell, for sparse mode
+	MotionScratch m_scratch; // of apply(env)
+
+public:
+	MotionOperator() {}
+	MotionOperator(const Environment& env, const MotionNoise& noise)
+	{
+		const int n = (int)env.freeCells.size();
+		headings.resize(env.headings());
+		columns.resize(env.headings());
+		for (int h = 0; h < env.headings(); h++)
+		{
+			std::vector<CellOffset> offsets;
+			for (const MotionOutcome& o : noise.outcomes) offsets.push_back(displacement(env, h, o));
+
+			std::vector<Eigen::Triplet<double, int32_t>> triplets;
+			triplets.reserve((size_t)n * offsets.size());
+			for (int src = 0; src < n; src++)
+			{
+				int x = (int)(env.freeCells[src] % env.stride());
+				int y = (int)(env.freeCells[src] / env.stride());
+				for (size_t k = 0; k < offsets.size(); k++)
+				{
+					if (noise.outcomes[k].p == 0.0 || !pathFree(env, x, y, offsets[k])) continue;
+					int dst = env.freeIndex[env.index(x + offsets[k].dx, y + offsets[k].dy)];
+					triplets.emplace_back(dst, src, noise.outcomes[k].p);
+				}
+			}
+			headings[h].resize(n, n);
+			headings[h].setFromTriplets(triplets.begin(), triplets.end()); // duplicates are summed
+			columns[h] = headings[h];
+		}
+	}
+
+	// robot-frame outcome as a cell offset for heading bin h, rounded to whole cells
+	static CellOffset displacement(const Environment& env, int heading, const MotionOutcome& o)
+	{
+		const double rad = env.headingAngle(heading) * 3.14159265358979323846 / 180.0;
+		const double s = std::sin(rad);
+		const double c = std::cos(rad);
+		return { (int)std::lround(o.forward * s + o.lateral * c), (int)std::lround(-o.forward * c + o.lateral * s) };
+	}
+
+	// every cell on the straight line to (x + d.dx, y + d.dy) is free; the border stops it at the map edge
+	static bool pathFree(const Environment& env, int x, int y, CellOffset d)
+	{
+		const int steps = std::max(std::abs(d.dx), std::abs(d.dy));
+		for (int k = 1; k <= steps; k++)
+		{
+			int cx = x + (int)std::lround((double)k * d.dx / steps);
+			int cy = y + (int)std::lround((double)k * d.dy / steps);
+			if (env.cell(cx, cy) == eCellOccupancy::Wall) return false;
+		}
+		return true;
+	}
+
+	// Prediction step: one sparse matrix-vector product per heading plane
+	BeliefStats apply(Environment& env) { return apply(env, m_scratch); }
+	// same with the caller's scratch, so one operator can run on several beliefs at once
+	BeliefStats apply(Environment& env, MotionScratch& scratch) const
+	{
+		if (env.isSparse())
+		{
+			return env.pushActive(0, env.headings(), [&](int h, size_t k, auto emit)
+			{
+				for (TransitionColumns::InnerIterator it(columns[h], env.freeIndex[k]); it; ++it)
+				{
+					emit(h, env.freeCells[it.row()], it.value());
+				}
+			});
+		}
+
+		const int planes = (int)headings.size();
+		const int n = (int)env.freeCells.size();
+		const uint32_t* free = env.freeCells.data();
+		scratch.fit(planes, n);
+		std::vector<Eigen::VectorXd>& in = scratch.in;
+		std::vector<Eigen::VectorXd>& out = scratch.out;
+		std::function<void(size_t)> gather = [&](size_t h)
+		{
+			const double* p = env.plane((int)h);
+			for (int i = 0; i < n; i++) in[h][i] = p[free[i]];
+		};
+		if (env.threadPool()) env.threadPool()->parallelFor(planes, gather);
+		else for (int h = 0; h < planes; h++) gather(h);
+
+		const int chunks = std::max(1, (n + ROW_CHUNK - 1) / ROW_CHUNK);
+		const size_t count = (size_t)planes * chunks;
+		std::vector<BeliefStats> partial(count);
+		return env.tracked(count, planes == env.headings(), [&](auto collect)
+		{
+			std::function<void(size_t)> task = [&](size_t t)
+			{
+				const int h = (int)(t / chunks);
+				const int first = (int)(t % chunks) * ROW_CHUNK;
+				const int rows = std::min(ROW_CHUNK, n - first);
+				if (rows <= 0) return;
+
+				out[h].segment(first, rows).noalias() = headings[h].middleRows(first, rows) * in[h];
+
+				BeliefTracker track = env.tracker(t);
+				double* p = env.plane(h);
+				const size_t base = p - env.data.data();
+				if (h == 0 && track.marginal)
+				{
+					for (int i = first; i < first + rows; i++) track.marginal[free[i]] = 0.0;
+				}
+				for (int i = first; i < first + rows; i++)
+				{
+					p[free[i]] = out[h][i];
+					track.add(collect, out[h][i], base + free[i], free[i]);
+				}
+				partial[t] = env.keep(track);
+			};
+			std::function<void(size_t)> chunkTask = [&](size_t c) // all headings, see Environment::groupsHeadings
+			{
+				for (int h = 0; h < planes; h++) task((size_t)h * chunks + c);
+			};
+			const bool grouped = env.groupsHeadings();
+			if (env.threadPool()) env.threadPool()->parallelFor(grouped ? chunks : count, grouped ? chunkTask : task);
+			else for (size_t t = 0; t < count; t++) task(t);
+
+			BeliefStats stats;
+			for (const BeliefStats& s : partial) stats.add(s);
+			return stats;
+		});
+	}
+};
+
+// Operators built once per action, e.g. "Forward", for the map, heading bins and noise they
+// were built from; a different one of these builds the action's operator again
+class MotionOperatorCache
+{
+private:
+	struct Entry
+	{
+		std::shared_ptr<const GridMap> map; // held, so the map cannot be replaced at the same address
+		int headings = 0;
+		std::vector<MotionOutcome> outcomes;
+		MotionOperator op;
+
+		bool matches(const Environment& env, const MotionNoise& noise) const
+		{
+			if (map != env.map() || headings != env.headings() || outcomes.size() != noise.outcomes.size()) return false;
+			for (size_t k = 0; k < outcomes.size(); k++)
+			{
+				const MotionOutcome& a = outcomes[k];
+				const MotionOutcome& b = noise.outcomes[k];
+				if (a.forward != b.forward || a.lateral != b.lateral || a.p != b.p) return false;
+			}
+			return true;
+		}
+	};
+	std::map<std::string, Entry> m_operators;
+public:
+	MotionOperator& get(const std::string& action, const Environment& env, const MotionNoise& noise)
+	{
+		Entry& e = m_operators[action];
+		if (!e.matches(env, noise))
+		{
+			e.map = env.map();
+			e.headings = env.headings();
+			e.outcomes = noise.outcomes;
+			e.op = MotionOperator(env, noise);
+		}
+		return e.op;
+	}
+	// nullptr when not built for env and noise yet; safe to call from several threads while nothing is built
+	const MotionOperator* find(const std::string& action, const Environment& env, const MotionNoise& noise) const
+	{
+		auto it = m_operators.find(action);
+		return it == m_operators.end() || !it->second.matches(env, noise) ? nullptr : &it->second.op;
+	}
+	void clear() { m_operators.clear(); }
+};
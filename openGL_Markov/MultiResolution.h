@@ -0,0 +1,293 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// Coarse-to-fine localization on an Environment.
+// While the belief is spread out it is kept per heading, block of blockSize x blockSize cells and
+// cell signature: a coarse cell is the set of free cells of one signature inside a block, and the
+// belief is assumed uniform over it. The sensor update is then exact and costs one multiply per
+// coarse cell; only motion mixes the cells of a block. Once the belief has concentrated, the
+// coarse cells holding REFINE_MASS of it are refined into the Environment and its own kernels,
+// sparse mode included, take over. If it spreads out again it is aggregated back.
+class MultiResolutionLocalizer
+{
+private:
+	// Coarse forward move: coarse cell from of block b sends weight * pSuccess of its mass to
+	// coarse cell to of neighbor block n (3x3, row by row), with entries[first[b] .. first[b + 1])
+	struct TransferEntry
+	{
+		uint8_t from;
+		uint8_t neighbor;
+		uint8_t to;
+		float weight;
+	};
+	struct Transfer
+	{
+		std::vector<uint32_t> first;
+		std::vector<TransferEntry> entries;
+	};
+
+public:
+	static const int DEFAULT_BLOCK = 16;
+	static constexpr double REFINE_MASS = 0.999; // part of the coarse belief kept on refinement
+	// refine / coarsen when exp(entropy) falls below / rises above this part of headings * freeCells
+	static constexpr double REFINE_BELOW = 0.05;
+	static constexpr double COARSEN_ABOVE = 0.25;
+
+private:
+	Environment& m_env;
+	int m_block;
+	int m_blocksX, m_blocksY;
+	std::vector<uint32_t> m_count; // [block][signature], free cells per coarse cell
+	std::vector<double> m_logCount; // log of m_count, for perplexity()
+	std::vector<double> m_coarse; // [heading][block][signature], normalized
+	std::map<std::pair<int, int>, Transfer> m_transfer; // by cell offset
+	bool m_refined = false;
+	int m_stepsSinceCheck = 0;
+	double m_droppedMass = 0.0; // coarse mass left out by refine()
+
+public:
+	MultiResolutionLocalizer(Environment& env, int blockSize = DEFAULT_BLOCK) : m_env(env), m_block(blockSize)
+	{
+		m_blocksX = (env.width() + m_block - 1) / m_block;
+		m_blocksY = (env.height() + m_block - 1) / m_block;
+		m_count.assign(coarseCells(), 0);
+		for (uint32_t k : env.freeCells) m_count[coarseOf(k)]++;
+		for (uint32_t c : m_count) m_logCount.push_back(c > 0 ? std::log((double)c) : 0.0);
+		coarsen();
+	}
+
+	int blocks() const { return m_blocksX * m_blocksY; }
+	int coarseCells() const { return blocks() * SIGNATURE_COUNT; } // per heading
+	int blockSize() const { return m_block; }
+	bool isRefined() const { return m_refined; }
+	double droppedMass() const { return m_droppedMass; }
+
+	// block of the cell at volume index k
+	int blockOf(size_t k) const
+	{
+		int x = (int)(k % m_env.stride()) - 1;
+		int y = (int)(k / m_env.stride()) - 1;
+		return (y / m_block) * m_blocksX + x / m_block;
+	}
+	// coarse cell of the free cell at volume index k
+	int coarseOf(size_t k) const { return blockOf(k) * SIGNATURE_COUNT + m_env.signatures[k]; }
+	double coarseProbability(int heading, int coarse) const { return m_coarse[(size_t)heading * coarseCells() + coarse]; }
+
+	// normalized belief at a cell, its share of the coarse cell while coarse
+	double probability(int heading, int x, int y)
+	{
+		if (m_refined) return m_env.probability(heading, x, y);
+		size_t k = m_env.index(x, y);
+		if (m_env.signatures[k] == WALL_SIGNATURE) return 0.0;
+		int c = coarseOf(k);
+		return coarseProbability(heading, c) / m_count[c];
+	}
+
+	// Updates return the stats of the normalized belief, max per cell
+	BeliefStats normalize(const BeliefStats& stats) const { return stats; }
+
+	BeliefStats applyFilter(Filter f, const SensorModel& sm)
+	{
+		if (m_refined) return finishFine(m_env.applyFilter(f, sm));
+
+		std::vector<LikelihoodTable> tables = m_env.headingTables(f, sm);
+		forEachHeading([&](int h)
+		{
+			double* c = &m_coarse[(size_t)h * coarseCells()];
+			for (int i = 0; i < coarseCells(); i++) c[i] *= tables[h].p[i % SIGNATURE_COUNT];
+		});
+		return finishCoarse();
+	}
+
+	BeliefStats moveForward(MovementModel mm)
+	{
+		if (m_refined) return finishFine(m_env.moveForward(mm));
+
+		std::vector<const Transfer*> transfers;
+		for (int h = 0; h < m_env.headings(); h++) transfers.push_back(&transfer(m_env.forwardSource(h)));
+		std::vector<double> old = m_coarse;
+		forEachHeading([&](int h)
+		{
+			const Transfer& t = *transfers[h];
+			const double* src = &old[(size_t)h * coarseCells()];
+			double* dst = &m_coarse[(size_t)h * coarseCells()];
+			for (int i = 0; i < coarseCells(); i++) dst[i] = src[i] * mm.pFail;
+			for (int b = 0; b < blocks(); b++)
+			{
+				const double* from = src + (size_t)b * SIGNATURE_COUNT;
+				for (uint32_t e = t.first[b]; e < t.first[b + 1]; e++)
+				{
+					const TransferEntry& entry = t.entries[e];
+					if (from[entry.from] == 0.0) continue;
+					int n = b + (entry.neighbor / 3 - 1) * m_blocksX + entry.neighbor % 3 - 1;
+					dst[(size_t)n * SIGNATURE_COUNT + entry.to] += from[entry.from] * mm.pSuccess * entry.weight;
+				}
+			}
+		});
+		return finishCoarse();
+	}
+
+	// same operator as Environment::applyTurn
+	BeliefStats applyTurn(int bins, MovementModel mm)
+	{
+		if (m_refined) return finishFine(m_env.applyTurn(bins, mm));
+
+		const int n = m_env.headings();
+		const int shift = ((bins % n) + n) % n;
+		std::vector<double> old = m_coarse;
+		for (int h = 0; h < n; h++)
+		{
+			const double* self = &old[(size_t)h * coarseCells()];
+			const double* other = &old[(size_t)((h + shift) % n) * coarseCells()];
+			double* dst = &m_coarse[(size_t)h * coarseCells()];
+			for (int i = 0; i < coarseCells(); i++) dst[i] = self[i] * mm.pFail + other[i] * mm.pSuccess;
+		}
+		return finishCoarse();
+	}
+
+	// Moves the belief to full resolution: the most probable coarse cells up to REFINE_MASS are
+	// spread evenly over their free cells, the rest is dropped. Returns the normalized stats.
+	BeliefStats refine()
+	{
+		if (m_refined) return m_env.normalize(m_env.getStats());
+		std::vector<size_t> order;
+		for (size_t i = 0; i < m_coarse.size(); i++) if (m_coarse[i] > 0.0) order.push_back(i);
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return m_coarse[a] > m_coarse[b]; });
+
+		std::vector<double> kept(m_coarse.size(), 0.0);
+		double mass = 0.0;
+		for (size_t i = 0; i < order.size() && mass < REFINE_MASS; i++)
+		{
+			kept[order[i]] = m_coarse[order[i]];
+			mass += m_coarse[order[i]];
+		}
+		m_droppedMass += 1.0 - mass;
+
+		m_env.leaveSparse();
+		std::fill(m_env.data.data(), m_env.data.data() + m_env.data.size(), 0.0);
+		for (int h = 0; h < m_env.headings(); h++)
+		{
+			double* p = m_env.plane(h);
+			for (uint32_t k : m_env.freeCells)
+			{
+				int c = coarseOf(k);
+				p[k] = kept[(size_t)h * coarseCells() + c] / m_count[c];
+			}
+		}
+		m_refined = true;
+		return m_env.normalize(m_env.getStats());
+	}
+	// aggregates the Environment's belief into coarse cells
+	void coarsen()
+	{
+		m_coarse.assign((size_t)m_env.headings() * coarseCells(), 0.0);
+		for (int h = 0; h < m_env.headings(); h++)
+		{
+			double* c = &m_coarse[(size_t)h * coarseCells()];
+			for (uint32_t k : m_env.freeCells) c[coarseOf(k)] += m_env.probability(h, (int)(k % m_env.stride()), (int)(k / m_env.stride()));
+		}
+		m_refined = false;
+		normalizeCoarse();
+	}
+
+private:
+	// coarse forward move for cells arriving from `source`, share of each coarse cell's free cells per target
+	const Transfer& transfer(CellOffset source)
+	{
+		std::pair<int, int> key(source.dx, source.dy);
+		auto it = m_transfer.find(key);
+		if (it != m_transfer.end()) return it->second;
+
+		Transfer& t = m_transfer[key];
+		t.first.push_back(0);
+		const ptrdiff_t move = -((ptrdiff_t)source.dy * m_env.stride() + source.dx);
+		std::vector<float> weight(SIGNATURE_COUNT * 9 * SIGNATURE_COUNT); // [from][neighbor][to]
+		for (int b = 0; b < blocks(); b++)
+		{
+			std::fill(weight.begin(), weight.end(), 0.0f);
+			const int x0 = 1 + (b % m_blocksX) * m_block;
+			const int y0 = 1 + (b / m_blocksX) * m_block;
+			for (int y = y0; y < std::min(y0 + m_block, m_env.height() + 1); y++)
+			{
+				for (int x = x0; x < std::min(x0 + m_block, m_env.width() + 1); x++)
+				{
+					size_t k = m_env.index(x, y);
+					size_t dst = k + move;
+					// the mass of cells moving into a wall is lost
+					if (m_env.signatures[k] == WALL_SIGNATURE || m_env.signatures[dst] == WALL_SIGNATURE) continue;
+					int d = blockOf(dst);
+					int n = (d / m_blocksX - b / m_blocksX + 1) * 3 + d % m_blocksX - b % m_blocksX + 1;
+					weight[(m_env.signatures[k] * 9 + n) * SIGNATURE_COUNT + m_env.signatures[dst]] += 1.0f / m_count[coarseOf(k)];
+				}
+			}
+			for (int i = 0; i < (int)weight.size(); i++)
+			{
+				if (weight[i] == 0.0f) continue;
+				int from = i / (9 * SIGNATURE_COUNT);
+				t.entries.push_back({ (uint8_t)from, (uint8_t)(i / SIGNATURE_COUNT % 9), (uint8_t)(i % SIGNATURE_COUNT), weight[i] });
+			}
+			t.first.push_back((uint32_t)t.entries.size());
+		}
+		return t;
+	}
+
+	// fn(h) for every heading, on the Environment's pool
+	template <typename F>
+	void forEachHeading(F fn)
+	{
+		std::function<void(size_t)> task = [&](size_t h) { fn((int)h); };
+		if (m_env.threadPool()) m_env.threadPool()->parallelFor(m_env.headings(), task);
+		else for (int h = 0; h < m_env.headings(); h++) task(h);
+	}
+
+	BeliefStats normalizeCoarse()
+	{
+		BeliefStats stats;
+		for (double v : m_coarse) stats.sum += v;
+		if (stats.sum <= 0.0) return stats;
+		BeliefStats result;
+		for (size_t i = 0; i < m_coarse.size(); i++)
+		{
+			m_coarse[i] /= stats.sum;
+			int c = (int)(i % coarseCells());
+			if (m_count[c] > 0) result.add(m_coarse[i] / m_count[c]);
+		}
+		return result;
+	}
+	BeliefStats finishCoarse()
+	{
+		BeliefStats result = normalizeCoarse();
+		if (++m_stepsSinceCheck < Environment::SPARSE_CHECK_INTERVAL) return result;
+		m_stepsSinceCheck = 0;
+		if (perplexity() < REFINE_BELOW * m_env.headings() * m_env.freeCells.size()) result = refine();
+		return result;
+	}
+	BeliefStats finishFine(const BeliefStats& stats)
+	{
+		BeliefStats result = m_env.normalize(stats);
+		if (++m_stepsSinceCheck < Environment::SPARSE_CHECK_INTERVAL) return result;
+		m_stepsSinceCheck = 0;
+		if (std::exp(m_env.entropy()) > COARSEN_ABOVE * m_env.headings() * m_env.freeCells.size()) coarsen();
+		return result;
+	}
+	// exp(entropy) of the fine belief the coarse one stands for
+	double perplexity() const
+	{
+		double entropy = 0.0;
+		for (int h = 0; h < m_env.headings(); h++)
+		{
+			const double* c = &m_coarse[(size_t)h * coarseCells()];
+			for (int i = 0; i < coarseCells(); i++)
+			{
+				if (c[i] > 0.0) entropy -= c[i] * (std::log(c[i]) - m_logCount[i]);
+			}
+		}
+		return std::exp(entropy);
+	}
+};
@@ -0,0 +1,537 @@
+#pragma once
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include "MarkovClasses.h"
+#include "TileStore.h"
+
+
+// Belief for maps whose belief volume does not fit in memory. Map signatures and belief are
+// TILE x TILE pages of memory-mapped files (TileStore): all-wall map tiles and zero belief
+// tiles are not in the files at all, and at most `residentTiles` belief tiles are mapped at
+// once. The map is streamed from the text file and never held whole. Updates are the
+// Environment operators (same tables, sources and lazy normalization) run over batches of
+// tiles whose pages are mapped first, then updated on the pool. After normalization, tiles
+// whose largest cell is below Environment::PRUNE_EPSILON are dropped back to zero.
+class OutOfCoreBelief
+{
+public:
+	static const int TILE = 256; // 64 KB of signatures, 512 KB of belief per plane
+	static const int TILE_CELLS = TILE * TILE;
+	static const size_t DEFAULT_RESIDENT = 256; // belief tiles, 128 MB
+
+private:
+	int m_width = 0; // map size
+	int m_height = 0;
+	int m_headings = 4;
+	int m_tilesX = 0, m_tilesY = 0;
+	size_t m_freeCount = 0;
+	ThreadPool* m_pool = nullptr;
+	TileStore<uint8_t> m_signatures; // page = tile, [row][col]
+	TileStore<double> m_belief; // page = plane * tiles + tile, [row][col]
+	std::vector<BeliefStats> m_pageStats; // per belief page, from the last kernel that wrote it
+	std::vector<uint8_t> m_tileFree; // tile has a free cell
+	std::vector<double> m_halo; // source-side columns of one tile row, see movePlane
+	int m_headingOffset = 0; // heading h is stored in plane (h + m_headingOffset) % headings
+	double m_scale = 1.0;
+	BeliefStats m_stats; // of the stored values, at the last normalize()
+	double m_prunedMass = 0.0;
+	bool m_open = false; // map and tile files usable, see isOpen
+
+public:
+	// Tile files get unique names in `directory` and are deleted with the object. At least
+	// max(3, headings) tiles stay resident, the most one batch job maps. Check isOpen().
+	OutOfCoreBelief(const std::string& mapPath, int headings, const std::string& directory,
+		size_t residentTiles = DEFAULT_RESIDENT, ThreadPool* pool = nullptr) : m_headings(std::max(1, headings)), m_pool(pool)
+	{
+		m_open = loadMap(mapPath, directory, residentTiles);
+		resetUniform();
+	}
+
+	// false, after a message box, when the map or a tile file could not be opened or a tile
+	// could not be mapped since; the belief is all 0 then and updates do nothing
+	bool isOpen() const { return m_open; }
+
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	int headings() const { return m_headings; }
+	int tiles() const { return m_tilesX * m_tilesY; }
+	size_t residentTiles() const { return m_belief.residentPages(); }
+	size_t materializedTiles() const { return m_belief.materializedPages(); }
+	double prunedMass() const { return m_prunedMass; }
+
+	double probability(int heading, int x, int y)
+	{
+		if (!m_open) return 0.0;
+		size_t page = pageOf(planeOfHeading(heading), (x - 1) / TILE, (y - 1) / TILE);
+		if (!m_belief.isMaterialized(page)) return 0.0;
+		const double* p = m_belief.read(page);
+		m_belief.beginBatch();
+		if (!usable()) return 0.0;
+		return p[((y - 1) % TILE) * TILE + (x - 1) % TILE] * m_scale;
+	}
+	bool isFree(int x, int y)
+	{
+		if (!m_open) return false;
+		const uint8_t* sig = m_signatures.read((size_t)((y - 1) / TILE) * m_tilesX + (x - 1) / TILE);
+		m_signatures.beginBatch();
+		return usable() && sig[((y - 1) % TILE) * TILE + (x - 1) % TILE] != WALL_SIGNATURE;
+	}
+
+	// uniform over every free cell and heading
+	void resetUniform()
+	{
+		if (!m_open) return;
+		for (size_t page = 0; page < m_belief.pages(); page++) m_belief.release(page);
+		m_pageStats.assign(m_belief.pages(), BeliefStats());
+		std::vector<size_t> pages;
+		for (int q = 0; q < m_headings; q++)
+		{
+			for (int t = 0; t < tiles(); t++)
+			{
+				if (m_tileFree[t]) pages.push_back((size_t)q * tiles() + t);
+			}
+		}
+		forEachPage(pages, [&](size_t, double* p, const uint8_t* sig)
+		{
+			BeliefStats stats;
+			for (int i = 0; i < TILE_CELLS; i++)
+			{
+				p[i] = sig[i] == WALL_SIGNATURE ? 0.0 : 1.0;
+				stats.add(p[i]);
+			}
+			return stats;
+		});
+		m_headingOffset = 0;
+		m_scale = 1.0 / ((double)m_headings * m_freeCount);
+		m_stats = getStats();
+	}
+
+	BeliefStats applyFilter(Filter f, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = Environment::headingTables(m_headings, f, sm);
+		return applyFilter(tables.data());
+	}
+	BeliefStats applyFilters(const std::vector<Filter>& readings, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = Environment::headingTables(m_headings, readings, sm);
+		return applyFilter(tables.data());
+	}
+	// sensor update, tables[h] for heading h; zero tiles stay zero
+	BeliefStats applyFilter(const LikelihoodTable* tables)
+	{
+		return forEachPage(materializedPages(), [&](size_t page, double* p, const uint8_t* sig)
+		{
+			BeliefStats stats;
+			const double* t = tables[headingOfPlane((int)(page / tiles()))].p;
+			for (int i = 0; i < TILE_CELLS; i++)
+			{
+				p[i] *= t[sig[i]];
+				stats.add(p[i]);
+			}
+			return stats;
+		});
+	}
+
+	BeliefStats moveForward(MovementModel mm)
+	{
+		BeliefStats stats;
+		for (int h = 0; h < m_headings; h++) stats.add(movePlane(planeOfHeading(h), Environment::forwardSource(m_headings, h), mm));
+		return stats;
+	}
+	BeliefStats applyMovement(int heading, eDirection mtype, MovementModel mm)
+	{
+		return movePlane(planeOfHeading(heading), Environment::sourceOffset(mtype), mm);
+	}
+
+	// see HeadingTurn; tiles with a materialized plane blend all their planes
+	BeliefStats applyTurn(int bins, MovementModel mm)
+	{
+		const int n = m_headings;
+		const HeadingTurn turn(n, bins, mm);
+		m_headingOffset = turn.offset(m_headingOffset);
+		if (!turn.blends() || !m_open) return m_stats;
+
+		std::vector<int> active;
+		for (int t = 0; t < tiles(); t++)
+		{
+			for (int q = 0; q < n; q++)
+			{
+				if (!m_belief.isMaterialized(pageOf(q, t))) continue;
+				active.push_back(t);
+				break;
+			}
+		}
+		struct Job
+		{
+			int tile;
+			std::vector<double*> p; // per plane
+		};
+		BeliefStats stats = forEachBatch(active.size(), std::max<size_t>(1, m_belief.residentLimit() / n), [&](size_t i)
+		{
+			Job job;
+			job.tile = active[i];
+			for (int q = 0; q < n; q++) job.p.push_back(m_belief.write(pageOf(q, job.tile)));
+			return job;
+		}, [&](const Job& job)
+		{
+			std::vector<BeliefStats> planeStats(n);
+			std::vector<double> old(n);
+			for (int i = 0; i < TILE_CELLS; i++)
+			{
+				for (int q = 0; q < n; q++) old[q] = job.p[q][i];
+				for (int q = 0; q < n; q++)
+				{
+					double probValue = turn.blend(old[q], old[turn.from(q)]);
+					job.p[q][i] = probValue;
+					planeStats[q].add(probValue);
+				}
+			}
+			BeliefStats stats;
+			for (int q = 0; q < n; q++)
+			{
+				m_pageStats[pageOf(q, job.tile)] = planeStats[q];
+				stats.add(planeStats[q]);
+			}
+			return stats;
+		});
+		releaseZeroPages();
+		return stats;
+	}
+
+	// of the stored values, from the per-tile stats of the last kernels
+	BeliefStats getStats() const
+	{
+		BeliefStats stats;
+		for (size_t page = 0; page < m_belief.pages(); page++)
+		{
+			if (m_belief.isMaterialized(page)) stats.add(m_pageStats[page]);
+		}
+		return stats;
+	}
+	// returns the normalized stats, then prunes
+	BeliefStats normalize(const BeliefStats& stats)
+	{
+		if (stats.sum <= 0.0) return stats;
+		BeliefStats result = Environment::normalizeLazily(stats, m_scale, m_stats, [&](double sum)
+		{
+			const double factor = 1.0 / sum;
+			forEachPage(materializedPages(), [&](size_t, double* p, const uint8_t*)
+			{
+				BeliefStats stats;
+				for (int i = 0; i < TILE_CELLS; i++)
+				{
+					p[i] *= factor;
+					stats.add(p[i]);
+				}
+				return stats;
+			});
+		});
+		prune();
+		return result;
+	}
+
+private:
+	// false once either store failed to map a page, see TileStore::failed
+	bool usable()
+	{
+		if (m_belief.failed() || m_signatures.failed()) m_open = false;
+		return m_open;
+	}
+	int planeOfHeading(int heading) const { return (heading + m_headingOffset) % m_headings; }
+	int headingOfPlane(int q) const { return (q - m_headingOffset % m_headings + m_headings) % m_headings; }
+	size_t pageOf(int q, int tile) const { return (size_t)q * tiles() + tile; }
+	size_t pageOf(int q, int tx, int ty) const { return pageOf(q, ty * m_tilesX + tx); }
+	// page for reading, all zero outside the map
+	const double* readTile(int q, int tx, int ty)
+	{
+		if (tx < 0 || tx >= m_tilesX || ty < 0 || ty >= m_tilesY) return m_belief.fillPage();
+		return m_belief.read(pageOf(q, tx, ty));
+	}
+	bool isMaterialized(int q, int tx, int ty) const
+	{
+		if (tx < 0 || tx >= m_tilesX || ty < 0 || ty >= m_tilesY) return false;
+		return m_belief.isMaterialized(pageOf(q, tx, ty));
+	}
+
+	// Streams the text map (see GridMap::load) three rows at a time into
+	// signature tiles, one tile row buffered.
+	bool loadMap(const std::string& mapPath, const std::string& directory, size_t residentTiles)
+	{
+		std::ifstream file(mapPath);
+		if (!file.is_open())
+		{
+			std::string output = "Error: Unable to open file: ";
+			output += mapPath;
+			MessageBoxA(0, output.c_str(), "Error", MB_OK);
+			return false;
+		}
+		auto nextLine = [&](std::string& line)
+		{
+			while (std::getline(file, line))
+			{
+				if (!line.empty() && line.back() == '\r') line.pop_back();
+				if (!line.empty()) return true;
+			}
+			line.clear();
+			return false;
+		};
+
+		std::string line;
+		size_t width = 0;
+		m_height = 0;
+		while (nextLine(line))
+		{
+			width = std::max(width, line.size());
+			m_height++;
+		}
+		m_width = (int)width;
+		m_tilesX = (m_width + TILE - 1) / TILE;
+		m_tilesY = (m_height + TILE - 1) / TILE;
+		residentTiles = std::max(residentTiles, (size_t)std::max(3, m_headings));
+		std::string signaturePath, beliefPath;
+		if (!tileFile(directory, "sig", signaturePath) || !tileFile(directory, "bel", beliefPath)) return false;
+		if (!m_signatures.open(signaturePath, tiles(), TILE_CELLS, residentTiles, WALL_SIGNATURE)) return false;
+		if (!m_belief.open(beliefPath, (size_t)m_headings * tiles(), TILE_CELLS, residentTiles, 0.0)) return false;
+		m_tileFree.assign(tiles(), 0);
+
+		file.clear();
+		file.seekg(0);
+		std::string above, row, below;
+		nextLine(row);
+		nextLine(below);
+		auto isFree = [&](const std::string& l, int y, int x) { return y >= 1 && y <= m_height && x >= 1 && x <= m_width && GridMap::freeInText(l, x); };
+		std::vector<uint8_t> tileRow((size_t)m_tilesX * TILE_CELLS, WALL_SIGNATURE);
+		m_freeCount = 0;
+		for (int y = 1; y <= m_height; y++)
+		{
+			for (int x = 1; x <= m_width; x++)
+			{
+				if (!isFree(row, y, x)) continue;
+				uint8_t s = 0; // eDirection bits, as in GridMap::computeSignatures
+				if (!isFree(above, y - 1, x)) s |= 1 << eDirection::Up;
+				if (!isFree(row, y, x + 1)) s |= 1 << eDirection::Right;
+				if (!isFree(below, y + 1, x)) s |= 1 << eDirection::Down;
+				if (!isFree(row, y, x - 1)) s |= 1 << eDirection::Left;
+				tileRow[(size_t)((x - 1) / TILE) * TILE_CELLS + ((y - 1) % TILE) * TILE + (x - 1) % TILE] = s;
+				m_freeCount++;
+			}
+			if (y % TILE == 0 || y == m_height)
+			{
+				const int ty = (y - 1) / TILE;
+				for (int tx = 0; tx < m_tilesX; tx++)
+				{
+					const uint8_t* src = &tileRow[(size_t)tx * TILE_CELLS];
+					if (std::all_of(src, src + TILE_CELLS, [](uint8_t s) { return s == WALL_SIGNATURE; })) continue;
+					m_signatures.beginBatch();
+					uint8_t* dst = m_signatures.write(ty * m_tilesX + tx);
+					if (!dst) return false;
+					memcpy(dst, src, TILE_CELLS);
+					m_tileFree[ty * m_tilesX + tx] = 1;
+				}
+				std::fill(tileRow.begin(), tileRow.end(), WALL_SIGNATURE);
+			}
+			above.swap(row);
+			row.swap(below);
+			nextLine(below);
+		}
+		return true;
+	}
+
+	// a new file in `directory` whose name no other instance or process uses
+	static bool tileFile(const std::string& directory, const char* prefix, std::string& path)
+	{
+		char name[MAX_PATH];
+		if (!GetTempFileNameA(directory.c_str(), prefix, 0, name))
+		{
+			std::string output = "Error: Unable to create a tile file in: ";
+			output += directory;
+			MessageBoxA(0, output.c_str(), "Error", MB_OK);
+			return false;
+		}
+		path = name;
+		return true;
+	}
+
+	std::vector<size_t> materializedPages() const
+	{
+		std::vector<size_t> pages;
+		for (size_t page = 0; page < m_belief.pages(); page++)
+		{
+			if (m_belief.isMaterialized(page)) pages.push_back(page);
+		}
+		return pages;
+	}
+
+	// Runs the jobs of items [0, count) in batches of `batch`: prepare(i) maps the pages of
+	// item i and returns its job (serially, through the LRU), then fn(job) runs on the pool.
+	// A batch must not map more than residentLimit pages of either store, see TileStore; when a
+	// page cannot be mapped no more jobs run. Partial stats are combined in item order.
+	template <typename P, typename F>
+	BeliefStats forEachBatch(size_t count, size_t batch, P prepare, F fn)
+	{
+		BeliefStats stats;
+		for (size_t first = 0; first < count && m_open; first += batch)
+		{
+			m_belief.beginBatch();
+			m_signatures.beginBatch();
+			std::vector<decltype(prepare(first))> jobs;
+			for (size_t i = first; i < std::min(count, first + batch); i++) jobs.push_back(prepare(i));
+			if (!usable()) break;
+
+			std::vector<BeliefStats> partial(jobs.size());
+			std::function<void(size_t)> task = [&](size_t i) { partial[i] = fn(jobs[i]); };
+			if (m_pool) m_pool->parallelFor(jobs.size(), task);
+			else for (size_t i = 0; i < jobs.size(); i++) task(i);
+			for (const BeliefStats& p : partial) stats.add(p);
+		}
+		m_belief.beginBatch(); // nothing stays pinned
+		m_signatures.beginBatch();
+		return stats;
+	}
+	// fn(page, values, signatures) for every listed page, in place; records the page stats
+	template <typename F>
+	BeliefStats forEachPage(const std::vector<size_t>& pages, F fn)
+	{
+		struct Job
+		{
+			size_t page;
+			double* p;
+			const uint8_t* sig;
+		};
+		BeliefStats stats = forEachBatch(pages.size(), m_belief.residentLimit(), [&](size_t i)
+		{
+			Job job = { pages[i], m_belief.write(pages[i]), m_signatures.read(pages[i] % tiles()) };
+			return job;
+		}, [&](const Job& job)
+		{
+			m_pageStats[job.page] = fn(job.page, job.p, job.sig);
+			return m_pageStats[job.page];
+		});
+		releaseZeroPages();
+		return stats;
+	}
+
+	// One plane moves from `source`, like Environment::applyMovement: in place, tile rows and
+	// the rows and columns inside a tile sweep away from the source side so every source is
+	// read before it is overwritten. The tiles of one row run in parallel; the columns they
+	// read from their neighbors in the row are copied to m_halo first.
+	BeliefStats movePlane(int q, CellOffset source, MovementModel mm)
+	{
+		if (!m_open) return BeliefStats();
+		const int dx = source.dx;
+		const int dy = source.dy;
+		const int sideColumn = dx < 0 ? TILE - 1 : 0; // column a tile gives to its neighbor
+		std::vector<double> zeroColumn(TILE, 0.0);
+		BeliefStats stats;
+		for (int n = 0; n < m_tilesY; n++)
+		{
+			const int ty = dy < 0 ? m_tilesY - 1 - n : n;
+			if (dx != 0)
+			{
+				m_halo.assign((size_t)m_tilesX * TILE, 0.0);
+				for (int tx = 0; tx < m_tilesX; tx++)
+				{
+					if (!isMaterialized(q, tx, ty)) continue;
+					m_belief.beginBatch();
+					const double* p = readTile(q, tx, ty);
+					if (!usable()) return stats;
+					for (int y = 0; y < TILE; y++) m_halo[(size_t)tx * TILE + y] = p[y * TILE + sideColumn];
+				}
+			}
+
+			// tiles of the row that can be nonzero after the move
+			std::vector<int> columns;
+			for (int tx = 0; tx < m_tilesX; tx++)
+			{
+				if (!m_tileFree[ty * m_tilesX + tx]) continue;
+				if (isMaterialized(q, tx, ty) || isMaterialized(q, tx + dx, ty) ||
+					isMaterialized(q, tx, ty + dy) || isMaterialized(q, tx + dx, ty + dy)) columns.push_back(tx);
+			}
+
+			struct Job
+			{
+				size_t page;
+				double* p;
+				const uint8_t* sig;
+				const double* next; // tile dy over, for source rows beyond the tile edge
+				const double* corner; // tile (dx, dy) over
+				const double* side; // source-side column of the tile dx over
+			};
+			stats.add(forEachBatch(columns.size(), std::max<size_t>(1, m_belief.residentLimit() / 3), [&](size_t i)
+			{
+				const int tx = columns[i];
+				Job job;
+				job.page = pageOf(q, tx, ty);
+				job.p = m_belief.write(job.page);
+				job.sig = m_signatures.read(ty * m_tilesX + tx);
+				job.next = readTile(q, tx, ty + dy);
+				job.corner = readTile(q, tx + dx, ty + dy);
+				job.side = (dx == 0 || tx + dx < 0 || tx + dx >= m_tilesX) ? zeroColumn.data() : &m_halo[(size_t)(tx + dx) * TILE];
+				return job;
+			}, [&](const Job& job)
+			{
+				BeliefStats stats;
+				const int y0 = dy < 0 ? TILE - 1 : 0;
+				const int yStep = dy < 0 ? -1 : 1;
+				const int x0 = dx < 0 ? TILE - 1 : 0;
+				const int xStep = dx < 0 ? -1 : 1;
+				for (int m = 0, y = y0; m < TILE; m++, y += yStep)
+				{
+					const int sy = y + dy;
+					const double* srcRow;
+					double sideValue; // source of the edge cell, from the next tile column
+					if (sy >= 0 && sy < TILE)
+					{
+						srcRow = job.p + sy * TILE;
+						sideValue = job.side[sy];
+					}
+					else
+					{
+						const int wrapped = (sy + TILE) % TILE;
+						srcRow = job.next + wrapped * TILE;
+						sideValue = job.corner[wrapped * TILE + sideColumn];
+					}
+
+					double* row = job.p + y * TILE;
+					const uint8_t* rowSig = job.sig + y * TILE;
+					for (int k = 0, x = x0; k < TILE; k++, x += xStep)
+					{
+						if (rowSig[x] == WALL_SIGNATURE) continue; // walls hold 0
+						const int sx = x + dx;
+						const double src = (sx >= 0 && sx < TILE) ? srcRow[sx] : sideValue;
+						row[x] = row[x] * mm.pFail + src * mm.pSuccess;
+						stats.add(row[x]);
+					}
+				}
+				m_pageStats[job.page] = stats;
+				return stats;
+			}));
+		}
+		releaseZeroPages();
+		return stats;
+	}
+
+	void releaseZeroPages()
+	{
+		for (size_t page = 0; page < m_belief.pages(); page++)
+		{
+			if (m_belief.isMaterialized(page) && m_pageStats[page].max == 0.0) m_belief.release(page);
+		}
+	}
+	// drops tiles whose largest normalized cell is below PRUNE_EPSILON, see Environment::prune
+	void prune()
+	{
+		const double threshold = Environment::PRUNE_EPSILON / m_scale;
+		double dropped = 0.0;
+		for (size_t page = 0; page < m_belief.pages(); page++)
+		{
+			if (!m_belief.isMaterialized(page) || m_pageStats[page].max >= threshold) continue;
+			dropped += m_pageStats[page].sum;
+			m_belief.release(page);
+		}
+		m_stats.sum -= dropped;
+		m_prunedMass += dropped * m_scale;
+	}
+};
@@ -0,0 +1,254 @@
+#pragma once
+#include <cmath>
+#include <functional>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// One pose hypothesis on the Environment's grid
+struct Particle
+{
+	uint32_t cell; // volume index, see Environment::index
+	int heading; // heading bin
+	double weight;
+};
+
+// Grid localization that hands over to Monte Carlo localization once the robot is localized.
+// The grid (Environment) runs until exp(entropy) of its belief is below particles / PARTICLES_PER_POSE;
+// the belief is then sampled into particles that move and weigh with the same MovementModel,
+// SensorModel and map. When the particle likelihoods collapse (kidnapped robot, or every
+// particle driven into a wall), the grid restarts from a uniform belief.
+class HybridLocalizer
+{
+public:
+	static const int DEFAULT_PARTICLES = 5000;
+	static const int PARTICLES_PER_POSE = 10; // particles per effective grid pose when sampling
+	static const int CHUNK = 4096; // particles per parallel task
+	// collapse: short-term mean likelihood below COLLAPSE_RATIO of the long-term one
+	static constexpr double COLLAPSE_RATIO = 0.35;
+	static constexpr double FAST_RATE = 0.3;
+	static constexpr double SLOW_RATE = 0.02;
+
+private:
+	Environment& m_env;
+	int m_count;
+	std::mt19937 m_rng;
+	std::vector<Particle> m_particles; // empty while the grid is in use
+	double m_fastLikelihood = 0.0;
+	double m_slowLikelihood = 0.0;
+	int m_stepsSinceCheck = 0;
+	std::unordered_map<uint64_t, double> m_histogram; // (plane, cell) -> weight, see probability()
+	bool m_histogramValid = false;
+
+public:
+	HybridLocalizer(Environment& env, int particles = DEFAULT_PARTICLES, unsigned seed = 1) : m_env(env), m_count(particles), m_rng(seed)
+	{
+	}
+
+	bool isParticleMode() const { return !m_particles.empty(); }
+	const std::vector<Particle>& particles() const { return m_particles; }
+
+	// normalized belief at a cell, the weight share of the particles there in particle mode
+	double probability(int heading, int x, int y)
+	{
+		if (!isParticleMode()) return m_env.probability(heading, x, y);
+		binParticles();
+		auto it = m_histogram.find(key(heading, (uint32_t)m_env.index(x, y)));
+		return it == m_histogram.end() ? 0.0 : it->second;
+	}
+
+	// Updates return the stats of the normalized belief
+	BeliefStats normalize(const BeliefStats& stats) const { return stats; }
+
+	BeliefStats applyFilter(Filter f, const SensorModel& sm)
+	{
+		if (!isParticleMode()) return finishGrid(m_env.applyFilter(f, sm));
+
+		std::vector<LikelihoodTable> tables = m_env.headingTables(f, sm);
+		forEachChunk([&](size_t first, size_t end, std::mt19937&)
+		{
+			for (size_t i = first; i < end; i++)
+			{
+				Particle& p = m_particles[i];
+				p.weight *= tables[p.heading].p[m_env.signatures[p.cell]];
+			}
+		});
+
+		// the particle weights summed to 1, so their new sum is the mean likelihood of the reading
+		double likelihood = 0.0;
+		for (const Particle& p : m_particles) likelihood += p.weight;
+		if (m_slowLikelihood == 0.0) m_fastLikelihood = m_slowLikelihood = likelihood; // first reading of this set
+		m_fastLikelihood += FAST_RATE * (likelihood - m_fastLikelihood);
+		m_slowLikelihood += SLOW_RATE * (likelihood - m_slowLikelihood);
+		if (likelihood <= 0.0 || m_fastLikelihood < COLLAPSE_RATIO * m_slowLikelihood) return fallBackToGrid();
+		return finishParticles(likelihood);
+	}
+
+	// one cell forward with pSuccess, like Environment::moveForward; a particle moving into a wall is lost
+	BeliefStats moveForward(MovementModel mm)
+	{
+		if (!isParticleMode()) return finishGrid(m_env.moveForward(mm));
+
+		std::vector<ptrdiff_t> move(m_env.headings());
+		for (int h = 0; h < m_env.headings(); h++)
+		{
+			CellOffset s = m_env.forwardSource(h);
+			move[h] = -((ptrdiff_t)s.dy * m_env.stride() + s.dx);
+		}
+		forEachChunk([&](size_t first, size_t end, std::mt19937& rng)
+		{
+			std::uniform_real_distribution<double> uniform(0.0, 1.0);
+			for (size_t i = first; i < end; i++)
+			{
+				Particle& p = m_particles[i];
+				double u = uniform(rng) * (mm.pFail + mm.pSuccess);
+				if (u < mm.pFail) continue;
+				uint32_t target = (uint32_t)(p.cell + move[p.heading]);
+				if (m_env.signatures[target] == WALL_SIGNATURE) p.weight = 0.0;
+				else p.cell = target;
+			}
+		});
+		return finishMotion();
+	}
+
+	// same operator as Environment::applyTurn
+	BeliefStats applyTurn(int bins, MovementModel mm)
+	{
+		if (!isParticleMode()) return finishGrid(m_env.applyTurn(bins, mm));
+
+		const int n = m_env.headings();
+		const int shift = ((bins % n) + n) % n;
+		forEachChunk([&](size_t first, size_t end, std::mt19937& rng)
+		{
+			std::uniform_real_distribution<double> uniform(0.0, 1.0);
+			for (size_t i = first; i < end; i++)
+			{
+				// new[h] gets old[h + shift] with pSuccess
+				if (uniform(rng) * (mm.pFail + mm.pSuccess) >= mm.pFail) m_particles[i].heading = (m_particles[i].heading + n - shift) % n;
+			}
+		});
+		return finishMotion();
+	}
+
+	// systematic sample of the grid belief
+	void sampleFromGrid()
+	{
+		m_particles.clear();
+		m_particles.reserve(m_count);
+		const double step = 1.0 / m_count;
+		double next = std::uniform_real_distribution<double>(0.0, step)(m_rng);
+		double cumulative = 0.0;
+		for (int h = 0; h < m_env.headings(); h++)
+		{
+			for (uint32_t k : m_env.freeCells)
+			{
+				cumulative += m_env.probability(h, (int)(k % m_env.stride()), (int)(k / m_env.stride()));
+				while (next < cumulative && (int)m_particles.size() < m_count)
+				{
+					m_particles.push_back({ k, h, step });
+					next += step;
+				}
+			}
+		}
+		if (m_particles.empty()) return;
+		for (Particle& p : m_particles) p.weight = 1.0 / m_particles.size();
+		m_fastLikelihood = m_slowLikelihood = 0.0;
+		m_stepsSinceCheck = 0;
+		m_histogramValid = false;
+	}
+	// global relocalization on the grid
+	BeliefStats fallBackToGrid()
+	{
+		m_particles.clear();
+		m_histogramValid = false;
+		m_stepsSinceCheck = 0;
+		m_env.resetUniform();
+		BeliefStats result;
+		result.sum = 1.0;
+		result.max = 1.0 / ((double)m_env.headings() * m_env.freeCells.size());
+		return result;
+	}
+
+private:
+	uint64_t key(int heading, uint32_t cell) const { return (uint64_t)heading << 32 | cell; }
+	// weight per pose, summed over the particles there
+	void binParticles()
+	{
+		if (m_histogramValid) return;
+		m_histogram.clear();
+		for (const Particle& p : m_particles) m_histogram[key(p.heading, p.cell)] += p.weight;
+		m_histogramValid = true;
+	}
+
+	// fn(first, end, rng) over chunks of the particles, each chunk with its own generator
+	template <typename F>
+	void forEachChunk(F fn)
+	{
+		const size_t chunks = (m_particles.size() + CHUNK - 1) / CHUNK;
+		std::vector<unsigned> seeds(chunks);
+		for (unsigned& s : seeds) s = m_rng();
+		std::function<void(size_t)> task = [&](size_t c)
+		{
+			std::mt19937 rng(seeds[c]);
+			fn(c * CHUNK, std::min((c + 1) * CHUNK, m_particles.size()), rng);
+		};
+		if (m_env.threadPool()) m_env.threadPool()->parallelFor(chunks, task);
+		else for (size_t c = 0; c < chunks; c++) task(c);
+	}
+
+	BeliefStats finishGrid(const BeliefStats& stats)
+	{
+		BeliefStats result = m_env.normalize(stats);
+		if (++m_stepsSinceCheck < Environment::SPARSE_CHECK_INTERVAL) return result;
+		m_stepsSinceCheck = 0;
+		if (std::exp(m_env.entropy()) * PARTICLES_PER_POSE > m_count) return result;
+		sampleFromGrid();
+		return finishParticles(1.0);
+	}
+	BeliefStats finishMotion()
+	{
+		double sum = 0.0;
+		for (const Particle& p : m_particles) sum += p.weight;
+		if (sum <= 0.0) return fallBackToGrid();
+		return finishParticles(sum);
+	}
+	// normalizes the weights to `sum`, resamples when the effective sample size is below half
+	BeliefStats finishParticles(double sum)
+	{
+		double squares = 0.0;
+		for (Particle& p : m_particles)
+		{
+			p.weight /= sum;
+			squares += p.weight * p.weight;
+		}
+		if (1.0 / squares < m_particles.size() / 2.0) resample();
+
+		m_histogramValid = false;
+		binParticles();
+		BeliefStats result;
+		result.sum = 1.0;
+		for (const auto& pose : m_histogram) result.max = std::max(result.max, pose.second); // largest probability() of a pose
+		return result;
+	}
+	// low-variance resampling, drops particles of weight 0
+	void resample()
+	{
+		std::vector<Particle> resampled;
+		resampled.reserve(m_count);
+		const double step = 1.0 / m_count;
+		double next = std::uniform_real_distribution<double>(0.0, step)(m_rng);
+		double cumulative = 0.0;
+		for (const Particle& p : m_particles)
+		{
+			cumulative += p.weight;
+			while (next < cumulative && (int)resampled.size() < m_count)
+			{
+				resampled.push_back({ p.cell, p.heading, step });
+				next += step;
+			}
+		}
+		m_particles.swap(resampled);
+	}
+};
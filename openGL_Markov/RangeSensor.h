@@ -0,0 +1,269 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// Beam model of one range reading. Ranges count the free cells in front of the robot's cell,
+// in steps of `resolution` cells, up to maxRange steps; maxRange is also the reading when
+// nothing is hit.
+struct RangeSensorModel
+{
+	int maxRange = 40; // steps, up to 65535
+	double resolution = 1.0; // cells per step
+	double sigmaHit = 1.0; // steps, noise of a reading that hits the expected wall
+	double lambdaShort = 0.1; // per step, unexpected obstacles in front of the wall
+	double zHit = 0.8;
+	double zShort = 0.1;
+	double zMax = 0.05;
+	double zRandom = 0.05;
+};
+
+// One scan at a pose: ranges[b] is the reading of beam b of the RangeSensor, in steps
+struct RangeScan
+{
+	std::vector<int> ranges;
+};
+
+// Range sensor on an Environment, with beams at fixed angles from the robot's heading. The
+// expected range of every free cell, heading bin and beam is ray-cast once, when the sensor is
+// built, into a [direction][free cell] table of uint8_t (uint16_t when maxRange > 255); beams
+// of different headings that point the same way share a direction. A reading is then a
+// likelihood lookup per cell and beam.
+class RangeSensor
+{
+public:
+	static const int CAST_CHUNK = 4096; // free cells per parallel ray-casting task
+
+private:
+	Environment& m_env;
+	RangeSensorModel m_model;
+	std::vector<double> m_beamAngles; // degrees clockwise from the robot's heading
+	std::vector<int> m_beamDirection; // [heading][beam] -> direction of the tables
+	std::vector<double> m_directionAngles; // degrees clockwise from Up
+	int m_free;
+	std::vector<uint8_t> m_range8; // [direction][free cell], maxRange <= 255
+	std::vector<uint16_t> m_range16; // otherwise
+	std::vector<double> m_likelihood; // [expected][measured]
+	std::vector<int32_t> m_bandFirst; // first free cell of every band of the Environment, and the end
+
+public:
+	RangeSensor(Environment& env, const std::vector<double>& beamAngles, const RangeSensorModel& model = RangeSensorModel())
+		: m_env(env), m_model(model), m_beamAngles(beamAngles)
+	{
+		m_model.maxRange = std::max(1, std::min(model.maxRange, 65535));
+		m_free = (int)env.freeCells.size();
+		buildLikelihood();
+		for (int h = 0; h < env.headings(); h++)
+		{
+			for (double angle : beamAngles) m_beamDirection.push_back(direction(env.headingAngle(h) + angle));
+		}
+		for (int b = 0; b <= env.bandCount(); b++)
+		{
+			size_t k = env.index(0, 1 + b * Environment::BAND_ROWS);
+			m_bandFirst.push_back((int32_t)(std::lower_bound(env.freeCells.begin(), env.freeCells.end(), (uint32_t)k) - env.freeCells.begin()));
+		}
+		if (isWide()) castRays(m_range16);
+		else castRays(m_range8);
+	}
+
+	const RangeSensorModel& model() const { return m_model; }
+	int beams() const { return (int)m_beamAngles.size(); }
+	double beamAngle(int beam) const { return m_beamAngles[beam]; }
+	bool isWide() const { return m_model.maxRange > 255; }
+	size_t cacheBytes() const { return m_range8.size() + m_range16.size() * sizeof(uint16_t); }
+	// expected reading of `beam` at `heading` from free cell number `freeCell`
+	int expectedRange(int heading, int beam, int freeCell) const
+	{
+		size_t i = (size_t)m_beamDirection[(size_t)heading * beams() + beam] * m_free + freeCell;
+		return isWide() ? m_range16[i] : m_range8[i];
+	}
+	// noise-free scan of a robot at the pose, empty on a wall
+	RangeScan expectedScan(int heading, int x, int y) const
+	{
+		RangeScan scan;
+		const int32_t i = m_env.freeIndex[m_env.index(x, y)];
+		if (i < 0) return scan;
+		for (int b = 0; b < beams(); b++) scan.ranges.push_back(expectedRange(heading, b, i));
+		return scan;
+	}
+	double likelihood(int expected, int measured) const
+	{
+		return m_likelihood[(size_t)expected * (m_model.maxRange + 1) + std::max(0, std::min(measured, m_model.maxRange))];
+	}
+
+	// Sensor update of the Environment's belief, unnormalized like Environment::applyFilter,
+	// and tracked like its kernels. Each beam's likelihoods are rescaled by their max,
+	// normalization removes the factor.
+	BeliefStats apply(const RangeScan& scan)
+	{
+		const int beams = std::min(this->beams(), (int)scan.ranges.size());
+		std::vector<std::vector<double>> column(beams, std::vector<double>(m_model.maxRange + 1));
+		for (int b = 0; b < beams; b++)
+		{
+			double max = 0.0;
+			for (int e = 0; e <= m_model.maxRange; e++)
+			{
+				column[b][e] = likelihood(e, scan.ranges[b]);
+				max = std::max(max, column[b][e]);
+			}
+			if (max > 0.0) for (double& l : column[b]) l /= max;
+		}
+		if (isWide()) return apply(column, m_range16);
+		return apply(column, m_range8);
+	}
+
+private:
+	// index of the world direction, added when no direction is within 1e-6 degrees
+	int direction(double angle)
+	{
+		angle = std::fmod(angle, 360.0);
+		if (angle < 0.0) angle += 360.0;
+		for (size_t d = 0; d < m_directionAngles.size(); d++)
+		{
+			const double diff = std::fabs(m_directionAngles[d] - angle);
+			if (std::min(diff, 360.0 - diff) < 1e-6) return (int)d;
+		}
+		m_directionAngles.push_back(angle);
+		return (int)m_directionAngles.size() - 1;
+	}
+
+	// discretized beam model, each row (expected range) sums to 1 over the readings
+	void buildLikelihood()
+	{
+		const int n = m_model.maxRange + 1;
+		m_likelihood.assign((size_t)n * n, 0.0);
+		for (int e = 0; e < n; e++)
+		{
+			double* row = &m_likelihood[(size_t)e * n];
+			double hitSum = 0.0, shortSum = 0.0;
+			for (int z = 0; z < n; z++) hitSum += std::exp(-0.5 * (z - e) * (z - e) / (m_model.sigmaHit * m_model.sigmaHit));
+			for (int z = 0; z < e; z++) shortSum += std::exp(-m_model.lambdaShort * z);
+			for (int z = 0; z < n; z++)
+			{
+				double hit = std::exp(-0.5 * (z - e) * (z - e) / (m_model.sigmaHit * m_model.sigmaHit)) / hitSum;
+				double probValue = m_model.zHit * hit + m_model.zRandom / n;
+				if (z < e) probValue += m_model.zShort * std::exp(-m_model.lambdaShort * z) / shortSum;
+				if (z == m_model.maxRange) probValue += m_model.zMax;
+				row[z] = probValue;
+			}
+			double sum = 0.0; // short readings are impossible at e = 0
+			for (int z = 0; z < n; z++) sum += row[z];
+			for (int z = 0; z < n; z++) row[z] /= sum;
+		}
+	}
+
+	template <typename R>
+	void castRays(std::vector<R>& ranges)
+	{
+		const int directions = (int)m_directionAngles.size();
+		ranges.assign((size_t)directions * m_free, (R)m_model.maxRange);
+		for (int d = 0; d < directions; d++)
+		{
+			const double rad = m_directionAngles[d] * 3.14159265358979323846 / 180.0;
+			const double sx = std::sin(rad);
+			const double sy = -std::cos(rad); // rows grow downwards
+			R* out = &ranges[(size_t)d * m_free];
+			const size_t chunks = (m_free + CAST_CHUNK - 1) / CAST_CHUNK;
+			std::function<void(size_t)> task = [&](size_t c)
+			{
+				for (int i = (int)c * CAST_CHUNK; i < std::min(m_free, (int)(c + 1) * CAST_CHUNK); i++)
+				{
+					uint32_t k = m_env.freeCells[i];
+					out[i] = (R)castRay((int)(k % m_env.stride()), (int)(k / m_env.stride()), sx, sy);
+				}
+			};
+			if (m_env.threadPool()) m_env.threadPool()->parallelFor(chunks, task);
+			else for (size_t c = 0; c < chunks; c++) task(c);
+		}
+	}
+	// Grid traversal (Amanatides-Woo) from the center of cell (x, y) to the first wall; the
+	// reading is the distance to the wall's edge less the half cell the robot stands in
+	int castRay(int x, int y, double sx, double sy) const
+	{
+		const double limit = (m_model.maxRange + 0.5) * m_model.resolution + 0.5;
+		const int stepX = sx > 1e-9 ? 1 : (sx < -1e-9 ? -1 : 0);
+		const int stepY = sy > 1e-9 ? 1 : (sy < -1e-9 ? -1 : 0);
+		const double deltaX = stepX ? 1.0 / std::fabs(sx) : 1e300; // ray length per column
+		const double deltaY = stepY ? 1.0 / std::fabs(sy) : 1e300;
+		double nextX = stepX ? 0.5 * deltaX : 1e300; // ray length to the next column edge
+		double nextY = stepY ? 0.5 * deltaY : 1e300;
+		while (true)
+		{
+			double t;
+			if (nextX < nextY)
+			{
+				t = nextX;
+				x += stepX;
+				nextX += deltaX;
+			}
+			else
+			{
+				t = nextY;
+				y += stepY;
+				nextY += deltaY;
+			}
+			if (t > limit) return m_model.maxRange;
+			if (m_env.isWall(x, y)) // the border keeps every ray on the map
+			{
+				int steps = (int)std::lround((t - 0.5) / m_model.resolution);
+				return std::max(0, std::min(steps, m_model.maxRange));
+			}
+		}
+	}
+
+	template <typename R>
+	BeliefStats apply(const std::vector<std::vector<double>>& column, const std::vector<R>& ranges)
+	{
+		const int n = m_env.headings();
+		const int beams = (int)column.size();
+		// expected ranges of every beam for each heading
+		std::vector<const R*> beamRanges((size_t)n * beams);
+		for (int h = 0; h < n; h++)
+		{
+			for (int b = 0; b < beams; b++)
+			{
+				beamRanges[(size_t)h * beams + b] = &ranges[(size_t)m_beamDirection[(size_t)h * this->beams() + b] * m_free];
+			}
+		}
+		auto cellLikelihood = [&](int h, int32_t i)
+		{
+			const R* const* r = &beamRanges[(size_t)h * beams];
+			double l = 1.0;
+			for (int b = 0; b < beams; b++) l *= column[b][r[b][i]];
+			return l;
+		};
+
+		if (m_env.isSparse())
+		{
+			return m_env.tracked(1, true, [&](auto collect)
+			{
+				BeliefTracker track = m_env.tracker(0);
+				for (size_t i : m_env.activeCells())
+				{
+					size_t k = i % m_env.planeSize();
+					m_env.data[i] *= cellLikelihood(m_env.headingOfPlane((int)(i / m_env.planeSize())), m_env.freeIndex[k]);
+					track.add(collect, m_env.data[i], i);
+				}
+				return m_env.keep(track);
+			});
+		}
+		return m_env.tracked((size_t)n * m_env.bandCount(), true, [&](auto collect)
+		{
+			return m_env.forEachBand(n, [&](int h, int yFirst, int yLast)
+			{
+				BeliefTracker track = m_env.bandTracker(h, yFirst, yLast); // walls hold 0 and are skipped
+				double* p = m_env.plane(h);
+				const size_t base = p - m_env.data.data();
+				const int band = (yFirst - 1) / Environment::BAND_ROWS;
+				for (int32_t i = m_bandFirst[band]; i < m_bandFirst[band + 1]; i++)
+				{
+					const uint32_t k = m_env.freeCells[i];
+					p[k] *= cellLikelihood(h, i);
+					track.add(collect, p[k], base + k, k);
+				}
+				return m_env.keep(track);
+			});
+		});
+	}
+};
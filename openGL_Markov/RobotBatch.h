@@ -0,0 +1,96 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "MotionOperator.h"
+
+
+// Commands queued for one robot until the next tick
+struct RobotStep
+{
+	std::string action; // "Forward", "Turn left", "Turn right" or empty, as in OnSendMovement
+	std::vector<Filter> readings; // taken after the action, at the same pose
+};
+
+// Many robots localizing on one GridMap. Every robot is an Environment on the shared map, and
+// the motion operators are built once per action for all of them, so an extra robot costs its
+// belief volume. tick() runs the queued action, then the readings, of every robot. Robots are
+// handed out to the ThreadPool one at a time, largest belief first, so threads that finish a
+// small (sparse) robot pick up the next one; kernels inside a robot then run serially. With
+// fewer robots than threads the robots run one after another, each kernel on the whole pool.
+class RobotBatch
+{
+private:
+	std::shared_ptr<const GridMap> m_map;
+	int m_headings;
+	ThreadPool* m_pool;
+	SensorModel m_sm;
+	MovementModel m_mm;
+	MotionOperatorCache m_operators; // built before the robots run, read-only while they do
+	std::vector<std::unique_ptr<Environment>> m_robots;
+	std::vector<MotionScratch> m_scratch; // per robot, for the shared operators
+	std::vector<RobotStep> m_pending; // per robot
+	std::vector<BeliefStats> m_stats; // per robot, normalized, as of its last step
+
+public:
+	RobotBatch(std::shared_ptr<const GridMap> map, int headings, ThreadPool* pool = nullptr,
+		const SensorModel& sm = SensorModel(), const MovementModel& mm = MovementModel())
+		: m_map(map), m_headings(headings), m_pool(pool), m_sm(sm), m_mm(mm) {}
+
+	// a new robot with a uniform belief, returns its number
+	int addRobot()
+	{
+		m_robots.emplace_back(new Environment(m_map, m_headings));
+		m_robots.back()->setThreadPool(m_pool);
+		m_pending.emplace_back();
+		m_scratch.emplace_back();
+		m_stats.emplace_back();
+		return (int)m_robots.size() - 1;
+	}
+	int robots() const { return (int)m_robots.size(); }
+	Environment& robot(int i) { return *m_robots[i]; }
+	const BeliefStats& stats(int i) const { return m_stats[i]; }
+	const GridMap& map() const { return *m_map; }
+
+	// replaces the robot's queued action
+	void move(int robot, const std::string& action) { m_pending[robot].action = action; }
+	void sense(int robot, const Filter& f) { m_pending[robot].readings.push_back(f); }
+
+	// Runs the queued commands of every robot and clears them
+	void tick()
+	{
+		std::vector<int> order;
+		for (int i = 0; i < robots(); i++)
+		{
+			const RobotStep& s = m_pending[i];
+			if (s.action.empty() && s.readings.empty()) continue;
+			if (s.action == "Forward") m_operators.get(s.action, *m_robots[i], MotionNoise(m_mm));
+			order.push_back(i);
+		}
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return cost(a) > cost(b); });
+
+		std::function<void(size_t)> task = [&](size_t t) { step(order[t]); };
+		if (m_pool && order.size() >= (size_t)m_pool->size()) m_pool->parallelFor(order.size(), task);
+		else for (size_t t = 0; t < order.size(); t++) task(t);
+	}
+
+private:
+	// cells the robot's kernels touch
+	size_t cost(int i) const
+	{
+		const Environment& env = *m_robots[i];
+		return env.isSparse() ? env.activeCells().size() : (size_t)m_headings * m_map->freeCells.size();
+	}
+
+	void step(int i)
+	{
+		Environment& env = *m_robots[i];
+		RobotStep& s = m_pending[i];
+		if (s.action == "Forward") m_stats[i] = env.normalize(m_operators.find(s.action, env, MotionNoise(m_mm))->apply(env, m_scratch[i]));
+		else if (s.action == "Turn left") m_stats[i] = env.normalize(env.applyTurn(env.quarterTurnBins(), m_mm));
+		else if (s.action == "Turn right") m_stats[i] = env.normalize(env.applyTurn(-env.quarterTurnBins(), m_mm));
+		if (!s.readings.empty()) m_stats[i] = env.normalize(env.applyFilters(s.readings, m_sm));
+		s = RobotStep();
+	}
+};
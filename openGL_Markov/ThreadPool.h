@@ -0,0 +1,127 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+
+// Persistent worker threads for the Markov update kernels.
+// parallelFor hands out task indices one by one, the calling thread works too.
+// Calls made from inside a task run serially.
+class ThreadPool
+{
+private:
+	struct Job
+	{
+		const std::function<void(size_t)>* task = nullptr;
+		size_t count = 0;
+		std::atomic<size_t> next{ 0 };
+		std::atomic<size_t> remaining{ 0 };
+	};
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	std::shared_ptr<Job> m_job;
+	unsigned m_generation = 0;
+	bool m_stop = false;
+	std::mutex m_runMutex; // one parallelFor at a time
+
+	static bool& insideTask()
+	{
+		static thread_local bool inside = false;
+		return inside;
+	}
+
+	// returns true when this call finished the last task of the job
+	static bool runTasks(Job& job)
+	{
+		bool last = false;
+		insideTask() = true;
+		for (size_t i = job.next++; i < job.count; i = job.next++)
+		{
+			(*job.task)(i);
+			if (--job.remaining == 0) last = true;
+		}
+		insideTask() = false;
+		return last;
+	}
+
+	void workerLoop()
+	{
+		unsigned seen = 0;
+		while (true)
+		{
+			std::shared_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+				if (m_stop) return;
+				seen = m_generation;
+				job = m_job;
+			}
+			if (runTasks(*job))
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_done.notify_all();
+			}
+		}
+	}
+
+public:
+	// threads = total threads including the caller, 0 = one per hardware thread
+	explicit ThreadPool(unsigned threads = 0)
+	{
+		if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned i = 1; i < threads; i++)
+		{
+			m_threads.emplace_back(&ThreadPool::workerLoop, this);
+		}
+	}
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (std::thread& t : m_threads) t.join();
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const { return (int)m_threads.size() + 1; }
+
+	// runs task(0) .. task(count - 1), returns when all are done
+	void parallelFor(size_t count, const std::function<void(size_t)>& task)
+	{
+		if (count == 0) return;
+		if (count == 1 || m_threads.empty() || insideTask())
+		{
+			for (size_t i = 0; i < count; i++) task(i);
+			return;
+		}
+
+		std::lock_guard<std::mutex> run(m_runMutex);
+		std::shared_ptr<Job> job = std::make_shared<Job>();
+		job->task = &task;
+		job->count = count;
+		job->remaining = count;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_job = job;
+			m_generation++;
+		}
+		m_wake.notify_all();
+
+		runTasks(*job);
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [&] { return job->remaining == 0; });
+	}
+};
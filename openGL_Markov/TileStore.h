@@ -0,0 +1,211 @@
+#pragma once
+#include <windows.h>
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <string>
+#include <vector>
+
+
+// Fixed-size pages of T in one memory-mapped file. A page that was never written, or was
+// released, holds `fill` everywhere and takes no space in the file: it is read through
+// fillPage(). Materialized pages get a slot in the file, and freed slots are reused.
+// At most `residentLimit` pages are mapped at once; the least recently used page is
+// unmapped to make room, except pages mapped since the last beginBatch(), so a batch can
+// hold on to its pointers. Callers size batches to at most `residentLimit` pages.
+// A page that cannot be mapped (address space, disk, or a batch over the limit) is reported
+// once with a message box; read() and write() return nullptr from then on, see failed().
+// Not thread-safe: map between parallel passes, not inside them.
+template <typename T>
+class TileStore
+{
+private:
+	struct Page
+	{
+		int64_t slot = -1; // -1 = not materialized
+		T* view = nullptr; // mapped view, nullptr when not resident
+		std::list<size_t>::iterator lru;
+		uint64_t batch = 0; // last batch that mapped it
+	};
+
+	std::string m_path;
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = NULL;
+	size_t m_pageElements = 0;
+	size_t m_slotBytes = 0; // page size rounded up to the allocation granularity
+	size_t m_residentLimit = 1;
+	std::vector<Page> m_pages;
+	std::vector<T> m_fillPage;
+	std::list<size_t> m_lru; // resident pages, most recently used first
+	std::vector<int64_t> m_freeSlots;
+	int64_t m_slotCount = 0; // slots handed out so far
+	int64_t m_slotCapacity = 0; // slots covered by m_mapping
+	uint64_t m_batch = 1;
+	bool m_failed = false;
+
+public:
+	TileStore() {}
+	~TileStore() { close(); }
+	TileStore(const TileStore&) = delete;
+	TileStore& operator=(const TileStore&) = delete;
+
+	// creates (or truncates) the backing file, deleted again when the store is closed
+	bool open(const std::string& path, size_t pages, size_t pageElements, size_t residentLimit, T fill)
+	{
+		close();
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		const size_t granularity = info.dwAllocationGranularity;
+		m_path = path;
+		m_pageElements = pageElements;
+		m_slotBytes = (pageElements * sizeof(T) + granularity - 1) / granularity * granularity;
+		m_residentLimit = std::max<size_t>(1, residentLimit);
+		m_pages.assign(pages, Page());
+		m_fillPage.assign(pageElements, fill);
+		m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			std::string output = "Error: Unable to create tile file: ";
+			output += path;
+			MessageBoxA(0, output.c_str(), "Error", MB_OK);
+			return false;
+		}
+		return true;
+	}
+	void close()
+	{
+		for (size_t page : m_lru) UnmapViewOfFile(m_pages[page].view);
+		m_lru.clear();
+		if (m_mapping) CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+		m_mapping = NULL;
+		m_file = INVALID_HANDLE_VALUE;
+		m_pages.clear();
+		m_freeSlots.clear();
+		m_slotCount = m_slotCapacity = 0;
+		m_failed = false;
+	}
+
+	size_t pages() const { return m_pages.size(); }
+	size_t pageElements() const { return m_pageElements; }
+	size_t residentLimit() const { return m_residentLimit; }
+	size_t residentPages() const { return m_lru.size(); }
+	size_t materializedPages() const { return (size_t)(m_slotCount - m_freeSlots.size()); }
+	bool isMaterialized(size_t page) const { return m_pages[page].slot >= 0; }
+	const T* fillPage() const { return m_fillPage.data(); }
+	// a page could not be mapped; the store cannot be used any more
+	bool failed() const { return m_failed; }
+
+	// pages mapped from here on stay mapped until the next beginBatch()
+	void beginBatch() { m_batch++; }
+	// page for reading, fillPage() when not materialized; nullptr when it cannot be mapped
+	const T* read(size_t page)
+	{
+		if (m_failed) return nullptr;
+		if (!isMaterialized(page)) return fillPage();
+		return map(page);
+	}
+	// page for writing, materialized (as all fill) when needed; nullptr when it cannot be mapped
+	T* write(size_t page)
+	{
+		if (m_failed) return nullptr;
+		Page& p = m_pages[page];
+		if (p.slot < 0)
+		{
+			p.slot = allocateSlot();
+			if (p.slot < 0) return nullptr;
+			T* view = map(page);
+			if (view) std::copy(m_fillPage.begin(), m_fillPage.end(), view);
+			return view;
+		}
+		return map(page);
+	}
+	// back to all fill, its slot is reused by the next materialized page
+	void release(size_t page)
+	{
+		Page& p = m_pages[page];
+		if (p.slot < 0) return;
+		if (p.view) unmap(page);
+		m_freeSlots.push_back(p.slot);
+		p.slot = -1;
+	}
+
+private:
+	T* map(size_t page)
+	{
+		Page& p = m_pages[page];
+		p.batch = m_batch;
+		if (p.view)
+		{
+			m_lru.splice(m_lru.begin(), m_lru, p.lru);
+			return p.view;
+		}
+		if (m_lru.size() >= m_residentLimit && !evict()) return fail("keep a batch within the resident limit of");
+		ULONGLONG offset = (ULONGLONG)p.slot * m_slotBytes;
+		p.view = (T*)MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, (DWORD)(offset >> 32), (DWORD)offset, m_pageElements * sizeof(T));
+		if (!p.view) return fail("map a tile of");
+		m_lru.push_front(page);
+		p.lru = m_lru.begin();
+		return p.view;
+	}
+	void unmap(size_t page)
+	{
+		Page& p = m_pages[page];
+		UnmapViewOfFile(p.view);
+		m_lru.erase(p.lru);
+		p.view = nullptr;
+	}
+	// least recently used page outside the current batch; false when the batch holds them all
+	bool evict()
+	{
+		for (auto it = m_lru.rbegin(); it != m_lru.rend(); ++it)
+		{
+			if (m_pages[*it].batch == m_batch) continue;
+			unmap(*it);
+			return true;
+		}
+		return false;
+	}
+	int64_t allocateSlot()
+	{
+		if (!m_freeSlots.empty())
+		{
+			int64_t slot = m_freeSlots.back();
+			m_freeSlots.pop_back();
+			return slot;
+		}
+		if (m_slotCount == m_slotCapacity && !grow()) return -1;
+		return m_slotCount++;
+	}
+	// Doubles the file. Views of the old mapping stay valid and coherent with the new one.
+	bool grow()
+	{
+		const int64_t capacity = std::max<int64_t>(16, m_slotCapacity * 2);
+		ULONGLONG bytes = (ULONGLONG)capacity * m_slotBytes;
+		HANDLE mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE, (DWORD)(bytes >> 32), (DWORD)bytes, NULL);
+		if (!mapping)
+		{
+			fail("grow");
+			return false;
+		}
+		if (m_mapping) CloseHandle(m_mapping);
+		m_mapping = mapping;
+		m_slotCapacity = capacity;
+		return true;
+	}
+	// out of address space or disk: reported once, the store refuses pages from then on
+	T* fail(const char* what)
+	{
+		if (!m_failed)
+		{
+			std::string output = "Error: Unable to ";
+			output += what;
+			output += " tile file: ";
+			output += m_path;
+			MessageBoxA(0, output.c_str(), "Error", MB_OK);
+		}
+		m_failed = true;
+		return nullptr;
+	}
+};
@@ -0,0 +1,309 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include "MarkovClasses.h"
+
+
+// Belief in TILE x TILE blocks, [tile][row][col] per plane with tiles row by row, so a one-cell
+// shift in any direction reads memory that is at most one tile away. Cells outside the map
+// are walls. Every kernel walks the volume through forEachTile; reads across a tile edge go
+// through TileRows. Keeps an Environment without a belief volume for the map, heading bins
+// and pool; load() and store() convert from and to the belief of an Environment on the same
+// map. Normalization is lazy like Environment::normalize. Always dense.
+class TiledBelief
+{
+public:
+	static const int TILE = 64;
+	static const int TILE_CELLS = TILE * TILE;
+
+private:
+	Environment m_env; // map, headings and pool only
+	int m_tilesX, m_tilesY;
+	size_t m_planeSize;
+	std::vector<uint8_t> m_signature; // [tile][row][col]
+	std::vector<AlignedBuffer<double>> m_planes; // [tile][row][col] per physical plane
+	std::vector<AlignedBuffer<double>> m_next; // motion output per physical plane, swapped in
+	std::vector<double> m_zeroRow; // source row outside the map
+	int m_headingOffset = 0; // heading h is stored in plane (h + m_headingOffset) % headings
+	double m_scale = 1.0;
+	BeliefStats m_stats; // of the stored values, at the last normalize()
+
+	// source rows of one tile row for a shift by (dx, dy): mid is the row in the tile column
+	// itself, side the row in the tile column dx over, both already resolved across tile rows
+	struct TileRows
+	{
+		const double* mid;
+		const double* side;
+	};
+
+public:
+	// uniform belief over every free cell and heading, serial without a pool
+	TiledBelief(std::shared_ptr<const GridMap> map, int headings, ThreadPool* pool = nullptr) : m_env(map, headings, false)
+	{
+		m_env.setThreadPool(pool);
+		m_tilesX = (m_env.width() + TILE - 1) / TILE;
+		m_tilesY = (m_env.height() + TILE - 1) / TILE;
+		m_planeSize = (size_t)tiles() * TILE_CELLS;
+		m_zeroRow.assign(TILE, 0.0);
+		m_signature.assign(m_planeSize, WALL_SIGNATURE);
+		for (int y = 1; y <= m_env.height(); y++)
+		{
+			for (int x = 1; x <= m_env.width(); x++) m_signature[offsetOf(x, y)] = m_env.signatures[m_env.index(x, y)];
+		}
+		resetUniform();
+	}
+
+	int tiles() const { return m_tilesX * m_tilesY; }
+	// position of map cell (x, y) inside a plane
+	size_t offsetOf(int x, int y) const
+	{
+		x--;
+		y--;
+		return ((size_t)(y / TILE) * m_tilesX + x / TILE) * TILE_CELLS + (y % TILE) * TILE + x % TILE;
+	}
+	int physical(int heading) const { return (heading + m_headingOffset) % m_env.headings(); }
+	double* plane(int heading) { return m_planes[physical(heading)].data(); }
+
+	// uniform belief over every free cell and heading, as after loading the map
+	void resetUniform()
+	{
+		const size_t empty = m_env.map()->emptyCount();
+		m_planes.resize(m_env.headings());
+		m_next.resize(m_env.headings());
+		m_headingOffset = 0;
+		for (AlignedBuffer<double>& p : m_planes)
+		{
+			p.resize(m_planeSize);
+			for (size_t i = 0; i < m_planeSize; i++) p[i] = m_signature[i] != WALL_SIGNATURE ? 1.0 / empty : 0.0;
+		}
+		m_scale = 1.0 / m_env.headings();
+		m_stats = getStats();
+	}
+	// the belief of an Environment on the same map and headings
+	void load(Environment& env)
+	{
+		m_planes.resize(env.headings());
+		m_next.resize(env.headings());
+		for (AlignedBuffer<double>& p : m_planes) p.resize(m_planeSize);
+		m_headingOffset = 0;
+		for (int h = 0; h < env.headings(); h++)
+		{
+			const double* src = env.plane(h);
+			double* dst = plane(h);
+			for (int y = 1; y <= env.height(); y++)
+			{
+				for (int x = 1; x <= env.width(); x++) dst[offsetOf(x, y)] = src[env.index(x, y)];
+			}
+		}
+		m_scale = env.scale();
+		m_stats = getStats();
+	}
+	void store(Environment& env)
+	{
+		env.leaveSparse();
+		for (int h = 0; h < env.headings(); h++)
+		{
+			const double* src = plane(h);
+			double* dst = env.plane(h);
+			for (int y = 1; y <= env.height(); y++)
+			{
+				for (int x = 1; x <= env.width(); x++) dst[env.index(x, y)] = src[offsetOf(x, y)] * m_scale;
+			}
+		}
+		env.normalize(env.getStats());
+	}
+
+	double probability(int heading, int x, int y) { return plane(heading)[offsetOf(x, y)] * m_scale; }
+
+	// Runs fn(h, tile) for every tile of every h in [0, planes), in parallel when the Environment
+	// has a pool. Partial stats are combined in tile order.
+	template <typename F>
+	BeliefStats forEachTile(int planes, F fn)
+	{
+		std::vector<BeliefStats> partial((size_t)planes * tiles());
+		std::function<void(size_t)> task = [&](size_t t) { partial[t] = fn((int)(t / tiles()), (int)(t % tiles())); };
+		if (m_env.threadPool()) m_env.threadPool()->parallelFor(partial.size(), task);
+		else for (size_t t = 0; t < partial.size(); t++) task(t);
+
+		BeliefStats stats;
+		for (const BeliefStats& p : partial) stats.add(p);
+		return stats;
+	}
+
+	BeliefStats applyFilter(Filter f, const SensorModel& sm)
+	{
+		std::vector<LikelihoodTable> tables = m_env.headingTables(f, sm);
+		return applyFilter(tables.data());
+	}
+	// sensor update, tables[h] for heading h
+	BeliefStats applyFilter(const LikelihoodTable* tables)
+	{
+		return forEachTile(m_env.headings(), [&](int h, int tile)
+		{
+			BeliefStats stats;
+			double* p = plane(h) + (size_t)tile * TILE_CELLS;
+			const uint8_t* sig = &m_signature[(size_t)tile * TILE_CELLS];
+			const double* t = tables[h].p;
+			for (int i = 0; i < TILE_CELLS; i++)
+			{
+				p[i] *= t[sig[i]];
+				stats.add(p[i]);
+			}
+			return stats;
+		});
+	}
+
+	BeliefStats moveForward(MovementModel mm)
+	{
+		std::vector<CellOffset> sources(m_env.headings());
+		for (int h = 0; h < m_env.headings(); h++) sources[h] = m_env.forwardSource(h);
+		return applyMovement(0, m_env.headings(), sources.data(), mm);
+	}
+	BeliefStats applyMovement(int heading, CellOffset source, MovementModel mm)
+	{
+		return applyMovement(heading, 1, &source, mm);
+	}
+	// headings [headingFirst, headingFirst + headingCount) move from sources[h - headingFirst],
+	// same operator as Environment::applyMovement; other headings are left as they are
+	BeliefStats applyMovement(int headingFirst, int headingCount, const CellOffset* sources, MovementModel mm)
+	{
+		for (int h = headingFirst; h < headingFirst + headingCount; h++)
+		{
+			AlignedBuffer<double>& next = m_next[physical(h)];
+			if (next.size() != m_planeSize) next.resize(m_planeSize);
+		}
+		BeliefStats stats = forEachTile(headingCount, [&](int i, int tile)
+		{
+			BeliefStats stats;
+			const int h = headingFirst + i;
+			const double* in = plane(h);
+			double* out = m_next[physical(h)].data() + (size_t)tile * TILE_CELLS;
+			const double* own = in + (size_t)tile * TILE_CELLS;
+			const int dx = sources[i].dx;
+			const int dy = sources[i].dy;
+			const uint8_t* sig = &m_signature[(size_t)tile * TILE_CELLS];
+			const int xFirst = dx < 0 ? 1 : 0;
+			const int xEnd = dx > 0 ? TILE - 1 : TILE;
+			for (int y = 0; y < TILE; y++)
+			{
+				TileRows src = sourceRows(in, tile, y, dx, dy);
+				const double* row = own + y * TILE;
+				const uint8_t* rowSig = sig + y * TILE;
+				double* rowOut = out + y * TILE;
+				for (int x = xFirst; x < xEnd; x++)
+				{
+					if (rowSig[x] == WALL_SIGNATURE) continue;
+					rowOut[x] = row[x] * mm.pFail + src.mid[x + dx] * mm.pSuccess; // walls hold 0
+					stats.add(rowOut[x]);
+				}
+				if (dx != 0) // edge column, its source is in the next tile column
+				{
+					int x = dx < 0 ? 0 : TILE - 1;
+					if (rowSig[x] == WALL_SIGNATURE) continue;
+					rowOut[x] = row[x] * mm.pFail + src.side[dx < 0 ? TILE - 1 : 0] * mm.pSuccess;
+					stats.add(rowOut[x]);
+				}
+			}
+			return stats;
+		});
+		for (int h = headingFirst; h < headingFirst + headingCount; h++) m_planes[physical(h)].swap(m_next[physical(h)]);
+		return stats;
+	}
+
+	// see HeadingTurn
+	BeliefStats applyTurn(int bins, MovementModel mm)
+	{
+		const int n = m_env.headings();
+		const HeadingTurn turn(n, bins, mm);
+		m_headingOffset = turn.offset(m_headingOffset);
+		if (!turn.blends()) return m_stats;
+
+		return forEachTile(1, [&](int, int tile) // all planes per cell
+		{
+			BeliefStats stats;
+			std::vector<double> old(n);
+			std::vector<double*> p(n);
+			for (int q = 0; q < n; q++) p[q] = m_planes[q].data() + (size_t)tile * TILE_CELLS;
+			for (int i = 0; i < TILE_CELLS; i++)
+			{
+				for (int q = 0; q < n; q++) old[q] = p[q][i];
+				for (int q = 0; q < n; q++)
+				{
+					double probValue = turn.blend(old[q], old[turn.from(q)]);
+					p[q][i] = probValue;
+					stats.add(probValue);
+				}
+			}
+			return stats;
+		});
+	}
+
+	BeliefStats getStats()
+	{
+		return forEachTile(m_env.headings(), [&](int h, int tile)
+		{
+			BeliefStats stats;
+			const double* p = plane(h) + (size_t)tile * TILE_CELLS;
+			for (int i = 0; i < TILE_CELLS; i++) stats.add(p[i]);
+			return stats;
+		});
+	}
+	// returns the normalized stats
+	BeliefStats normalize(const BeliefStats& stats)
+	{
+		return Environment::normalizeLazily(stats, m_scale, m_stats, [&](double sum)
+		{
+			const double factor = 1.0 / sum;
+			forEachTile(m_env.headings(), [&](int h, int tile)
+			{
+				double* p = plane(h) + (size_t)tile * TILE_CELLS;
+				for (int i = 0; i < TILE_CELLS; i++) p[i] *= factor;
+				return BeliefStats();
+			});
+		});
+	}
+
+	// Milliseconds per single-heading move in each eDirection, row-major Environment against
+	// tiles, averaged over `repeats` moves on the given map. Both beliefs are left changed.
+	static std::string benchmark(Environment& env, int repeats)
+	{
+		static const char* names[4] = { "Up", "Right", "Down", "Left" };
+		TiledBelief tiled(env.map(), env.headings(), env.threadPool());
+		tiled.load(env);
+		MovementModel mm;
+		std::string report;
+		for (int d = 0; d < 4; d++)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+			for (int r = 0; r < repeats; r++) env.applyMovement(0, (eDirection)d, mm);
+			auto t1 = std::chrono::steady_clock::now();
+			for (int r = 0; r < repeats; r++) tiled.applyMovement(0, Environment::sourceOffset((eDirection)d), mm);
+			auto t2 = std::chrono::steady_clock::now();
+
+			char line[128];
+			snprintf(line, sizeof(line), "%-5s row-major %8.3f ms  tiled %8.3f ms\n", names[d],
+				std::chrono::duration<double, std::milli>(t1 - t0).count() / repeats,
+				std::chrono::duration<double, std::milli>(t2 - t1).count() / repeats);
+			report += line;
+		}
+		return report;
+	}
+
+private:
+	TileRows sourceRows(const double* in, int tile, int y, int dx, int dy) const
+	{
+		int tx = tile % m_tilesX;
+		int ty = tile / m_tilesX;
+		int sy = y + dy;
+		if (sy < 0) { ty--; sy += TILE; }
+		else if (sy >= TILE) { ty++; sy -= TILE; }
+
+		TileRows rows = { m_zeroRow.data(), m_zeroRow.data() };
+		if (ty < 0 || ty >= m_tilesY) return rows;
+		rows.mid = in + ((size_t)ty * m_tilesX + tx) * TILE_CELLS + sy * TILE;
+		if (tx + dx >= 0 && tx + dx < m_tilesX) rows.side = in + ((size_t)ty * m_tilesX + tx + dx) * TILE_CELLS + sy * TILE;
+		return rows;
+	}
+};
@@ -2,6 +2,19 @@
 #include <tchar.h>
 #include "WindowClass.h"
 #include "InterfaceController.h"
+#include "MotionOperator.h"
+#include "CompactBelief.h"
+#include "FreeCellBelief.h"
+#include "TiledBelief.h"
+#include "MultiResolution.h"
+#include "ParticleFilter.h"
+#include "OutOfCoreBelief.h"
+#include "ActiveLocalization.h"
+#include "BeliefHistory.h"
+#include "BeliefPredictor.h"
+#include "MapArtifact.h"
+#include "RangeSensor.h"
+#include "LikelihoodField.h"
 
 // OpenGL context and window handles
 HDC g_hDC;
@@ -9,93 +22,191 @@ HGLRC g_hRC;
 HWND g_hWnd;
 
 
-std::vector<Environment*> Environment::allEnvironments;
 std::vector<Button*> Button::allButtons;
 
-EnvironmentUIController ep("map1.txt");
+ThreadPool threadPool;
+EnvironmentUIController ep; // shows the Environment built in WinMain, or the out-of-core belief
 ButtonRenderer br;
 
 Filter f;
 SensorModel sm;
 MovementModel mm;
+MotionOperatorCache motionOperators;
+CompactBelief<LogFloat32Codec>* logBelief = nullptr; // set when BELIEF_STORAGE selects it
+CompactBelief<Quantized16Codec>* quantizedBelief = nullptr;
+MultiResolutionLocalizer* multiResolution = nullptr; // set when COARSE_BLOCK > 0
+HybridLocalizer* hybrid = nullptr; // set when MCL_PARTICLES > 0
+FreeCellBelief* freeCellBelief = nullptr; // set when FREE_CELL_ENGINE
+TiledBelief* tiledBelief = nullptr; // set when TILED_ENGINE
+OutOfCoreBelief* outOfCore = nullptr; // set when OUT_OF_CORE_TILES > 0
+ActiveLocalizer* activeLocalizer = nullptr; // picks the "Best" movement, when ACTIVE_STEP_BUDGET_MS > 0 and no other engine is selected
+BeliefHistory* history = nullptr; // the Environment's belief after every step, when no other engine is selected
+int historyView = -1; // step shown, -1 = the current belief
+BeliefPredictor* predictor = nullptr; // what-if previews of Forward moves, when no other engine is selected
+Eigen::VectorXd preview; // belief shown by showPreview
+RangeSensor* rangeSensor = nullptr; // simulated range scans, when RANGE_BEAMS > 0 and no other engine is selected
+LikelihoodField* likelihoodField = nullptr; // scores them instead of rangeSensor, when LIKELIHOOD_FIELD
 
 
-void normalize()
+// stats = sum and max of the unnormalized belief, accumulated by the update pass
+void normalize(const BeliefStats& stats)
 {
-	double sum = 0;
-	for (Environment* e : Environment::allEnvironments)
+	BeliefStats normalized;
+	if (logBelief) normalized = logBelief->normalize(stats);
+	else if (quantizedBelief) normalized = quantizedBelief->normalize(stats);
+	else if (multiResolution) normalized = multiResolution->normalize(stats);
+	else if (hybrid) normalized = hybrid->normalize(stats);
+	else if (freeCellBelief) normalized = freeCellBelief->normalize(stats);
+	else if (tiledBelief) normalized = tiledBelief->normalize(stats);
+	else if (outOfCore) normalized = outOfCore->normalize(stats);
+	else normalized = ep.env->normalize(stats);
+	if (ep.maxValue < normalized.max) ep.maxValue = normalized.max; // for gradient rendering
+}
+
+// shows a step of the history, -1 = the current belief
+void showHistory(int step)
+{
+	historyView = step;
+	if (step < 0) ep.probabilityOf = [](int h, int x, int y) { return ep.env->probability(h, x, y); };
+	else ep.probabilityOf = [](int h, int x, int y) { return history->probability(historyView, h, x, y); };
+	const int shown = step < 0 ? history->lastStep() : step;
+	ep.statusText = "Step " + std::to_string(shown) + " of " + std::to_string(history->lastStep()) + ": " + history->label(shown);
+}
+
+// shows the belief after `moves` Forward moves from the current one, 0 = the current belief
+void showPreview(int moves)
+{
+	if (moves == 0)
 	{
-		sum += e->getSum();
+		if (history) showHistory(-1);
+		else
+		{
+			ep.probabilityOf = [](int h, int x, int y) { return ep.env->probability(h, x, y); };
+			ep.statusText.clear();
+		}
+		return;
 	}
-	for (Environment* e : Environment::allEnvironments)
+	preview = predictor->predict(predictor->snapshot(), *predictor->forwardPower(moves));
+	ep.probabilityOf = [](int h, int x, int y) { return predictor->probability(preview, h, x, y); };
+	ep.statusText = "Preview: " + std::to_string(moves) + " x Forward (0 = current belief)";
+}
+
+void recordStep(const std::string& label)
+{
+	if (history) history->record(*ep.env, label);
+	if (history || predictor) showPreview(0);
+}
+
+// digit keys preview that many Forward moves, 0 returns to the current belief
+void OnPreviewKey(WPARAM key)
+{
+	if (predictor && key >= '0' && key <= '9') showPreview((int)(key - '0'));
+}
+
+// arrow keys step through the history, Backspace returns the belief to the step shown (or the one before)
+void OnHistoryKey(WPARAM key)
+{
+	if (!history) return;
+	const int current = historyView < 0 ? history->lastStep() : historyView;
+	if (key == VK_LEFT) showHistory(std::max(history->firstStep(), current - 1));
+	else if (key == VK_RIGHT) showHistory(current + 1 >= history->lastStep() ? -1 : current + 1);
+	else if (key == VK_BACK)
 	{
-		e->normalizeWithSum(sum); // for gradient rendering
-		if (ep.maxValue < e->getMax()) ep.maxValue = e->getMax();
+		const int step = historyView < 0 ? current - 1 : current;
+		if (step < history->firstStep()) return;
+		history->restore(step, *ep.env);
+		history->truncate(step);
+		showHistory(-1);
 	}
 }
 
 void OnApplyFilter(Filter f1)
 {
-	Filter f2 = f1.rotateRight();
-	Filter f3 = f2.rotateRight();
-	Filter f4 = f3.rotateRight();
-
-	ep.envUp->applyFilter(f1, sm);
-	ep.envRight->applyFilter(f2, sm);
-	ep.envDown->applyFilter(f3, sm);
-	ep.envLeft->applyFilter(f4, sm);
-
-	normalize();
+	// reading rotated into each heading's map frame
+	if (logBelief) normalize(logBelief->applyFilter(f1, sm));
+	else if (quantizedBelief) normalize(quantizedBelief->applyFilter(f1, sm));
+	else if (multiResolution) normalize(multiResolution->applyFilter(f1, sm));
+	else if (hybrid) normalize(hybrid->applyFilter(f1, sm));
+	else if (freeCellBelief) normalize(freeCellBelief->applyFilter(f1, sm));
+	else if (tiledBelief) normalize(tiledBelief->applyFilter(f1, sm));
+	else if (outOfCore) normalize(outOfCore->applyFilter(f1, sm));
+	else normalize(ep.env->applyFilter(f1, sm));
+	recordStep("Filter");
 	return;
 }
 
+// movement on one of the alternative engines, each with its own forward model: one cell with pSuccess
+template <typename Belief>
+bool beliefMovement(Belief* belief, const std::string& s, BeliefStats& stats)
+{
+	if (!belief) return false;
+	if (s == "Forward") stats = belief->moveForward(mm);
+	else if (s == "Turn left") stats = belief->applyTurn(Environment::quarterTurnBins(HEADING_BINS), mm);
+	else if (s == "Turn right") stats = belief->applyTurn(-Environment::quarterTurnBins(HEADING_BINS), mm);
+	else return false;
+	return true;
+}
+
 void OnSendMovement(const std::string s)
 {
-	if (s == "Forward")
+	Environment* env = ep.env;
+
+	if (s == "Best")
 	{
-		ep.envUp->applyMovement(eDirection::Up, mm); // pForwardForward + pForwardStop
-		ep.envRight->applyMovement(eDirection::Right, mm);
-		ep.envDown->applyMovement(eDirection::Down, mm);
-		ep.envLeft->applyMovement(eDirection::Left, mm);
+		if (!activeLocalizer) return; // the choice is made on the Environment's own belief
+		ActionChoice choice = activeLocalizer->choose(ACTIVE_STEP_BUDGET_MS);
+		if (!choice.action.empty()) OnSendMovement(choice.action);
+		return;
+	}
+
+	BeliefStats stats;
+	if (logBelief || quantizedBelief || multiResolution || hybrid || freeCellBelief || tiledBelief || outOfCore)
+	{
+		if (!beliefMovement(logBelief, s, stats) && !beliefMovement(quantizedBelief, s, stats) &&
+			!beliefMovement(multiResolution, s, stats) && !beliefMovement(hybrid, s, stats) &&
+			!beliefMovement(freeCellBelief, s, stats) && !beliefMovement(tiledBelief, s, stats) &&
+			!beliefMovement(outOfCore, s, stats)) return;
+	}
+	else if (s == "Forward")
+	{
+		stats = motionOperators.get(s, *env, MotionNoise(mm)).apply(*env); // pForwardForward + pForwardStop
 	}
 	else if(s=="Turn left")
 	{
-		for (size_t i = 1; i < SIZE_X + 1; i++)
-		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
-			{
-				double newUp = ep.envUp->data[i][j] * mm.pFail + ep.envRight->data[i][j] * mm.pSuccess;
-				double newRight = ep.envRight->data[i][j] * mm.pFail + ep.envDown->data[i][j] * mm.pSuccess;
-				double newDown = ep.envRight->data[i][j] * mm.pFail + ep.envLeft->data[i][j] * mm.pSuccess;
-				double newLeft = ep.envRight->data[i][j] * mm.pFail + ep.envUp->data[i][j] * mm.pSuccess;
-
-				ep.envUp->data[i][j] = newUp;
-				ep.envRight->data[i][j] = newRight;
-				ep.envDown->data[i][j] = newDown;
-				ep.envLeft->data[i][j] = newLeft;
-			}
-		}
+		stats = env->applyTurn(env->quarterTurnBins(), mm);
 	}
 	else if(s=="Turn right")
 	{
-		for (size_t i = 1; i < SIZE_X + 1; i++)
+		stats = env->applyTurn(-env->quarterTurnBins(), mm);
+	}
+	else return;
+
+	normalize(stats);
+	recordStep(s);
+	return;
+}
+
+// range scan of a robot at the clicked pose, applied to the Environment's belief
+void OnScanClick()
+{
+	int h, x, y;
+	if (!rangeSensor || !ep.hoveredPose(h, x, y)) return;
+	RangeScan scan = rangeSensor->expectedScan(h, x, y);
+	if (scan.ranges.empty()) return; // a wall
+	if (likelihoodField)
+	{
+		// cells from the center of the robot's cell to the edge of the wall hit, see RangeSensor::castRay
+		const RangeSensorModel& m = rangeSensor->model();
+		BeamScan beams;
+		for (int b = 0; b < rangeSensor->beams(); b++)
 		{
-			for (size_t j = 1; j < SIZE_Y + 1; j++)
-			{
-				double newUp = ep.envUp->data[i][j] * mm.pFail + ep.envLeft->data[i][j] * mm.pSuccess;
-				double newRight = ep.envRight->data[i][j] * mm.pFail + ep.envUp->data[i][j] * mm.pSuccess;
-				double newDown = ep.envRight->data[i][j] * mm.pFail + ep.envRight->data[i][j] * mm.pSuccess;
-				double newLeft = ep.envRight->data[i][j] * mm.pFail + ep.envDown->data[i][j] * mm.pSuccess;
-
-				ep.envUp->data[i][j] = newUp;
-				ep.envRight->data[i][j] = newRight;
-				ep.envDown->data[i][j] = newDown;
-				ep.envLeft->data[i][j] = newLeft;
-			}
+			beams.angles.push_back(rangeSensor->beamAngle(b));
+			beams.ranges.push_back(scan.ranges[b] < m.maxRange ? scan.ranges[b] * m.resolution + 0.5 : likelihoodField->model().maxRange);
 		}
+		normalize(likelihoodField->apply(beams));
 	}
-	normalize();
-	return;
+	else normalize(rangeSensor->apply(scan));
+	recordStep("Range scan");
 }
 
 SensorInputUIController sip(30,30, OnApplyFilter);
@@ -168,6 +279,11 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 	case WM_LBUTTONUP:
 		sip.processClick();
 		mip.processClick();
+		OnScanClick();
+		break;
+	case WM_KEYDOWN:
+		OnHistoryKey(wParam);
+		OnPreviewKey(wParam);
 		break;
 	case WM_DESTROY:
 		PostQuitMessage(0);
@@ -181,6 +297,86 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 // WinMain - Entry point of the Windows application
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
+	if (OUT_OF_CORE_TILES > 0)
+	{
+		// the map is streamed from its text file, no Environment is built
+		outOfCore = new OutOfCoreBelief("map1.txt", HEADING_BINS, ".", OUT_OF_CORE_TILES, &threadPool);
+		if (!outOfCore->isOpen()) return -1; // reported by OutOfCoreBelief
+		ep.layout(outOfCore->width(), outOfCore->height(), outOfCore->headings());
+		ep.probabilityOf = [](int h, int x, int y) { return outOfCore->probability(h, x, y); };
+		ep.isFreeCell = [](int x, int y) { return outOfCore->isFree(x, y); };
+	}
+	else
+	{
+		std::string error;
+		std::shared_ptr<const GridMap> map = MAP_ARTIFACT ? MapArtifact::open("map1.txt", &threadPool, &error) : GridMap::load("map1.txt");
+		if (!map)
+		{
+			MessageBoxA(0, error.c_str(), "Error", MB_OK);
+			return -1;
+		}
+		if (BELIEF_STORAGE == LogFloat32)
+		{
+			// engines that keep their own belief get no Environment volume
+			logBelief = new CompactBelief<LogFloat32Codec>(map, HEADING_BINS, &threadPool);
+			ep.show(map, HEADING_BINS, [](int h, int x, int y) { return logBelief->probability(h, x, y); });
+		}
+		else if (BELIEF_STORAGE == Quantized16)
+		{
+			quantizedBelief = new CompactBelief<Quantized16Codec>(map, HEADING_BINS, &threadPool);
+			ep.show(map, HEADING_BINS, [](int h, int x, int y) { return quantizedBelief->probability(h, x, y); });
+		}
+		else if (FREE_CELL_ENGINE)
+		{
+			freeCellBelief = new FreeCellBelief(map, HEADING_BINS, &threadPool);
+			ep.show(map, HEADING_BINS, [](int h, int x, int y) { return freeCellBelief->probability(h, x, y); });
+		}
+		else if (TILED_ENGINE)
+		{
+			tiledBelief = new TiledBelief(map, HEADING_BINS, &threadPool);
+			ep.show(map, HEADING_BINS, [](int h, int x, int y) { return tiledBelief->probability(h, x, y); });
+		}
+		else
+		{
+			ep.show(new Environment(map, HEADING_BINS));
+			ep.env->setThreadPool(&threadPool);
+			if (COARSE_BLOCK > 0)
+			{
+				multiResolution = new MultiResolutionLocalizer(*ep.env, COARSE_BLOCK);
+				ep.probabilityOf = [](int h, int x, int y) { return multiResolution->probability(h, x, y); };
+			}
+			else if (MCL_PARTICLES > 0)
+			{
+				hybrid = new HybridLocalizer(*ep.env, MCL_PARTICLES);
+				ep.probabilityOf = [](int h, int x, int y) { return hybrid->probability(h, x, y); };
+			}
+			else
+			{
+				ep.env->setTracking(true); // MAP pose and entropy for the UI
+				ep.env->getStats();
+				if (BELIEF_HISTORY_MB > 0)
+				{
+					history = new BeliefHistory(*ep.env, (size_t)BELIEF_HISTORY_MB << 20);
+					recordStep("Start");
+				}
+				if (ACTIVE_STEP_BUDGET_MS > 0) activeLocalizer = new ActiveLocalizer(*ep.env, sm, mm);
+				if (RANGE_BEAMS > 0)
+				{
+					std::vector<double> beamAngles;
+					for (int b = 0; b < RANGE_BEAMS; b++) beamAngles.push_back(Environment::headingAngle(RANGE_BEAMS, b)); // evenly spaced
+					rangeSensor = new RangeSensor(*ep.env, beamAngles);
+					if (LIKELIHOOD_FIELD)
+					{
+						LikelihoodFieldModel model;
+						model.maxRange = rangeSensor->model().maxRange * rangeSensor->model().resolution;
+						likelihoodField = new LikelihoodField(*ep.env, model);
+					}
+				}
+				if (PREDICTION_CACHE_MB > 0) predictor = new BeliefPredictor(*ep.env, MotionNoise(mm), mm, (size_t)PREDICTION_CACHE_MB << 20);
+			}
+		}
+	}
+
 	Controller ctrlGL;
 	WindowClass glWin(hInstance, L"Markov Localization - Aleksandrs Buraks 171RDB289 IRDMR0", NULL, &ctrlGL);
 	glWin.setWindowStyle(WS_OVERLAPPEDWINDOW);
@@ -3,6 +3,20 @@
 // Window size
 const int WINDOW_WIDTH = 1000;
 const int WINDOW_HEIGHT = 790;
-const int SIZE_X = 10;
-const int SIZE_Y = 10;
-const double cellSize = (1280 / 4) / 10;
\ No newline at end of file
+const double gridPanelSize = 1280 / 4; // on-screen size of one heading grid
+const double cellSize = gridPanelSize / 10; // largest on-screen cell, smaller for big maps
+const int HEADING_BINS = 4; // belief planes, evenly spaced clockwise from Up
+const bool MAP_ARTIFACT = true; // load the map from its compiled binary (map1.txt.gridmap, rebuilt when the map changes)
+// belief storage: Float64 = Environment's doubles, LogFloat32 / Quantized16 = CompactBelief
+enum eBeliefStorage { Float64, LogFloat32, Quantized16 };
+const eBeliefStorage BELIEF_STORAGE = Float64;
+const int COARSE_BLOCK = 0; // cells per block side for coarse-to-fine localization (double storage only), 0 = off
+const int MCL_PARTICLES = 0; // switch to Monte Carlo localization with this many particles once localized, 0 = off
+const bool FREE_CELL_ENGINE = false; // belief over free cells only (FreeCellBelief), double storage
+const bool TILED_ENGINE = false; // belief in TILE x TILE blocks (TiledBelief), double storage
+const int OUT_OF_CORE_TILES = 0; // belief tiles kept mapped by OutOfCoreBelief (tile files in the working directory), 0 = off
+const double ACTIVE_STEP_BUDGET_MS = 100.0; // time the "Best" movement may spend scoring the candidate actions
+const int BELIEF_HISTORY_MB = 256; // memory for past beliefs (scrubbing with the arrow keys, undo with Backspace), 0 = off
+const int PREDICTION_CACHE_MB = 64; // composed motion operators kept for the what-if preview (digit keys: that many Forward moves), 0 = off
+const int RANGE_BEAMS = 8; // beams of a simulated range scan, evenly spaced from the heading; clicking a cell scans from that pose, 0 = off
+const bool LIKELIHOOD_FIELD = false; // range scans scored by LikelihoodField (distance of the beam endpoints to the nearest wall) instead of the beam model
\ No newline at end of file
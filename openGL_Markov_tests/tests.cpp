@@ -0,0 +1,1203 @@
+// Checks of the openGL_Markov engines against a straightforward reference, run as a console
+// program: prints every failed check and returns the number of failures.
+#include <windows.h>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "MarkovClasses.h"
+#include "CompactBelief.h"
+#include "MultiResolution.h"
+#include "ParticleFilter.h"
+#include "FreeCellBelief.h"
+#include "TiledBelief.h"
+#include "OutOfCoreBelief.h"
+#include "RobotBatch.h"
+#include "BeliefHistory.h"
+#include "MapArtifact.h"
+#include "BeliefPredictor.h"
+#include "RangeSensor.h"
+#include "LikelihoodField.h"
+#include "ActiveLocalization.h"
+
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what)
+{
+	if (ok) return;
+	failures++;
+	printf("FAILED: %s\n", what.c_str());
+}
+static void checkError(double error, double tolerance, const std::string& what)
+{
+	check(error <= tolerance, what + ": error " + std::to_string(error) + " > " + std::to_string(tolerance));
+}
+
+// width x height cells, each a wall with probability `walls`
+static std::shared_ptr<const GridMap> randomMap(int width, int height, double walls, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::bernoulli_distribution wall(walls);
+	std::vector<uint8_t> free((size_t)width * height);
+	for (uint8_t& f : free) f = !wall(rng);
+	return GridMap::build(width, height, [&](int x, int y) { return free[(size_t)(y - 1) * width + x - 1] != 0; });
+}
+
+// the map as a text map, see GridMap::freeInText
+static void writeTextMap(const GridMap& map, const std::string& path)
+{
+	std::ofstream file(path);
+	for (int y = 1; y <= map.height(); y++)
+	{
+		for (int x = 1; x <= map.width(); x++) file << (map.isWall(x, y) ? 'w' : '0');
+		file << "\n";
+	}
+}
+
+// normalized probability of every pose, [heading][y][x] without the border
+template <typename Belief>
+static std::vector<double> probabilities(Belief& belief, const GridMap& map, int headings)
+{
+	std::vector<double> p;
+	for (int h = 0; h < headings; h++)
+	{
+		for (int y = 1; y <= map.height(); y++)
+		{
+			for (int x = 1; x <= map.width(); x++) p.push_back(belief.probability(h, x, y));
+		}
+	}
+	return p;
+}
+
+// Markov localization written out cell by cell, with no layout or normalization tricks: the
+// reference every engine is compared against. Normalized after every step.
+class ReferenceBelief
+{
+private:
+	std::shared_ptr<const GridMap> m_map;
+	int m_headings;
+	std::vector<double> m_p; // [heading][y][x], border included
+
+public:
+	ReferenceBelief(std::shared_ptr<const GridMap> map, int headings) : m_map(map), m_headings(headings)
+	{
+		m_p.assign((size_t)headings * map->planeSize(), 0.0);
+		for (int h = 0; h < headings; h++)
+		{
+			for (int y = 1; y <= map->height(); y++)
+			{
+				for (int x = 1; x <= map->width(); x++)
+				{
+					if (!map->isWall(x, y)) at(h, x, y) = 1.0 / ((double)headings * map->emptyCount());
+				}
+			}
+		}
+	}
+
+	int headings() const { return m_headings; }
+	double& at(int h, int x, int y) { return m_p[(size_t)h * m_map->planeSize() + m_map->index(x, y)]; }
+	double probability(int h, int x, int y) { return at(h, x, y); }
+	// takes over a belief given as by probabilities(), e.g. to follow an engine from there
+	void assign(const std::vector<double>& p)
+	{
+		size_t i = 0;
+		for (int h = 0; h < m_headings; h++)
+		{
+			for (int y = 1; y <= m_map->height(); y++)
+			{
+				for (int x = 1; x <= m_map->width(); x++) at(h, x, y) = p[i++];
+			}
+		}
+	}
+	double max() const { return *std::max_element(m_p.begin(), m_p.end()); }
+	double entropy() const
+	{
+		double e = 0.0;
+		for (double p : m_p) if (p > 0.0) e -= p * std::log(p);
+		return e;
+	}
+
+	// the neighbor in world direction d (eDirection order) is a wall
+	bool wallAt(int x, int y, int d) const
+	{
+		static const int dx[4] = { 0, 1, 0, -1 };
+		static const int dy[4] = { -1, 0, 1, 0 };
+		return m_map->isWall(x + dx[d % 4], y + dy[d % 4]);
+	}
+	// reading f in the robot frame: sensor direction d of heading h looks along world
+	// direction q + d, q quarter turns clockwise from Up, or between two of them
+	void sense(const Filter& f, const SensorModel& sm)
+	{
+		for (int h = 0; h < m_headings; h++)
+		{
+			const double quarters = 4.0 * h / m_headings;
+			const int q = (int)quarters;
+			const double w = quarters - q;
+			forEachFree([&](int x, int y)
+			{
+				double l = 1.0;
+				for (int d = 0; d < 4; d++)
+				{
+					const eCellOccupancy z = f.side((eDirection)d);
+					double p = sm.probModel[wallAt(x, y, q + d)][z] * (1.0 - w);
+					if (w > 0.0) p += sm.probModel[wallAt(x, y, q + d + 1)][z] * w;
+					l *= p;
+				}
+				at(h, x, y) *= l;
+			});
+		}
+		normalize();
+	}
+	// one cell along the heading (rounded to the 8-neighborhood) with pSuccess, staying with
+	// pFail; mass moving into a wall is lost
+	void forward(const MovementModel& mm)
+	{
+		std::vector<double> old = m_p;
+		for (int h = 0; h < m_headings; h++)
+		{
+			const double rad = 2.0 * 3.14159265358979323846 * h / m_headings;
+			const int dx = (int)std::lround(std::sin(rad));
+			const int dy = -(int)std::lround(std::cos(rad));
+			const size_t plane = (size_t)h * m_map->planeSize();
+			forEachFree([&](int x, int y)
+			{
+				double p = old[plane + m_map->index(x, y)] * mm.pFail;
+				if (!m_map->isWall(x - dx, y - dy)) p += old[plane + m_map->index(x - dx, y - dy)] * mm.pSuccess;
+				at(h, x, y) = p;
+			});
+		}
+		normalize();
+	}
+	// by `bins` heading bins, positive = left: new[h] = old[h] * pFail + old[h + bins] * pSuccess
+	void turn(int bins, const MovementModel& mm)
+	{
+		std::vector<double> old = m_p;
+		const size_t n = m_map->planeSize();
+		for (int h = 0; h < m_headings; h++)
+		{
+			const int from = ((h + bins) % m_headings + m_headings) % m_headings;
+			for (size_t k = 0; k < n; k++) m_p[h * n + k] = old[h * n + k] * mm.pFail + old[from * n + k] * mm.pSuccess;
+		}
+		normalize();
+	}
+
+private:
+	template <typename F>
+	void forEachFree(F fn)
+	{
+		for (int y = 1; y <= m_map->height(); y++)
+		{
+			for (int x = 1; x <= m_map->width(); x++)
+			{
+				if (!m_map->isWall(x, y)) fn(x, y);
+			}
+		}
+	}
+	void normalize()
+	{
+		double sum = 0.0;
+		for (double p : m_p) sum += p;
+		for (double& p : m_p) p /= sum;
+	}
+};
+
+// One command of a test run
+struct Step
+{
+	enum Kind { Sense, Forward, TurnLeft, TurnRight } kind;
+	Filter f; // Sense
+};
+
+// Commands of a robot driving around the map at random from a free cell, reading after every
+// move, noise-free. Turns are quarter turns, so the robot reads along the grid.
+static std::vector<Step> randomRun(const GridMap& map, int steps, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	uint32_t k = map.freeCells[rng() % map.freeCells.size()];
+	int x = (int)(k % map.stride()), y = (int)(k / map.stride());
+	int quarter = rng() % 4; // heading, quarter turns clockwise from Up
+	const int dx[4] = { 0, 1, 0, -1 };
+	const int dy[4] = { -1, 0, 1, 0 };
+	std::vector<Step> run;
+	for (int s = 0; s < steps; s++)
+	{
+		Step step;
+		step.kind = s % 2 ? Step::Sense : (Step::Kind)(1 + rng() % 3);
+		if (step.kind == Step::Sense)
+		{
+			for (int d = 0; d < 4; d++)
+			{
+				const int world = (quarter + d) % 4;
+				const eCellOccupancy z = map.isWall(x + dx[world], y + dy[world]) ? eCellOccupancy::Wall : eCellOccupancy::Empty;
+				if (d == 0) step.f.up = z;
+				else if (d == 1) step.f.right = z;
+				else if (d == 2) step.f.down = z;
+				else step.f.left = z;
+			}
+		}
+		else if (step.kind == Step::Forward)
+		{
+			if (!map.isWall(x + dx[quarter], y + dy[quarter]))
+			{
+				x += dx[quarter];
+				y += dy[quarter];
+			}
+		}
+		else quarter = (quarter + (step.kind == Step::TurnLeft ? 3 : 1)) % 4;
+		run.push_back(step);
+	}
+	return run;
+}
+
+// largest difference of two beliefs given as by probabilities(), relative to the largest of `expected`
+static double relativeError(const std::vector<double>& p, const std::vector<double>& expected)
+{
+	const double max = *std::max_element(expected.begin(), expected.end());
+	double error = 0.0;
+	for (size_t i = 0; i < p.size(); i++) error = std::max(error, std::fabs(p[i] - expected[i]) / max);
+	return error;
+}
+
+// Runs the commands on an engine and on the reference and returns the largest difference of a
+// normalized probability, relative to the reference's largest one. `step` is called after
+// every command with the reference, e.g. for checks of the engine's own statistics.
+template <typename Belief, typename F>
+static double compareRun(Belief& belief, std::shared_ptr<const GridMap> map, int headings, const std::vector<Step>& run, F step)
+{
+	SensorModel sm;
+	MovementModel mm;
+	ReferenceBelief ref(map, headings);
+	const int quarter = Environment::quarterTurnBins(headings);
+	double error = 0.0;
+	for (const Step& s : run)
+	{
+		switch (s.kind)
+		{
+		case Step::Sense:
+			belief.normalize(belief.applyFilter(s.f, sm));
+			ref.sense(s.f, sm);
+			break;
+		case Step::Forward:
+			belief.normalize(belief.moveForward(mm));
+			ref.forward(mm);
+			break;
+		case Step::TurnLeft:
+			belief.normalize(belief.applyTurn(quarter, mm));
+			ref.turn(quarter, mm);
+			break;
+		case Step::TurnRight:
+			belief.normalize(belief.applyTurn(-quarter, mm));
+			ref.turn(-quarter, mm);
+			break;
+		}
+		const double max = ref.max();
+		for (int h = 0; h < headings; h++)
+		{
+			for (int y = 1; y <= map->height(); y++)
+			{
+				for (int x = 1; x <= map->width(); x++)
+				{
+					error = std::max(error, std::fabs(belief.probability(h, x, y) - ref.at(h, x, y)) / max);
+				}
+			}
+		}
+		step(ref);
+	}
+	return error;
+}
+template <typename Belief>
+static double compareRun(Belief& belief, std::shared_ptr<const GridMap> map, int headings, const std::vector<Step>& run)
+{
+	return compareRun(belief, map, headings, run, [](const ReferenceBelief&) {});
+}
+
+// Largest difference between the summary an Environment tracked (MAP pose, top-k poses in
+// order, position marginal) and the same read off a full scan of its probabilities, relative
+// to the largest probability; HUGE_VAL when the top-k list is short or repeats a pose
+static double summaryError(Environment& env, const GridMap& map, int headings, int topK)
+{
+	const std::vector<double> p = probabilities(env, map, headings);
+	std::vector<double> sorted = p;
+	std::sort(sorted.begin(), sorted.end(), std::greater<double>());
+	const double max = sorted[0];
+	const BeliefCell best = env.mapCell();
+	double error = std::max(std::fabs(best.p - max), std::fabs(env.probability(best.heading, best.x, best.y) - max));
+
+	const std::vector<BeliefCell> top = env.topCells();
+	if (top.size() != (size_t)topK) return HUGE_VAL;
+	for (size_t i = 0; i < top.size(); i++)
+	{
+		error = std::max(error, std::fabs(top[i].p - sorted[i]));
+		error = std::max(error, std::fabs(env.probability(top[i].heading, top[i].x, top[i].y) - top[i].p));
+		for (size_t j = 0; j < i; j++)
+		{
+			if (top[j].heading == top[i].heading && top[j].x == top[i].x && top[j].y == top[i].y) return HUGE_VAL;
+		}
+	}
+
+	const size_t plane = (size_t)map.width() * map.height();
+	for (int y = 1; y <= map.height(); y++)
+	{
+		for (int x = 1; x <= map.width(); x++)
+		{
+			double marginal = 0.0;
+			for (int h = 0; h < headings; h++) marginal += p[h * plane + (size_t)(y - 1) * map.width() + x - 1];
+			error = std::max(error, std::fabs(env.marginal(x, y) - marginal));
+		}
+	}
+	return error / max;
+}
+
+// Environment, dense and sparse, serial and on a pool, with the summary it tracks against the
+// reference and against a full scan of its own belief
+static void testEnvironment(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 1);
+	for (int headings : { 4, 8 })
+	{
+		for (bool threaded : { false, true })
+		{
+			for (bool sparse : { false, true })
+			{
+				const std::string name = "Environment, " + std::to_string(headings) + " headings" +
+					(threaded ? ", pool" : "") + (sparse ? ", sparse" : "");
+				Environment env(map, headings);
+				if (threaded) env.setThreadPool(&pool);
+				env.setSparseAllowed(sparse);
+				env.setTracking(true, 4, true);
+				env.getStats();
+				int sparseSteps = 0;
+				double entropyError = 0.0, summaryErrorMax = 0.0;
+				const double error = compareRun(env, map, headings, randomRun(*map, 60, 7), [&](const ReferenceBelief& ref)
+				{
+					if (env.isSparse()) sparseSteps++;
+					check(env.hasSummary(), name + ": summary after a step");
+					if (!env.hasSummary()) return;
+					entropyError = std::max(entropyError, std::fabs(env.trackedEntropy() - ref.entropy()));
+					summaryErrorMax = std::max(summaryErrorMax, summaryError(env, *map, headings, 4));
+				});
+				// sparse mode drops cells below PRUNE_EPSILON
+				checkError(error, sparse ? 1e-6 : 1e-10, name);
+				checkError(entropyError, sparse ? 1e-6 : 1e-9, name + ", tracked entropy");
+				checkError(summaryErrorMax, sparse ? 1e-9 : 1e-12, name + ", MAP pose, top 4 and marginal");
+				if (sparse) check(sparseSteps > 0, name + ": went sparse");
+			}
+		}
+	}
+}
+
+// applies the commands of a run to an Environment
+static void applyRun(Environment& env, const std::vector<Step>& run)
+{
+	SensorModel sm;
+	MovementModel mm;
+	for (const Step& s : run)
+	{
+		if (s.kind == Step::Sense) env.normalize(env.applyFilter(s.f, sm));
+		else if (s.kind == Step::Forward) env.normalize(env.moveForward(mm));
+		else env.normalize(env.applyTurn(s.kind == Step::TurnLeft ? env.quarterTurnBins() : -env.quarterTurnBins(), mm));
+	}
+}
+
+// probability of every pose in a BeliefPredictor vector, as by probabilities()
+static std::vector<double> predictedProbabilities(const BeliefPredictor& predictor, const Eigen::VectorXd& belief, const GridMap& map, int headings)
+{
+	std::vector<double> p;
+	for (int h = 0; h < headings; h++)
+	{
+		for (int y = 1; y <= map.height(); y++)
+		{
+			for (int x = 1; x <= map.width(); x++) p.push_back(predictor.probability(belief, h, x, y));
+		}
+	}
+	return p;
+}
+
+// BeliefPredictor: Forward^k and action sequences against the moves applied one at a time,
+// and a small cache that evicts within its budget and still predicts the same
+static void testBeliefPredictor(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(40, 30, 0.25, 18);
+	const int headings = 8;
+	MovementModel mm;
+	Environment env(map, headings);
+	env.setThreadPool(&pool);
+	env.setSparseAllowed(false);
+	applyRun(env, randomRun(*map, 8, 19)); // a belief with some shape
+
+	const MotionNoise slip = MotionNoise::forward(1, 0.1, 0.1, 0.2);
+	BeliefPredictor predictor(env, MotionNoise(mm), mm, (size_t)64 << 20);
+	const Eigen::VectorXd start = predictor.snapshot();
+	const size_t forwardBytes = (size_t)BeliefPredictor(env, slip, mm, 0).action("Forward").nonZeros() * (sizeof(double) + sizeof(int32_t));
+	BeliefPredictor small(env, slip, mm, 3 * forwardBytes); // a few powers at most
+
+	Environment moved(map, headings), slipped(map, headings);
+	moved.setSparseAllowed(false);
+	slipped.setSparseAllowed(false);
+	moved.assignBelief(env);
+	slipped.assignBelief(env);
+	MotionOperator slipOperator(slipped, slip);
+	double error = 0.0, slipError = 0.0;
+	bool overBudget = false;
+	for (int k = 1; k <= 12; k++)
+	{
+		moved.normalize(moved.moveForward(mm));
+		slipped.normalize(slipOperator.apply(slipped));
+		error = std::max(error, relativeError(predictedProbabilities(predictor, predictor.predict(start, *predictor.forwardPower(k)), *map, headings),
+			probabilities(moved, *map, headings)));
+		slipError = std::max(slipError, relativeError(predictedProbabilities(small, small.predict(start, *small.forwardPower(k)), *map, headings),
+			probabilities(slipped, *map, headings)));
+		overBudget |= small.cachedBytes() > 3 * forwardBytes && small.cachedOperators() > 1;
+	}
+	checkError(error, 1e-10, "BeliefPredictor: Forward^k against k moveForward steps");
+	checkError(slipError, 1e-10, "BeliefPredictor: Forward^k against k MotionOperator steps, small cache");
+	check(!overBudget, "BeliefPredictor: cache over its budget");
+	check(small.cachedOperators() < predictor.cachedOperators(), "BeliefPredictor: small cache never evicted"); // same keys
+
+	const std::vector<std::string> actions = { "Turn left", "Forward", "Forward", "Forward", "Turn right", "Forward" };
+	const int quarter = env.quarterTurnBins();
+	for (const std::string& a : actions)
+	{
+		if (a == "Forward") env.normalize(env.moveForward(mm));
+		else env.normalize(env.applyTurn(a == "Turn left" ? quarter : -quarter, mm));
+	}
+	checkError(relativeError(predictedProbabilities(predictor, predictor.predict(start, *predictor.sequence(actions)), *map, headings),
+		probabilities(env, *map, headings)), 1e-10, "BeliefPredictor: sequence against the actions applied in order");
+}
+
+// CompactBelief in both codecs: float log-domain and 16-bit quantized values with a plane
+// exponent; the carried normalizer must keep the probabilities summing to 1
+template <typename Codec>
+static void testCompactBelief(ThreadPool& pool, const std::string& codec, double tolerance)
+{
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 2);
+	for (int headings : { 4, 8 })
+	{
+		const std::string name = "CompactBelief<" + codec + ">, " + std::to_string(headings) + " headings";
+		CompactBelief<Codec> belief(map, headings, &pool);
+		Environment env(map, headings);
+		checkError(relativeError(probabilities(belief, *map, headings), probabilities(env, *map, headings)), 1e-12, name + ", uniform");
+		double sumError = 0.0;
+		const double error = compareRun(belief, map, headings, randomRun(*map, 60, 8), [&](const ReferenceBelief&)
+		{
+			const std::vector<double> p = probabilities(belief, *map, headings);
+			sumError = std::max(sumError, std::fabs(std::accumulate(p.begin(), p.end(), 0.0) - 1.0));
+		});
+		checkError(error, tolerance, name);
+		checkError(sumError, 1e-9, name + ", sum of probabilities");
+
+		// conversion from and to the double volume of an Environment
+		belief.store(env);
+		const std::vector<double> stored = probabilities(env, *map, headings);
+		checkError(relativeError(stored, probabilities(belief, *map, headings)), 1e-12, name + ", store");
+		CompactBelief<Codec> loaded(map, headings);
+		loaded.load(env);
+		checkError(relativeError(probabilities(loaded, *map, headings), stored), tolerance, name + ", load");
+	}
+}
+
+// MultiResolutionLocalizer: with 1x1 blocks every coarse cell is one cell, so the coarse phase
+// is exact; with larger blocks the belief must follow the reference from the moment it is
+// refined. Coarse cells of more than 65535 free cells must keep their count.
+static void testMultiResolution(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 14);
+	const int headings = 4;
+	for (int block : { 1, 4 })
+	{
+		const std::string name = "MultiResolutionLocalizer, " + std::to_string(block) + "x" + std::to_string(block) + " blocks";
+		Environment env(map, headings);
+		env.setThreadPool(&pool);
+		MultiResolutionLocalizer belief(env, block);
+		int coarseSteps = 0, fineSteps = 0;
+		bool followed = false;
+		double coarseError = 0.0, fineError = 0.0;
+		compareRun(belief, map, headings, randomRun(*map, 80, 15), [&](ReferenceBelief& ref)
+		{
+			const std::vector<double> p = probabilities(belief, *map, headings);
+			if (!belief.isRefined())
+			{
+				coarseSteps++;
+				coarseError = std::max(coarseError, relativeError(p, probabilities(ref, *map, headings)));
+				followed = false;
+				return;
+			}
+			if (followed)
+			{
+				fineSteps++;
+				fineError = std::max(fineError, relativeError(p, probabilities(ref, *map, headings)));
+			}
+			ref.assign(p); // refined this step: the reference goes on from the refined belief
+			followed = true;
+		});
+		check(coarseSteps > 0 && fineSteps > 0, name + ": " + std::to_string(coarseSteps) + " coarse and " + std::to_string(fineSteps) + " fine steps");
+		if (block == 1) checkError(coarseError, 1e-10, name + ", coarse");
+		checkError(fineError, 1e-6, name + ", fine"); // sparse mode drops cells below PRUNE_EPSILON
+	}
+
+	std::shared_ptr<const GridMap> open = GridMap::build(300, 300, [](int, int) { return true; });
+	Environment env(open, 1);
+	MultiResolutionLocalizer belief(env, 300);
+	double sum = 0.0;
+	for (int y = 1; y <= open->height(); y++)
+	{
+		for (int x = 1; x <= open->width(); x++) sum += belief.probability(0, x, y);
+	}
+	checkError(std::fabs(sum - 1.0), 1e-9, "MultiResolutionLocalizer, one 300x300 block: sum of probabilities");
+}
+
+// HybridLocalizer: the grid hands over to particles sampled from its belief, particle steps
+// report the largest probability of a pose, and particles that collapse, by a reading that
+// fits none of them or by all of them driving into walls, restart the grid from uniform
+static void testHybridLocalizer(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(40, 30, 0.25, 20);
+	const int headings = 4, particles = 4000;
+	SensorModel sm;
+	MovementModel mm;
+	Environment start(map, headings);
+	const std::vector<double> uniform = probabilities(start, *map, headings);
+	auto largest = [&](HybridLocalizer& belief)
+	{
+		const std::vector<double> p = probabilities(belief, *map, headings);
+		return *std::max_element(p.begin(), p.end());
+	};
+	auto restarted = [&](HybridLocalizer& belief, const BeliefStats& stats, const std::string& name)
+	{
+		check(!belief.isParticleMode(), name + ": still in particle mode");
+		checkError(relativeError(probabilities(belief, *map, headings), uniform), 1e-12, name + ", uniform grid");
+		checkError(std::fabs(stats.max - largest(belief)), 1e-15, name + ", stats");
+	};
+
+	// systematic sampling: every pose holds its grid probability to within one particle
+	Environment env(map, headings);
+	env.setThreadPool(&pool);
+	applyRun(env, randomRun(*map, 12, 21));
+	const std::vector<double> grid = probabilities(env, *map, headings);
+	HybridLocalizer sampled(env, particles);
+	sampled.sampleFromGrid();
+	double sampleError = 0.0;
+	const std::vector<double> p = probabilities(sampled, *map, headings);
+	for (size_t i = 0; i < p.size(); i++) sampleError = std::max(sampleError, std::fabs(p[i] - grid[i]));
+	check(sampled.isParticleMode() && (int)sampled.particles().size() == particles, "HybridLocalizer: sampled particles");
+	checkError(sampleError, 1.0 / particles + 1e-12, "HybridLocalizer: sampled belief");
+
+	// every particle driven into a wall
+	MovementModel certain;
+	certain.pSuccess = 1.0;
+	certain.pFail = 0.0;
+	BeliefStats stats;
+	for (int i = 0; i < map->width() + map->height() && sampled.isParticleMode(); i++) stats = sampled.moveForward(certain);
+	restarted(sampled, stats, "HybridLocalizer, particles in walls");
+
+	// handover while driving
+	Environment driven(map, headings);
+	driven.setThreadPool(&pool);
+	HybridLocalizer belief(driven, particles);
+	const int quarter = Environment::quarterTurnBins(headings);
+	int gridSteps = 0, particleSteps = 0;
+	double maxError = 0.0, sumError = 0.0;
+	Filter last;
+	for (const Step& s : randomRun(*map, 120, 22))
+	{
+		if (s.kind == Step::Sense) stats = belief.applyFilter(last = s.f, sm);
+		else if (s.kind == Step::Forward) stats = belief.moveForward(mm);
+		else stats = belief.applyTurn(s.kind == Step::TurnLeft ? quarter : -quarter, mm);
+		if (!belief.isParticleMode())
+		{
+			gridSteps++;
+			continue;
+		}
+		particleSteps++;
+		const std::vector<double> q = probabilities(belief, *map, headings);
+		maxError = std::max(maxError, std::fabs(stats.max - *std::max_element(q.begin(), q.end())));
+		sumError = std::max(sumError, std::fabs(std::accumulate(q.begin(), q.end(), 0.0) - 1.0));
+	}
+	check(gridSteps > 0 && particleSteps > 0, "HybridLocalizer: " + std::to_string(gridSteps) + " grid and " + std::to_string(particleSteps) + " particle steps");
+	checkError(maxError, 1e-12, "HybridLocalizer: stats.max against the largest pose probability");
+	checkError(sumError, 1e-9, "HybridLocalizer: sum of probabilities");
+
+	// kidnapped: the opposite of the last reading on every side
+	check(belief.isParticleMode(), "HybridLocalizer: in particle mode at the end of the run");
+	Filter kidnapped;
+	kidnapped.up = last.up == eCellOccupancy::Wall ? eCellOccupancy::Empty : eCellOccupancy::Wall;
+	kidnapped.right = last.right == eCellOccupancy::Wall ? eCellOccupancy::Empty : eCellOccupancy::Wall;
+	kidnapped.down = last.down == eCellOccupancy::Wall ? eCellOccupancy::Empty : eCellOccupancy::Wall;
+	kidnapped.left = last.left == eCellOccupancy::Wall ? eCellOccupancy::Empty : eCellOccupancy::Wall;
+	for (int i = 0; i < 10 && belief.isParticleMode(); i++) stats = belief.applyFilter(kidnapped, sm);
+	restarted(belief, stats, "HybridLocalizer, kidnapped");
+}
+
+// FreeCellBelief: free cells only, motion through the sparse operators
+static void testFreeCellBelief(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 3);
+	for (int headings : { 4, 8 })
+	{
+		const std::string name = "FreeCellBelief, " + std::to_string(headings) + " headings";
+		FreeCellBelief belief(map, headings, &pool);
+		Environment env(map, headings);
+		checkError(relativeError(probabilities(belief, *map, headings), probabilities(env, *map, headings)), 1e-12, name + ", uniform");
+		checkError(compareRun(belief, map, headings, randomRun(*map, 60, 9)), 1e-10, name);
+
+		// conversion from and to the double volume of an Environment
+		belief.store(env);
+		const std::vector<double> stored = probabilities(env, *map, headings);
+		checkError(relativeError(stored, probabilities(belief, *map, headings)), 1e-12, name + ", store");
+		FreeCellBelief loaded(map, headings);
+		loaded.load(env);
+		checkError(relativeError(probabilities(loaded, *map, headings), stored), 1e-12, name + ", load");
+	}
+}
+
+// TiledBelief, on a map of several tiles both ways so moves cross tile edges
+static void testTiledBelief(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(TiledBelief::TILE * 2 + 20, TiledBelief::TILE + 30, 0.25, 4);
+	for (int headings : { 4, 8 })
+	{
+		const std::string name = "TiledBelief, " + std::to_string(headings) + " headings";
+		TiledBelief belief(map, headings, &pool);
+		Environment env(map, headings);
+		checkError(relativeError(probabilities(belief, *map, headings), probabilities(env, *map, headings)), 1e-12, name + ", uniform");
+		checkError(compareRun(belief, map, headings, randomRun(*map, 60, 10)), 1e-10, name);
+
+		// conversion from and to the double volume of an Environment
+		belief.store(env);
+		const std::vector<double> stored = probabilities(env, *map, headings);
+		checkError(relativeError(stored, probabilities(belief, *map, headings)), 1e-12, name + ", store");
+		TiledBelief loaded(map, headings);
+		loaded.load(env);
+		checkError(relativeError(probabilities(loaded, *map, headings), stored), 1e-12, name + ", load");
+	}
+}
+
+// OutOfCoreBelief on 2x2 tiles with the fewest resident tiles it allows, so batches evict
+// tiles all the time; two instances in one directory must not share tile files
+static void testOutOfCoreBelief(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(OutOfCoreBelief::TILE + 20, OutOfCoreBelief::TILE + 10, 0.25, 5);
+	const std::string path = "tests_outofcore.txt";
+	writeTextMap(*map, path);
+	for (int headings : { 4, 8 })
+	{
+		const std::string name = "OutOfCoreBelief, " + std::to_string(headings) + " headings";
+		OutOfCoreBelief belief(path, headings, ".", 1, &pool);
+		OutOfCoreBelief twin(path, headings, ".", 1, &pool);
+		check(belief.residentTiles() <= (size_t)std::max(3, headings), name + ": resident tiles");
+		int wrongFree = 0;
+		for (int y = 1; y <= map->height(); y++)
+		{
+			for (int x = 1; x <= map->width(); x++) wrongFree += belief.isFree(x, y) == map->isWall(x, y);
+		}
+		check(wrongFree == 0, name + ": free cells");
+		const std::vector<Step> run = randomRun(*map, 30, 11);
+		checkError(compareRun(belief, map, headings, run), 1e-9, name);
+		const std::vector<double> before = probabilities(belief, *map, headings);
+		checkError(compareRun(twin, map, headings, run), 1e-9, name + ", second instance");
+		check(probabilities(belief, *map, headings) == before, name + ": left alone by the second instance");
+	}
+	std::remove(path.c_str());
+
+	// failures are reported, not fatal: a missing map, and a batch over the resident limit
+	OutOfCoreBelief missing("tests_missing.txt", 4, ".", 1, &pool);
+	check(!missing.isOpen(), "OutOfCoreBelief: opened a missing map");
+	missing.normalize(missing.moveForward(MovementModel()));
+	check(missing.probability(0, 1, 1) == 0.0 && !missing.isFree(1, 1), "OutOfCoreBelief: belief of a missing map");
+	TileStore<double> store;
+	check(store.open("tests_tiles.bin", 2, 16, 1, 0.0), "TileStore: open");
+	store.beginBatch();
+	const bool first = store.write(0) != nullptr;
+	check(first && store.write(1) == nullptr && store.failed(), "TileStore: mapped more pages than the resident limit in one batch");
+	store.beginBatch();
+	check(store.read(0) == nullptr && store.write(0) == nullptr, "TileStore: handed out a page after a failure");
+}
+
+// RobotBatch: robots on one shared map, stepped together, against an Environment of their own
+// each. With as many robots as pool threads the robots run in parallel, with fewer one at a
+// time on the whole pool.
+static void testRobotBatch(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 6);
+	SensorModel sm;
+	MovementModel mm;
+	for (int robots : { 2, pool.size() })
+	{
+		const std::string name = "RobotBatch, " + std::to_string(robots) + " robots";
+		RobotBatch batch(map, 4, &pool, sm, mm);
+		std::vector<std::unique_ptr<Environment>> alone;
+		std::vector<std::vector<Step>> runs;
+		for (int r = 0; r < robots; r++)
+		{
+			batch.addRobot();
+			alone.emplace_back(new Environment(map, 4));
+			runs.push_back(randomRun(*map, 40, 20 + r));
+		}
+		MotionOperatorCache operators;
+		double error = 0.0;
+		for (size_t s = 0; s < runs[0].size(); s++)
+		{
+			for (int r = 0; r < robots; r++)
+			{
+				const Step& step = runs[r][s];
+				Environment& env = *alone[r];
+				switch (step.kind)
+				{
+				case Step::Sense:
+					batch.sense(r, step.f);
+					env.normalize(env.applyFilters(std::vector<Filter>(1, step.f), sm));
+					break;
+				case Step::Forward:
+					batch.move(r, "Forward");
+					env.normalize(operators.get("Forward", env, MotionNoise(mm)).apply(env));
+					break;
+				case Step::TurnLeft:
+					batch.move(r, "Turn left");
+					env.normalize(env.applyTurn(env.quarterTurnBins(), mm));
+					break;
+				case Step::TurnRight:
+					batch.move(r, "Turn right");
+					env.normalize(env.applyTurn(-env.quarterTurnBins(), mm));
+					break;
+				}
+			}
+			batch.tick();
+			for (int r = 0; r < robots; r++)
+			{
+				error = std::max(error, relativeError(probabilities(batch.robot(r), *map, 4), probabilities(*alone[r], *map, 4)));
+			}
+		}
+		checkError(error, 1e-12, name);
+		for (int r = 0; r < robots; r++) check(batch.robot(r).map() == map, name + ": robots share the map");
+	}
+}
+
+// poses of a recorded step further from `expected` than the codes allow: the rounding, the
+// delta tolerance and, near BeliefHistory::FLOOR, values stored as 0
+static int historyMismatches(BeliefHistory& history, int step, const std::vector<double>& expected, const GridMap& map, int headings, int tolerance)
+{
+	const double relative = std::exp((tolerance + 0.5) / BeliefHistory::STEPS_PER_NAT) - 1.0;
+	const double absolute = BeliefHistory::FLOOR * std::exp((tolerance + 1.0) / BeliefHistory::STEPS_PER_NAT);
+	int mismatches = 0;
+	size_t i = 0;
+	for (int h = 0; h < headings; h++)
+	{
+		for (int y = 1; y <= map.height(); y++)
+		{
+			for (int x = 1; x <= map.width(); x++, i++)
+			{
+				const double p = expected[i];
+				mismatches += std::fabs(history.probability(step, h, x, y) - p) > (p * relative + absolute) * (1.0 + 1e-9);
+			}
+		}
+	}
+	return mismatches;
+}
+
+// RangeSensor: ray-cast ranges on a map small enough to count by hand, the table type at the
+// uint8_t limit, and the sensor update against the beam likelihoods multiplied out per pose
+static void testRangeSensor(ThreadPool& pool)
+{
+	// 8 x 5 cells, one wall at (6, 3); the robot at (2, 3) has 2 free cells above, 3 to the
+	// right, 2 below and 1 to the left
+	std::shared_ptr<const GridMap> room = GridMap::build(8, 5, [](int x, int y) { return x != 6 || y != 3; });
+	Environment roomEnv(room, 4);
+	const std::vector<double> beamAngles = { 0.0, 90.0, 180.0, 270.0 };
+	RangeSensor sensor(roomEnv, beamAngles);
+	check(sensor.expectedScan(0, 2, 3).ranges == std::vector<int>({ 2, 3, 2, 1 }), "RangeSensor: ranges facing up");
+	check(sensor.expectedScan(1, 2, 3).ranges == std::vector<int>({ 3, 2, 1, 2 }), "RangeSensor: ranges facing right");
+	check(sensor.expectedScan(0, 6, 3).ranges.empty(), "RangeSensor: scan on a wall");
+	RangeSensorModel model;
+	model.maxRange = 2;
+	check(RangeSensor(roomEnv, beamAngles, model).expectedScan(0, 2, 3).ranges == std::vector<int>({ 2, 2, 2, 1 }), "RangeSensor: ranges past maxRange");
+	model.maxRange = 40;
+	model.resolution = 0.5;
+	check(RangeSensor(roomEnv, beamAngles, model).expectedScan(0, 2, 3).ranges == std::vector<int>({ 4, 6, 4, 2 }), "RangeSensor: ranges in half cells");
+
+	// a corridor longer than either limit: uint8_t up to 255, uint16_t from 256 on
+	std::shared_ptr<const GridMap> corridor = GridMap::build(300, 1, [](int, int) { return true; });
+	Environment corridorEnv(corridor, 4);
+	for (int maxRange : { 255, 256 })
+	{
+		model = RangeSensorModel();
+		model.maxRange = maxRange;
+		RangeSensor s(corridorEnv, { 90.0 }, model);
+		const std::string name = "RangeSensor, maxRange " + std::to_string(maxRange);
+		check(s.isWide() == (maxRange > 255), name + ": table type");
+		check(s.cacheBytes() == (size_t)corridor->emptyCount() * 4 * (maxRange > 255 ? 2 : 1), name + ": table bytes"); // one direction per heading
+		check(s.expectedRange(0, 0, 0) == maxRange && s.expectedRange(0, 0, 299 - maxRange) == maxRange && s.expectedRange(0, 0, 300 - maxRange) == maxRange - 1,
+			name + ": ranges at the limit");
+	}
+
+	// sensor update, dense and sparse, on a belief with some shape; the scan is one robot's
+	// expected scan with a short and a long reading
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 23);
+	for (bool sparse : { false, true })
+	{
+		const int headings = 8;
+		const std::string name = std::string("RangeSensor, ") + (sparse ? "sparse" : "dense");
+		Environment env(map, headings);
+		env.setThreadPool(&pool);
+		env.setSparseAllowed(sparse);
+		env.setTracking(true);
+		applyRun(env, randomRun(*map, 60, 24));
+		check(env.isSparse() == sparse, name + ": mode");
+		RangeSensor beams(env, { 0.0, 45.0, 90.0, 180.0, 270.0 });
+		const uint32_t k = map->freeCells[map->freeCells.size() / 3];
+		RangeScan scan = beams.expectedScan(3, (int)(k % map->stride()), (int)(k / map->stride()));
+		scan.ranges[1] = std::max(0, scan.ranges[1] - 2);
+		scan.ranges[3] += 1;
+
+		std::vector<double> expected = probabilities(env, *map, headings);
+		size_t pose = 0;
+		double sum = 0.0;
+		for (int h = 0; h < headings; h++)
+		{
+			for (int y = 1; y <= map->height(); y++)
+			{
+				for (int x = 1; x <= map->width(); x++, pose++)
+				{
+					const int32_t i = map->freeIndex[map->index(x, y)];
+					for (int b = 0; i >= 0 && b < beams.beams(); b++) expected[pose] *= beams.likelihood(beams.expectedRange(h, b, i), scan.ranges[b]);
+					sum += expected[pose];
+				}
+			}
+		}
+		for (double& p : expected) p /= sum;
+		env.normalize(beams.apply(scan));
+		checkError(relativeError(probabilities(env, *map, headings), expected), sparse ? 1e-6 : 1e-10, name + ": update"); // sparse mode prunes
+	}
+}
+
+// LikelihoodField: the distance transform against the nearest wall found by a full search,
+// and the sensor update against the beam model scored per pose from those distances
+static void testLikelihoodField(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 25);
+	std::vector<int> wallX, wallY;
+	for (int y = 0; y <= map->height() + 1; y++)
+	{
+		for (int x = 0; x < map->stride(); x++)
+		{
+			if (!map->isWall(x, y)) continue;
+			wallX.push_back(x);
+			wallY.push_back(y);
+		}
+	}
+	auto nearestWall = [&](int x, int y)
+	{
+		double best = HUGE_VAL;
+		for (size_t w = 0; w < wallX.size(); w++) best = std::min(best, std::hypot((double)(x - wallX[w]), (double)(y - wallY[w])));
+		return best;
+	};
+	const std::vector<float> serial = LikelihoodField::distanceTransform(*map);
+	const std::vector<float> parallel = LikelihoodField::distanceTransform(*map, &pool);
+	double distanceError = 0.0;
+	for (int y = 0; y <= map->height() + 1; y++)
+	{
+		for (int x = 0; x < map->stride(); x++) distanceError = std::max(distanceError, std::fabs(serial[map->index(x, y)] - nearestWall(x, y)));
+	}
+	check(serial == parallel, "LikelihoodField: distance transform on a pool");
+	checkError(distanceError, 1e-5, "LikelihoodField: distance transform");
+
+	// 8 headings, a diagonal beam, a reading past maxRange that is skipped
+	const int headings = 8;
+	LikelihoodFieldModel model;
+	model.maxRange = 12.0;
+	BeamScan scan;
+	scan.angles = { 0.0, 45.0, 90.0, 180.0, 270.0 };
+	scan.ranges = { 3.0, 2.2, 5.0, 20.0, 1.0 };
+	auto endpointLikelihood = [&](int x, int y)
+	{
+		const bool onMap = x >= 0 && x < map->stride() && y >= 0 && y <= map->height() + 1;
+		const double d = onMap ? nearestWall(x, y) : HUGE_VAL;
+		return model.zHit * std::exp(-d * d / (2.0 * model.sigmaHit * model.sigmaHit)) + model.zRandom / model.maxRange;
+	};
+	for (bool sparse : { false, true })
+	{
+		const std::string name = std::string("LikelihoodField, ") + (sparse ? "sparse" : "dense");
+		Environment env(map, headings);
+		env.setThreadPool(&pool);
+		env.setSparseAllowed(sparse);
+		env.setTracking(true);
+		applyRun(env, randomRun(*map, 60, 26));
+		check(env.isSparse() == sparse, name + ": mode");
+		LikelihoodField field(env, model);
+
+		std::vector<double> expected = probabilities(env, *map, headings);
+		size_t pose = 0;
+		double sum = 0.0;
+		for (int h = 0; h < headings; h++)
+		{
+			const double rad = env.headingAngle(h) * 3.14159265358979323846 / 180.0;
+			for (int y = 1; y <= map->height(); y++)
+			{
+				for (int x = 1; x <= map->width(); x++, pose++)
+				{
+					if (expected[pose] == 0.0) continue;
+					for (size_t b = 0; b < scan.angles.size(); b++)
+					{
+						if (scan.ranges[b] >= model.maxRange) continue;
+						const double a = rad + scan.angles[b] * 3.14159265358979323846 / 180.0;
+						expected[pose] *= endpointLikelihood(x + (int)std::lround(scan.ranges[b] * std::sin(a)), y + (int)std::lround(-scan.ranges[b] * std::cos(a)));
+					}
+					sum += expected[pose];
+				}
+			}
+		}
+		for (double& p : expected) p /= sum;
+		env.normalize(field.apply(scan));
+		checkError(relativeError(probabilities(env, *map, headings), expected), 1e-5, name + ": update"); // float field
+	}
+}
+
+// BeliefHistory: codes round-trip within half a step, every recorded step decodes within the
+// tolerance whatever the seek order, restore and truncate go back to a recorded step, and
+// eviction keeps the newest steps decodable
+static void testBeliefHistory(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(40, 30, 0.25, 7);
+	const int headings = 4;
+	const int tolerance = 16;
+
+	std::mt19937 rng(12);
+	int codeErrors = 0;
+	for (int i = 0; i < 10000; i++)
+	{
+		const double p = std::exp(-40.0 * std::generate_canonical<double, 53>(rng));
+		const double decoded = BeliefHistory::decode(BeliefHistory::encode(p));
+		if (p < BeliefHistory::FLOOR) codeErrors += decoded != 0.0;
+		else codeErrors += std::fabs(std::log(decoded / p)) > 0.5 / BeliefHistory::STEPS_PER_NAT + 1e-12;
+	}
+	check(codeErrors == 0, "BeliefHistory: " + std::to_string(codeErrors) + " codes off by more than half a step");
+
+	Environment env(map, headings);
+	env.setThreadPool(&pool);
+	BeliefHistory history(env, (size_t)64 << 20, tolerance);
+	std::vector<std::vector<double>> recorded;
+	SensorModel sm;
+	MovementModel mm;
+	auto record = [&](const std::string& label)
+	{
+		history.record(env, label);
+		recorded.push_back(probabilities(env, *map, headings));
+	};
+	record("Start");
+	for (const Step& s : randomRun(*map, 3 * BeliefHistory::KEYFRAME_INTERVAL, 13))
+	{
+		if (s.kind == Step::Sense) env.normalize(env.applyFilter(s.f, sm));
+		else if (s.kind == Step::Forward) env.normalize(env.moveForward(mm));
+		else env.normalize(env.applyTurn(s.kind == Step::TurnLeft ? env.quarterTurnBins() : -env.quarterTurnBins(), mm));
+		record(std::to_string(recorded.size()));
+	}
+	check(history.firstStep() == 0 && history.lastStep() == (int)recorded.size() - 1, "BeliefHistory: steps recorded");
+
+	std::vector<int> order(recorded.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::shuffle(order.begin(), order.end(), rng);
+	order.insert(order.end(), { 5, 6, 7, 40, 41 }); // going on from the cursor
+	for (int step : order)
+	{
+		const int mismatches = historyMismatches(history, step, recorded[step], *map, headings, tolerance);
+		check(mismatches == 0, "BeliefHistory: step " + std::to_string(step) + " decodes " + std::to_string(mismatches) + " poses out of tolerance");
+	}
+	check(history.label(0) == "Start" && history.label(9) == "9", "BeliefHistory: labels");
+
+	// restore a step, drop the ones after it and record a new branch from there
+	const int branch = BeliefHistory::KEYFRAME_INTERVAL + 3;
+	history.restore(branch, env);
+	check(historyMismatches(history, branch, probabilities(env, *map, headings), *map, headings, tolerance) == 0, "BeliefHistory: restore");
+	history.truncate(branch);
+	check(history.lastStep() == branch, "BeliefHistory: truncate");
+	recorded.resize(branch + 1);
+	env.normalize(env.moveForward(mm));
+	record("Branch");
+	check(history.lastStep() == branch + 1 && history.label(branch + 1) == "Branch", "BeliefHistory: record after truncate");
+	for (int step = 0; step <= branch + 1; step++)
+	{
+		check(historyMismatches(history, step, recorded[step], *map, headings, tolerance) == 0, "BeliefHistory: step " + std::to_string(step) + " after truncate");
+	}
+
+	// a budget of a few frames: whole keyframe groups are dropped from the front
+	BeliefHistory small(env, 3 * history.bytes() / recorded.size(), tolerance);
+	std::vector<std::vector<double>> kept;
+	for (int step = 0; step < 2 * BeliefHistory::KEYFRAME_INTERVAL; step++)
+	{
+		env.normalize(env.applyTurn(env.quarterTurnBins(), mm));
+		small.record(env);
+		kept.push_back(probabilities(env, *map, headings));
+	}
+	check(small.firstStep() > 0, "BeliefHistory: evicts");
+	for (int step = small.firstStep(); step <= small.lastStep(); step++)
+	{
+		check(historyMismatches(small, step, kept[step], *map, headings, tolerance) == 0, "BeliefHistory: step " + std::to_string(step) + " after eviction");
+	}
+}
+
+// ActiveLocalizer: the expected entropy of every candidate against applying each of the 16
+// readings to a copy of the predicted belief and averaging the posterior entropies, dense and
+// sparse; a spent budget skips every candidate after the first
+static void testActiveLocalizer(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(70, 45, 0.25, 25);
+	const int headings = 8;
+	SensorModel sm;
+	MovementModel mm;
+	const std::vector<std::string> candidates = { "Forward", "Turn left", "Turn right" };
+	for (bool sparse : { false, true })
+	{
+		const std::string name = std::string("ActiveLocalizer, ") + (sparse ? "sparse" : "dense");
+		Environment env(map, headings);
+		env.setThreadPool(&pool);
+		env.setSparseAllowed(sparse);
+		env.setTracking(true);
+		applyRun(env, randomRun(*map, sparse ? 60 : 10, 26));
+		check(env.isSparse() == sparse, name + ": mode");
+
+		ActiveLocalizer localizer(env, sm, mm, candidates);
+		const ActionChoice choice = localizer.choose(1e9);
+		Environment predicted(map, headings), posterior(map, headings);
+		std::string best;
+		double bestEntropy = HUGE_VAL, error = 0.0, readingError = 0.0;
+		for (size_t c = 0; c < candidates.size(); c++)
+		{
+			predicted.assignBelief(env);
+			if (candidates[c] == "Forward") predicted.normalize(predicted.moveForward(mm));
+			else predicted.normalize(predicted.applyTurn(candidates[c] == "Turn left" ? predicted.quarterTurnBins() : -predicted.quarterTurnBins(), mm));
+
+			double expected = 0.0, total = 0.0;
+			for (int o = 0; o < ActiveLocalizer::OUTCOMES; o++)
+			{
+				posterior.assignBelief(predicted);
+				const double prior = posterior.getStats().sum;
+				const double reading = posterior.applyFilter(ActiveLocalizer::reading(o), sm).sum / prior; // P(reading)
+				total += reading;
+				if (reading <= 0.0) continue;
+				posterior.normalize(posterior.getStats());
+				double entropy = 0.0;
+				for (double p : probabilities(posterior, *map, headings)) if (p > 0.0) entropy -= p * std::log(p);
+				expected += reading * entropy;
+			}
+			readingError = std::max(readingError, std::fabs(total - 1.0));
+			error = std::max(error, std::fabs(choice.scores[c].expectedEntropy - expected));
+			check(choice.scores[c].evaluated && choice.scores[c].action == candidates[c], name + ": " + candidates[c] + " evaluated");
+			if (expected < bestEntropy)
+			{
+				bestEntropy = expected;
+				best = candidates[c];
+			}
+		}
+		checkError(readingError, 1e-9, name + ": readings sum to 1");
+		checkError(error, 1e-8, name + ": expected entropy");
+		check(choice.action == best, name + ": chose " + choice.action + ", not " + best);
+
+		const ActionChoice rushed = localizer.choose(0.0);
+		check(rushed.scores[0].evaluated && !rushed.scores[1].evaluated && !rushed.scores[2].evaluated, name + ": budget of 0 ms evaluated past the first candidate");
+		check(rushed.action == candidates[0], name + ": budget of 0 ms chose " + rushed.action);
+	}
+}
+
+// MapArtifact: a compiled map loads back with the same arrays, and every kind of damage the
+// checks are there for is refused with a reason instead of reaching a kernel
+static void testMapArtifact(ThreadPool& pool)
+{
+	std::shared_ptr<const GridMap> map = randomMap(50, 40, 0.3, 17);
+	const std::string path = "tests_artifact.gridmap", damagedPath = "tests_damaged.gridmap";
+	check(MapArtifact::compile(*map, path, &pool), "MapArtifact: compile");
+	std::vector<char> bytes;
+	{
+		std::string error;
+		std::shared_ptr<const GridMap> loaded = MapArtifact::load(path, &error, true);
+		check(loaded != nullptr, "MapArtifact: load " + error);
+		if (!loaded) return;
+		bool same = loaded->width() == map->width() && loaded->height() == map->height() && loaded->emptyCount() == map->emptyCount() &&
+			loaded->distance.size() == map->planeSize();
+		for (size_t k = 0; same && k < map->planeSize(); k++) same = loaded->signatures[k] == map->signatures[k] && loaded->freeIndex[k] == map->freeIndex[k];
+		for (int i = 0; same && i < map->emptyCount(); i++) same = loaded->freeCells[i] == map->freeCells[i];
+		check(same, "MapArtifact: loaded map differs from the compiled one");
+		std::ifstream in(path, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	} // unmapped before the files are removed
+
+	MapArtifactHeader h;
+	memcpy(&h, bytes.data(), sizeof(h));
+	auto at = [&](std::vector<char>& file, MapArtifact::eSection s, size_t offset) { return file.data() + h.sections[s][0] + offset; };
+	const int32_t wall = map->freeIndex[0], huge = 0x7fffffff; // cell 0 is border
+	const uint32_t outside = 0x7fffffff;
+	const uint8_t badSignature = 200;
+	struct Damage { const char* what; std::function<void(std::vector<char>&)> apply; };
+	const Damage damages[] = {
+		{ "flipped magic", [&](std::vector<char>& f) { f[0] ^= 1; } },
+		{ "flipped header byte", [&](std::vector<char>& f) { f[20] ^= 1; } },
+		{ "truncated file", [&](std::vector<char>& f) { f.pop_back(); } },
+		{ "free cell out of range", [&](std::vector<char>& f) { memcpy(at(f, MapArtifact::FreeCells, 0), &outside, sizeof(outside)); } },
+		{ "wall with a free index", [&](std::vector<char>& f) { int32_t zero = 0; memcpy(at(f, MapArtifact::FreeIndex, 0), &zero, sizeof(zero)); } },
+		{ "free index out of range", [&](std::vector<char>& f) { memcpy(at(f, MapArtifact::FreeIndex, map->freeCells[0] * sizeof(int32_t)), &huge, sizeof(huge)); } },
+		{ "signature out of range", [&](std::vector<char>& f) { *at(f, MapArtifact::Signatures, map->freeCells[0]) = (char)badSignature; } },
+	};
+	check(wall < 0, "MapArtifact: cell 0 is a wall");
+	auto loadDamaged = [&](const std::vector<char>& file, bool verify, std::string& error)
+	{
+		{
+			std::ofstream out(damagedPath, std::ios::binary | std::ios::trunc);
+			out.write(file.data(), (std::streamsize)file.size());
+		}
+		error.clear();
+		return MapArtifact::load(damagedPath, &error, verify) != nullptr;
+	};
+	for (const Damage& d : damages)
+	{
+		std::vector<char> file = bytes;
+		d.apply(file);
+		std::string error;
+		check(!loadDamaged(file, false, error) && !error.empty(), std::string("MapArtifact: accepted ") + d.what);
+	}
+
+	// the distance section is not checked cell by cell, only by the content hash
+	std::vector<char> file = bytes;
+	*at(file, MapArtifact::Distance, 0) ^= 1;
+	std::string error;
+	check(loadDamaged(file, false, error), "MapArtifact: plain load refused a content change " + error);
+	check(!loadDamaged(file, true, error) && !error.empty(), "MapArtifact: verified load accepted a content change");
+
+	error.clear();
+	check(!MapArtifact::load("tests_missing.gridmap", &error) && !error.empty(), "MapArtifact: loaded a missing file");
+
+	// a source without free cells is refused and nothing is compiled
+	const std::string wallsPath = "tests_walls.txt";
+	writeTextMap(*GridMap::build(8, 6, [](int, int) { return false; }), wallsPath);
+	error.clear();
+	check(!MapArtifact::open(wallsPath, &pool, &error) && !error.empty(), "MapArtifact: opened a map without free cells");
+	check(!std::ifstream(wallsPath + ".gridmap").is_open(), "MapArtifact: compiled a map without free cells");
+
+	std::remove(path.c_str());
+	std::remove(damagedPath.c_str());
+	std::remove(wallsPath.c_str());
+}
+
+int main()
+{
+	ThreadPool pool(4); // parallel kernels even on a single core
+	testEnvironment(pool);
+	testBeliefPredictor(pool);
+	testCompactBelief<LogFloat32Codec>(pool, "LogFloat32", 1e-5);
+	testCompactBelief<Quantized16Codec>(pool, "Quantized16", 2e-3);
+	testMultiResolution(pool);
+	testHybridLocalizer(pool);
+	testFreeCellBelief(pool);
+	testTiledBelief(pool);
+	testOutOfCoreBelief(pool);
+	testRobotBatch(pool);
+	testRangeSensor(pool);
+	testLikelihoodField(pool);
+	testBeliefHistory(pool);
+	testActiveLocalizer(pool);
+	testMapArtifact(pool);
+	printf("%d failed\n", failures);
+	return failures;
+}